@@ -0,0 +1,354 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "open_evse.h"
+
+#ifdef DUOSHARE
+#include <util/crc16.h>
+extern "C" {
+#include "./twi.h"
+}
+
+DuoShare g_DuoShare;
+
+#ifndef RAPI_I2C
+// w/ RAPI_I2C, i2cRapiRxEvent() passes our packets to rxIsr()
+static void duoRxEvent(uint8_t *data,int cnt)
+{
+  g_DuoShare.rxIsr(data,cnt);
+}
+#endif // !RAPI_I2C
+
+uint8_t DuoShare::calcCrc(const DUO_PKT *pkt)
+{
+  uint8_t crc = 0;
+  for (uint8_t i=0;i < sizeof(DUO_PKT)-1;i++) {
+    crc = _crc8_ccitt_update(crc,((const uint8_t *)pkt)[i]);
+  }
+  return crc;
+}
+
+void DuoShare::Init()
+{
+  memset(m_Nodes,0,sizeof(m_Nodes));
+  memset((void *)m_RxFull,0,sizeof(m_RxFull));
+
+  m_Nodes[0].addr = EeReadByte(EOFS_LOCAL_I2C_ADDR);
+  m_GroupAmps = EeReadByte(EOFS_GROUP_CURRENT_CAPACITY);
+  m_FallbackAmps = EeReadByte(EOFS_DUO_SHARED_AMPS);
+  if ((EeReadByte(EOFS_DUO_NVFLAGS) & DUONV_DISABLED) ||
+      !m_Nodes[0].addr || (m_Nodes[0].addr > 0x7f) ||
+      (m_GroupAmps < MIN_CURRENT_CAPACITY_J1772)) {
+    m_GroupAmps = 0;
+  }
+  if (m_FallbackAmps > m_GroupAmps) {
+    m_FallbackAmps = m_GroupAmps / 2; // unset - assume 2 EVSEs
+  }
+  if (m_FallbackAmps < MIN_CURRENT_CAPACITY_J1772) {
+    m_FallbackAmps = MIN_CURRENT_CAPACITY_J1772;
+  }
+
+  if (m_GroupAmps) {
+#ifndef RAPI_I2C
+    // we only need to receive broadcasts
+    twi_setAddress(0);
+    twi_attachSlaveRxEvent(duoRxEvent);
+#endif // !RAPI_I2C
+    TWAR |= _BV(TWGCE); // respond to the general call address
+  }
+  else {
+    TWAR &= ~_BV(TWGCE);
+    g_EvseController.SetShareDa(0);
+    if (m_Paused) {
+      m_Paused = 0;
+      if (g_EvseController.GetState() == EVSE_STATE_SLEEPING) {
+	g_EvseController.Enable();
+      }
+    }
+  }
+  m_TxMs = millis() - DUO_TX_INTERVAL_MS;
+}
+
+// groupamps: 0 = disable
+void DuoShare::Reconfigure(uint8_t groupamps,uint8_t fallbackamps,uint8_t addr)
+{
+  if (groupamps) {
+    EeWriteByte(EOFS_GROUP_CURRENT_CAPACITY,groupamps);
+    EeWriteByte(EOFS_DUO_SHARED_AMPS,fallbackamps);
+    EeWriteByte(EOFS_LOCAL_I2C_ADDR,addr);
+    EeWriteByte(EOFS_DUO_NVFLAGS,(uint8_t)~DUONV_DISABLED);
+  }
+  else {
+    EeWriteByte(EOFS_DUO_NVFLAGS,0xff);
+  }
+  Init();
+}
+
+// TWI ISR - returns 1 if the data was a DUO_PKT
+uint8_t DuoShare::rxIsr(const uint8_t *data,int cnt)
+{
+  if ((cnt != sizeof(DUO_PKT)) || (data[0] != DUO_MAGIC)) return 0;
+  for (uint8_t i=0;i < DUO_RX_SLOTS;i++) {
+    if (!m_RxFull[i]) {
+      memcpy((void *)m_RxBuf[i],data,sizeof(DUO_PKT));
+      m_RxFull[i] = 1;
+      break;
+    }
+  }
+  return 1; // n.b. dropped if no free slot - the peer will send it again
+}
+
+void DuoShare::rxPkt()
+{
+  for (uint8_t s=0;s < DUO_RX_SLOTS;s++) {
+    if (!m_RxFull[s]) continue;
+    DUO_PKT pkt;
+    memcpy(&pkt,(const void *)m_RxBuf[s],sizeof(pkt));
+    m_RxFull[s] = 0;
+
+    if ((pkt.crc != calcCrc(&pkt)) || !pkt.addr ||
+	(pkt.addr == m_Nodes[0].addr)) continue;
+
+    DUO_NODE *node = NULL;
+    for (uint8_t i=1;i < DUO_MAX_NODES;i++) {
+      if (m_Nodes[i].addr == pkt.addr) {
+	node = &m_Nodes[i];
+	break;
+      }
+      else if (!node && !m_Nodes[i].addr) {
+	node = &m_Nodes[i];
+      }
+    }
+    if (!node) continue; // table full
+
+    node->addr = pkt.addr;
+    node->flags = pkt.flags;
+    node->groupAmps = pkt.groupAmps;
+    node->demandDa = pkt.demandDa;
+    node->limitDa = pkt.limitDa;
+    node->measDa = pkt.measDa;
+    node->rxMs = millis();
+  }
+}
+
+// figure out what this EVSE wants
+void DuoShare::updateSelf()
+{
+  DUO_NODE *self = &m_Nodes[0];
+  uint8_t state = g_EvseController.GetState();
+
+#ifdef AMMETER
+  int32_t ma = g_EvseController.GetChargingCurrent();
+  self->measDa = ((state == EVSE_STATE_C) && (ma > 0)) ? ma / 100 : 0;
+#endif
+
+  if (m_Paused && !g_EvseController.EvConnected()) {
+    // unplugged while waiting for a share
+    m_Paused = 0;
+    g_EvseController.Enable();
+  }
+
+  uint8_t flags = 0;
+  uint16_t demand = 0;
+  if (state == EVSE_STATE_C) {
+    flags = DUOF_CONNECTED|DUOF_CHARGING;
+    demand = g_EvseController.GetCurrentCapacityDa();
+    // once the EV has had time to ramp up, if it's drawing well under its
+    // share, only ask for a little more than it draws. it's no longer
+    // tapered once it draws within DUO_TAPER_DA/2 of its share
+    if (g_EvseController.GetElapsedChargeTime() >= DUO_RAMP_SECS) {
+      uint16_t thresh = (self->flags & DUOF_TAPERED) ? DUO_TAPER_DA/2 : DUO_TAPER_DA;
+      if (self->measDa + thresh < self->limitDa) {
+	flags |= DUOF_TAPERED;
+	if (self->measDa + DUO_TAPER_DA < demand) {
+	  demand = self->measDa + DUO_TAPER_DA;
+	}
+      }
+    }
+  }
+  else if ((state == EVSE_STATE_B) || m_Paused) {
+    // only need the minimum until the EV starts charging
+    flags = DUOF_CONNECTED;
+    demand = MIN_CURRENT_CAPACITY_J1772*10;
+  }
+  if (demand && (demand < MIN_CURRENT_CAPACITY_J1772*10)) {
+    demand = MIN_CURRENT_CAPACITY_J1772*10;
+  }
+  self->flags = flags;
+  self->demandDa = demand;
+}
+
+// n.b. sorts the first cnt entries of idx
+// bydemand = 0: charging first, then by address
+// bydemand = 1: smallest demand first, then by address
+static void sortNodes(const DUO_NODE *nodes,uint8_t *idx,uint8_t cnt,uint8_t bydemand)
+{
+  for (uint8_t i=1;i < cnt;i++) {
+    for (uint8_t j=i;j > 0;j--) {
+      const DUO_NODE *a = &nodes[idx[j-1]];
+      const DUO_NODE *b = &nodes[idx[j]];
+      int16_t d;
+      // d > 0: a goes first
+      if (bydemand) d = (int16_t)b->demandDa - (int16_t)a->demandDa;
+      else d = (int16_t)(a->flags & DUOF_CHARGING) - (int16_t)(b->flags & DUOF_CHARGING);
+      if ((d > 0) || ((d == 0) && (a->addr < b->addr))) break;
+      uint8_t t = idx[j-1];
+      idx[j-1] = idx[j];
+      idx[j] = t;
+    }
+  }
+}
+
+// returns this EVSE's share in 0.1A, 0 = none
+uint16_t DuoShare::allocate()
+{
+  unsigned long curms = millis();
+  uint8_t groupamps = m_GroupAmps;
+  uint8_t idx[DUO_MAX_NODES];
+  uint8_t cnt = 0;
+  uint8_t peercnt = 0;
+  int16_t peerda = 0; // advertised or drawn by the peers
+  for (uint8_t i=0;i < DUO_MAX_NODES;i++) {
+    DUO_NODE *node = &m_Nodes[i];
+    if (!node->addr) continue;
+    if (i) {
+      if ((curms - node->rxMs) >= DUO_TIMEOUT_MS) {
+	node->addr = 0; // gone
+	continue;
+      }
+      peercnt++;
+      if (node->groupAmps < groupamps) groupamps = node->groupAmps;
+      peerda += (node->limitDa > node->measDa) ? node->limitDa : node->measDa;
+    }
+    if (node->demandDa) idx[cnt++] = i;
+  }
+
+  uint16_t share = 0;
+  if (!peercnt) {
+    share = m_FallbackAmps*10;
+  }
+  else {
+    // admit only as many EVSEs as can get the minimum
+    sortNodes(m_Nodes,idx,cnt,0);
+    if (cnt > groupamps / MIN_CURRENT_CAPACITY_J1772) {
+      cnt = groupamps / MIN_CURRENT_CAPACITY_J1772;
+    }
+    // max-min fair share
+    sortNodes(m_Nodes,idx,cnt,1);
+    uint16_t budget = groupamps*10;
+    for (uint8_t i=0;i < cnt;i++) {
+      uint16_t da = budget / (cnt - i);
+      if (m_Nodes[idx[i]].demandDa < da) da = m_Nodes[idx[i]].demandDa;
+      if (idx[i] == 0) {
+	share = da;
+	break;
+      }
+      budget -= da;
+    }
+    int16_t room = groupamps*10 - peerda;
+    if ((int16_t)share > room) share = (room > 0) ? room : 0;
+  }
+  if (share > m_Nodes[0].demandDa) share = m_Nodes[0].demandDa;
+  if (share < MIN_CURRENT_CAPACITY_J1772*10) share = 0;
+  return share;
+}
+
+void DuoShare::apply(uint16_t da)
+{
+  DUO_NODE *self = &m_Nodes[0];
+  if (!self->demandDa) {
+    // not connected - a newly connected EV starts out w/ the minimum
+    self->limitDa = 0;
+    g_EvseController.SetShareDa(MIN_CURRENT_CAPACITY_J1772*10);
+    return;
+  }
+
+  uint8_t state = g_EvseController.GetState();
+  if (!da) {
+    self->limitDa = 0;
+    if (!m_Paused && ((state == EVSE_STATE_B) || (state == EVSE_STATE_C))) {
+      m_Paused = 1;
+      g_EvseController.Sleep();
+    }
+  }
+  else {
+    self->limitDa = da;
+    g_EvseController.SetShareDa(da);
+    if (m_Paused) {
+      m_Paused = 0;
+      if (state == EVSE_STATE_SLEEPING) {
+	g_EvseController.Enable();
+      }
+    }
+  }
+}
+
+void DuoShare::transmit()
+{
+  DUO_NODE *self = &m_Nodes[0];
+  DUO_PKT pkt;
+  pkt.magic = DUO_MAGIC;
+  pkt.addr = self->addr;
+  pkt.flags = self->flags;
+  pkt.groupAmps = m_GroupAmps;
+  pkt.demandDa = self->demandDa;
+  pkt.limitDa = self->limitDa;
+  pkt.measDa = self->measDa;
+  pkt.crc = calcCrc(&pkt);
+
+  // n.b. if we lose arbitration, it goes out next time
+  Wire.beginTransmission(0); // general call
+  Wire.write((const uint8_t *)&pkt,sizeof(pkt));
+  Wire.endTransmission();
+  m_TxMs = millis();
+}
+
+// call from ProcessInputs()
+void DuoShare::Service()
+{
+  if (!m_GroupAmps) return;
+
+  DUO_NODE *self = &m_Nodes[0];
+  uint8_t flags = self->flags;
+  uint16_t demand = self->demandDa;
+  uint16_t limit = self->limitDa;
+
+  rxPkt();
+  updateSelf();
+  apply(allocate());
+
+  if ((self->flags != flags) || (self->demandDa != demand) ||
+      (self->limitDa != limit) ||
+      ((millis() - m_TxMs) >= DUO_TX_INTERVAL_MS)) {
+    transmit();
+  }
+}
+
+uint8_t DuoShare::GetPeerCnt()
+{
+  uint8_t cnt = 0;
+  for (uint8_t i=1;i < DUO_MAX_NODES;i++) {
+    if (m_Nodes[i].addr) cnt++;
+  }
+  return cnt;
+}
+
+#endif // DUOSHARE
@@ -0,0 +1,100 @@
+// -*- C++ -*-
+#pragma once
+
+#ifdef DUOSHARE
+//
+// share one circuit (EOFS_GROUP_CURRENT_CAPACITY) between up to
+// DUO_MAX_NODES EVSEs.
+// there's no master. every DUO_TX_INTERVAL_MS, and whenever its state
+// changes, each EVSE broadcasts a DUO_PKT to the I2C general call address.
+// every EVSE keeps a table of what it has heard, and runs the same
+// allocation on it:
+//  - EVSEs which can't get MIN_CURRENT_CAPACITY_J1772 are paused, charging
+//    ones last, then by address
+//  - the rest get a max-min fair share of the group capacity, i.e. no EVSE
+//    gets more than it asks for, and what one doesn't use is split among
+//    the others
+// an EVSE asks for MIN_CURRENT_CAPACITY_J1772 while waiting in State B, its
+// current capacity in State C, and only a little more than it draws once
+// its EV has tapered, so the rest is handed to the others right away.
+// tables can briefly differ, so an EVSE never advertises more than the group
+// capacity minus what its peers last reported advertising or drawing:
+// decreases take effect at once, and increases wait for the peers to report
+// that they've made room.
+// an EVSE that hears no peers at all falls back to EOFS_DUO_SHARED_AMPS,
+// the static split
+//
+#define DUO_MAX_NODES 4
+#ifndef DUO_TX_INTERVAL_MS
+#define DUO_TX_INTERVAL_MS 500UL
+#endif
+#define DUO_TIMEOUT_MS (4*DUO_TX_INTERVAL_MS) // peer dropped if not heard
+#define DUO_RAMP_SECS 15 // time an EV gets to ramp up before it can taper
+#define DUO_TAPER_DA 20 // tapered: drawing this much under its share
+#define DUO_MAGIC 0xd5 // not ASCII, so it can't be mistaken for RAPI
+#define DUO_RX_SLOTS (DUO_MAX_NODES-1)
+
+// DUO_PKT.flags / DUO_NODE.flags
+#define DUOF_CONNECTED 0x01 // EV connected, wants to charge
+#define DUOF_CHARGING  0x02 // State C
+#define DUOF_TAPERED   0x04 // EV drawing less than its share
+
+typedef struct duo_pkt {
+  uint8_t magic; // DUO_MAGIC
+  uint8_t addr; // sender's node address (EOFS_LOCAL_I2C_ADDR), not its I2C address
+  uint8_t flags; // DUOF_xxx
+  uint8_t groupAmps; // sender's group capacity
+  uint16_t demandDa; // current wanted, 0.1A
+  uint16_t limitDa; // current advertised, 0.1A
+  uint16_t measDa; // current measured, 0.1A
+  uint8_t crc; // CRC8 of all preceding bytes
+} __attribute__((packed)) DUO_PKT;
+
+typedef struct duo_node {
+  uint8_t addr; // 0 = free slot
+  uint8_t flags;
+  uint8_t groupAmps;
+  uint16_t demandDa;
+  uint16_t limitDa;
+  uint16_t measDa;
+  unsigned long rxMs; // when last heard
+} DUO_NODE;
+
+// EOFS_DUO_NVFLAGS
+#define DUONV_DISABLED 0x01
+
+class DuoShare {
+  DUO_NODE m_Nodes[DUO_MAX_NODES]; // [0] is this EVSE
+  // filled by the TWI ISR
+  volatile uint8_t m_RxBuf[DUO_RX_SLOTS][sizeof(DUO_PKT)];
+  volatile uint8_t m_RxFull[DUO_RX_SLOTS];
+  uint8_t m_GroupAmps; // 0 = disabled
+  uint8_t m_FallbackAmps;
+  uint8_t m_Paused; // we put the EVSE to sleep
+  unsigned long m_TxMs;
+
+  static uint8_t calcCrc(const DUO_PKT *pkt);
+  void rxPkt();
+  void updateSelf();
+  uint16_t allocate();
+  void apply(uint16_t da);
+  void transmit();
+
+public:
+  DuoShare() { m_GroupAmps = 0; m_Paused = 0; }
+  void Init();
+  void Service();
+  void Reconfigure(uint8_t groupamps,uint8_t fallbackamps,uint8_t addr);
+  uint8_t IsEnabled() { return m_GroupAmps ? 1 : 0; }
+  uint8_t GetGroupAmps() { return m_GroupAmps; }
+  uint8_t GetFallbackAmps() { return m_FallbackAmps; }
+  uint8_t GetAddr() { return m_Nodes[0].addr; }
+  uint8_t GetPeerCnt();
+  uint16_t GetLimitDa() { return m_Nodes[0].limitDa; }
+
+  // called from TWI ISR
+  uint8_t rxIsr(const uint8_t *data,int cnt);
+};
+
+extern DuoShare g_DuoShare;
+#endif // DUOSHARE
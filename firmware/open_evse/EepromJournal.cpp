@@ -0,0 +1,107 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "open_evse.h"
+
+#ifdef EEPROM_JOURNAL
+#include <util/crc16.h>
+
+EepromJournal g_EeJournal;
+
+uint8_t *EepromJournal::slotAddr(uint8_t slot)
+{
+  return (uint8_t *)(EOFS_JOURNAL + slot*EEJ_REC_SIZE);
+}
+
+uint8_t EepromJournal::calcCrc(const EE_JOURNAL_REC *rec)
+{
+  const uint8_t *p = (const uint8_t *)rec;
+  uint8_t crc = 0;
+  for (uint8_t i=0;i < EEJ_REC_SIZE-1;i++) {
+    crc = _crc8_ccitt_update(crc,p[i]);
+  }
+  return crc;
+}
+
+// must be called before anyone reads the journalled values
+void EepromJournal::Init()
+{
+  uint8_t found = 0;
+  for (uint8_t slot=0;slot < EEJ_SLOT_CNT;slot++) {
+    eeprom_read_block(&m_WrRec,slotAddr(slot),EEJ_REC_SIZE);
+    // n.b. an erased slot has a bad CRC
+    if (calcCrc(&m_WrRec) == m_WrRec.crc) {
+      if (!found || ((int8_t)(m_WrRec.seq - m_Rec.seq) > 0)) {
+	memcpy(&m_Rec,&m_WrRec,EEJ_REC_SIZE);
+	m_Slot = slot;
+	found = 1;
+      }
+    }
+  }
+
+  if (!found) {
+    // empty journal - migrate values from their legacy locations
+    m_Rec.seq = 0;
+    m_Rec.whTot = eeprom_read_dword((uint32_t*)EOFS_KWH_ACCUMULATED);
+    if (m_Rec.whTot == 0xffffffff) m_Rec.whTot = 0;
+    eeprom_read_block(m_Rec.tripCnt,(void *)EOFS_GFI_TRIP_CNT,TRIPCNT_CNT);
+    m_Slot = EEJ_SLOT_CNT-1;
+    setDirty();
+  }
+}
+
+void EepromJournal::startWrite()
+{
+  if (++m_Slot == EEJ_SLOT_CNT) m_Slot = 0;
+  m_Rec.seq++;
+  m_Rec.crc = calcCrc(&m_Rec);
+  memcpy(&m_WrRec,&m_Rec,EEJ_REC_SIZE);
+  m_WrIdx = 0;
+  m_bFlags = EEJF_WRITING;
+}
+
+// call from loop(). writes at most one byte, and only if the EEPROM
+// isn't busy, so it never blocks. changes made while a record is being
+// written are coalesced into the next record
+void EepromJournal::Service()
+{
+  if (!(m_bFlags & EEJF_WRITING)) {
+    if (!(m_bFlags & EEJF_DIRTY)) return;
+    startWrite();
+  }
+
+  if (eeprom_is_ready()) {
+    eeprom_update_byte(slotAddr(m_Slot)+m_WrIdx,((uint8_t *)&m_WrRec)[m_WrIdx]);
+    if (++m_WrIdx == EEJ_REC_SIZE) {
+      m_bFlags &= ~EEJF_WRITING;
+    }
+  }
+}
+
+// blocking - finish all pending writes, e.g. before a reboot
+void EepromJournal::Flush()
+{
+  while (!IsIdle()) {
+    Service();
+  }
+}
+
+#endif // EEPROM_JOURNAL
@@ -0,0 +1,57 @@
+// -*- C++ -*-
+#pragma once
+
+#ifdef EEPROM_JOURNAL
+//
+// wear-levelled store for the values that get rewritten over and over:
+// lifetime Wh and the fault trip counters.
+// each write appends a complete snapshot record to the next slot of a ring
+// in EOFS_JOURNAL, so every cell is written only once per EEJ_SLOT_CNT
+// updates. on boot, the newest record with a good CRC wins, so a write torn
+// by a power failure just falls back to the previous record.
+// the record is written a byte at a time from Service(), which never
+// waits on the EEPROM, so there's no 3.3ms/byte stall in the caller.
+//
+typedef struct ee_journal_rec {
+  uint8_t seq; // incremented w/ each record, wraps
+  uint32_t whTot; // EnergyMeter lifetime Wh
+  // trip counters are stored raw, w/ the same encoding as the legacy
+  // EOFS_xxx_TRIP_CNT bytes (0xff = 0 trips)
+  uint8_t tripCnt[TRIPCNT_CNT]; // TRIPCNT_xxx
+  uint8_t crc; // CRC8 of all preceding bytes
+} EE_JOURNAL_REC;
+
+#define EEJ_SLOT_CNT 16
+#define EEJ_REC_SIZE ((uint8_t)sizeof(EE_JOURNAL_REC))
+
+// m_bFlags
+#define EEJF_DIRTY   0x01 // m_Rec has changes not yet written
+#define EEJF_WRITING 0x02 // m_WrRec is being written
+
+class EepromJournal {
+  EE_JOURNAL_REC m_Rec; // current values
+  EE_JOURNAL_REC m_WrRec; // snapshot being written
+  uint8_t m_Slot; // slot of newest record
+  uint8_t m_WrIdx; // next byte of m_WrRec to write
+  uint8_t m_bFlags;
+
+  uint8_t *slotAddr(uint8_t slot);
+  static uint8_t calcCrc(const EE_JOURNAL_REC *rec);
+  void setDirty() { m_bFlags |= EEJF_DIRTY; }
+  void startWrite();
+
+public:
+  EepromJournal() { m_bFlags = 0; }
+  void Init();
+  void Service();
+  void Flush();
+  uint8_t IsIdle() { return !(m_bFlags & (EEJF_DIRTY|EEJF_WRITING)); }
+
+  uint32_t GetWhTot() { return m_Rec.whTot; }
+  void SetWhTot(uint32_t wh) { m_Rec.whTot = wh; setDirty(); }
+  uint8_t GetTripCnt(uint8_t which) { return m_Rec.tripCnt[which]; }
+  void SetTripCnt(uint8_t which,uint8_t cnt) { m_Rec.tripCnt[which] = cnt; setDirty(); }
+};
+
+extern EepromJournal g_EeJournal;
+#endif // EEPROM_JOURNAL
@@ -0,0 +1,185 @@
+// -*- C++ -*-
+/*
+ * Open EVSE Firmware
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "open_evse.h"
+
+#ifdef SETTINGS_CACHE
+#include <util/crc16.h>
+
+#ifdef EEPROM_JOURNAL
+// legacy bytes owned by EepromJournal - not cached
+#define EES_HOLE_START EOFS_KWH_ACCUMULATED
+#define EES_HOLE_END EOFS_VOLT_OFFSET
+#define EES_HOLE_LEN (EES_HOLE_END-EES_HOLE_START)
+#else
+#define EES_HOLE_LEN 0
+#endif
+
+static_assert(sizeof(EE_SETTINGS)+EES_HOLE_LEN == EES_SIZE,"EE_SETTINGS doesn't match EOFS_xxx");
+
+EepromSettings g_EeSettings;
+
+uint8_t EepromSettings::cached(uint16_t ofs)
+{
+#ifdef EEPROM_JOURNAL
+  if ((ofs >= EES_HOLE_START) && (ofs < EES_HOLE_END)) return 0;
+#endif
+  return ofs < EES_SIZE;
+}
+
+// ofs: EOFS_xxx of a cached byte
+uint8_t *EepromSettings::ptr(uint16_t ofs)
+{
+#ifdef EEPROM_JOURNAL
+  if (ofs >= EES_HOLE_END) ofs -= EES_HOLE_LEN;
+#endif
+  return ((uint8_t *)&m_Settings) + ofs;
+}
+
+uint8_t EepromSettings::calcCrc()
+{
+  uint8_t crc = 0;
+  for (uint8_t i=0;i < EES_SIZE-1;i++) {
+    crc = _crc8_ccitt_update(crc,cached(i) ? *ptr(i) : eeprom_read_byte((uint8_t *)(uintptr_t)i));
+  }
+  return crc;
+}
+
+// must be called before anyone reads settings
+void EepromSettings::Init()
+{
+#ifdef EEPROM_JOURNAL
+  eeprom_read_block(&m_Settings,(void *)0,EES_HOLE_START);
+  eeprom_read_block(ptr(EES_HOLE_END),(void *)EES_HOLE_END,EES_SIZE-EES_HOLE_END);
+#else
+  eeprom_read_block(&m_Settings,(void *)0,EES_SIZE);
+#endif
+  if (calcCrc() != m_Settings.crc) {
+    if (m_Settings.crc != 0xff) {
+      // corrupt. every setting treats an erased value as unset
+      memset(&m_Settings,0xff,sizeof(m_Settings));
+    }
+    // else unsealed - keep the raw values
+    m_bFlags = EESF_DIRTY|EESF_COMMIT;
+  }
+}
+
+// like eeprom_update_byte(), but counts physical writes
+void EepromSettings::update(uint16_t ofs,uint8_t b)
+{
+  uint8_t *addr = (uint8_t *)(uintptr_t)ofs;
+  if (eeprom_read_byte(addr) != b) {
+    eeprom_write_byte(addr,b);
+    m_WrCnt++;
+  }
+}
+
+// call from ProcessInputs(). writes at most one byte, and only if the
+// EEPROM isn't busy
+void EepromSettings::Service()
+{
+  if (!m_bFlags || !eeprom_is_ready()) return;
+
+  if (m_bFlags & EESF_DIRTY) {
+    if (!(m_bFlags & EESF_COMMIT) &&
+	((millis() - m_LastChangeMs) < EES_QUIET_MS)) return;
+
+    // (re)start from the top. unseal before touching the block. if changed
+    // mid write-back, it's still unsealed, and unchanged bytes are skipped
+    // by update()
+    if (!(m_bFlags & EESF_WRITING)) {
+      update(EOFS_SETTINGS_CRC,0xff);
+    }
+    m_bFlags = EESF_WRITING;
+    m_WrIdx = 0;
+    return;
+  }
+
+  if (m_WrIdx == EOFS_SETTINGS_CRC) {
+    m_Settings.crc = calcCrc();
+  }
+  update(m_WrIdx,*ptr(m_WrIdx));
+  if (++m_WrIdx == EES_SIZE) {
+    m_bFlags = 0;
+  }
+#ifdef EEPROM_JOURNAL
+  else if (m_WrIdx == EES_HOLE_START) {
+    m_WrIdx = EES_HOLE_END;
+  }
+#endif
+}
+
+// blocking - finish all pending writes, e.g. before a reboot
+void EepromSettings::Flush()
+{
+  Commit();
+  while (!IsIdle()) {
+    Service();
+  }
+}
+
+uint8_t EepromSettings::ReadByte(uint16_t ofs)
+{
+  if (cached(ofs)) return *ptr(ofs);
+  else return eeprom_read_byte((uint8_t *)(uintptr_t)ofs);
+}
+
+uint16_t EepromSettings::ReadWord(uint16_t ofs)
+{
+  if (cached(ofs)) {
+    uint16_t w;
+    memcpy(&w,ptr(ofs),2);
+    return w;
+  }
+  else return eeprom_read_word((uint16_t *)(uintptr_t)ofs);
+}
+
+uint32_t EepromSettings::ReadDword(uint16_t ofs)
+{
+  if (cached(ofs)) {
+    uint32_t dw;
+    memcpy(&dw,ptr(ofs),4);
+    return dw;
+  }
+  else return eeprom_read_dword((uint32_t *)(uintptr_t)ofs);
+}
+
+// only marks the block dirty if the value actually changed
+void EepromSettings::write(uint16_t ofs,const void *src,uint8_t len)
+{
+  if (cached(ofs)) {
+    if (memcmp(ptr(ofs),src,len)) {
+      memcpy(ptr(ofs),src,len);
+      m_bFlags |= EESF_DIRTY;
+      m_LastChangeMs = millis();
+      m_ChgCnt++;
+    }
+  }
+  else {
+    // not cached - written immediately
+    m_ChgCnt++;
+    for (uint8_t i=0;i < len;i++) {
+      update(ofs+i,((const uint8_t *)src)[i]);
+    }
+  }
+}
+
+#endif // SETTINGS_CACHE
@@ -0,0 +1,116 @@
+// -*- C++ -*-
+#pragma once
+
+#ifdef SETTINGS_CACHE
+//
+// RAM copy of the settings block at the start of the EEPROM
+// (EOFS_CURRENT_CAPACITY_L1..EOFS_SETTINGS_CRC).
+// Init() reads the whole block once at boot, after which settings reads
+// never touch the EEPROM. writes go to RAM and are written back a byte at a
+// time from Service(), like EepromJournal.
+// the write-back is deferred until there have been no changes for
+// EES_QUIET_MS, or until Commit(), so a setting that's changed over and over
+// (e.g. $SC from a load manager) only costs one physical write.
+// the last byte is a CRC8 of the block. the CRC byte is erased before a
+// write-back begins, so an interrupted write-back (or a block written by
+// firmware predating the cache) reads back as unsealed, and the raw values
+// are kept, as before. a sealed block w/ a bad CRC is corrupt, and all
+// settings revert to their defaults
+// w/ EEPROM_JOURNAL, the legacy kWh/trip count bytes (EOFS_KWH_ACCUMULATED..
+// EOFS_VOLT_OFFSET-1) aren't cached - they're only read once, to migrate
+// into the journal. they're still covered by the CRC, read from the EEPROM
+//
+typedef struct ee_settings {
+  uint8_t currentCapacityL1; // EOFS_CURRENT_CAPACITY_L1
+  uint8_t currentCapacityL2; // EOFS_CURRENT_CAPACITY_L2
+  uint16_t flags; // EOFS_FLAGS
+  uint8_t timerFlags; // EOFS_TIMER_FLAGS
+  uint8_t timerStartHour; // EOFS_TIMER_START_HOUR
+  uint8_t timerStartMin; // EOFS_TIMER_START_MIN
+  uint8_t timerStopHour; // EOFS_TIMER_STOP_HOUR
+  uint8_t timerStopMin; // EOFS_TIMER_STOP_MIN
+  int16_t currentScaleFactor; // EOFS_CURRENT_SCALE_FACTOR
+  int16_t ammeterCurrOffset; // EOFS_AMMETER_CURR_OFFSET
+#ifndef EEPROM_JOURNAL
+  uint32_t kwhAccumulated; // EOFS_KWH_ACCUMULATED
+  uint8_t gfiTripCnt; // EOFS_GFI_TRIP_CNT
+  uint8_t noGndTripCnt; // EOFS_NOGND_TRIP_CNT
+  uint8_t stuckRelayTripCnt; // EOFS_STUCK_RELAY_TRIP_CNT
+#endif // !EEPROM_JOURNAL
+
+  uint32_t voltOffset; // EOFS_VOLT_OFFSET
+  uint16_t voltScaleFactor; // EOFS_VOLT_SCALE_FACTOR
+  uint16_t threshAmbient; // EOFS_THRESH_AMBIENT
+  uint16_t threshIr; // EOFS_THRESH_IR
+  uint8_t localI2cAddr; // EOFS_LOCAL_I2C_ADDR
+  uint8_t groupCurrentCapacity; // EOFS_GROUP_CURRENT_CAPACITY
+  uint8_t duoNvFlags; // EOFS_DUO_NVFLAGS
+  uint8_t duoSharedAmps; // EOFS_DUO_SHARED_AMPS
+  uint16_t hsInterval; // EOFS_HEARTBEAT_SUPERVISION_INTERVAL
+  uint8_t hsCurrent; // EOFS_HEARTBEAT_SUPERVISION_CURRENT
+  uint8_t relayCloseMs; // EOFS_RELAY_CLOSE_MS
+  uint8_t relayHoldPwm; // EOFS_RELAY_HOLD_PWM
+  uint8_t crc; // EOFS_SETTINGS_CRC - CRC8 of all preceding bytes
+} __attribute__((packed)) EE_SETTINGS;
+
+// bytes of EEPROM covered by the block
+#define EES_SIZE (EOFS_SETTINGS_CRC+1)
+
+#ifndef EES_QUIET_MS
+#define EES_QUIET_MS 10000UL
+#endif
+
+// m_bFlags
+#define EESF_DIRTY   0x01 // m_Settings has changes not yet written
+#define EESF_WRITING 0x02 // write-back in progress
+#define EESF_COMMIT  0x04 // write back now, w/o waiting for EES_QUIET_MS
+
+class EepromSettings {
+  EE_SETTINGS m_Settings;
+  uint8_t m_WrIdx; // EOFS of next byte of m_Settings to write
+  uint8_t m_bFlags;
+  unsigned long m_LastChangeMs;
+  uint32_t m_ChgCnt; // # of writes that changed a setting
+  uint32_t m_WrCnt; // # of bytes physically written to the EEPROM
+
+  uint8_t calcCrc();
+  uint8_t cached(uint16_t ofs);
+  uint8_t *ptr(uint16_t ofs);
+  void write(uint16_t ofs,const void *src,uint8_t len);
+  void update(uint16_t ofs,uint8_t b);
+
+public:
+  EepromSettings() { m_bFlags = 0; m_ChgCnt = 0; m_WrCnt = 0; }
+  void Init();
+  void Service();
+  void Commit() { if (m_bFlags & EESF_DIRTY) m_bFlags |= EESF_COMMIT; }
+  void Flush();
+  uint8_t IsIdle() { return !(m_bFlags & (EESF_DIRTY|EESF_WRITING)); }
+  uint32_t GetChgCnt() { return m_ChgCnt; }
+  uint32_t GetWrCnt() { return m_WrCnt; }
+
+  // ofs: EOFS_xxx. offsets past the block go straight to the EEPROM
+  uint8_t ReadByte(uint16_t ofs);
+  uint16_t ReadWord(uint16_t ofs);
+  uint32_t ReadDword(uint16_t ofs);
+  void WriteByte(uint16_t ofs,uint8_t b) { write(ofs,&b,1); }
+  void WriteWord(uint16_t ofs,uint16_t w) { write(ofs,&w,2); }
+  void WriteDword(uint16_t ofs,uint32_t dw) { write(ofs,&dw,4); }
+};
+
+extern EepromSettings g_EeSettings;
+
+#define EeReadByte(ofs) g_EeSettings.ReadByte((uint16_t)(uintptr_t)(ofs))
+#define EeReadWord(ofs) g_EeSettings.ReadWord((uint16_t)(uintptr_t)(ofs))
+#define EeReadDword(ofs) g_EeSettings.ReadDword((uint16_t)(uintptr_t)(ofs))
+#define EeWriteByte(ofs,b) g_EeSettings.WriteByte((uint16_t)(uintptr_t)(ofs),b)
+#define EeWriteWord(ofs,w) g_EeSettings.WriteWord((uint16_t)(uintptr_t)(ofs),w)
+#define EeWriteDword(ofs,dw) g_EeSettings.WriteDword((uint16_t)(uintptr_t)(ofs),dw)
+#else // !SETTINGS_CACHE
+#define EeReadByte(ofs) eeprom_read_byte((uint8_t *)(ofs))
+#define EeReadWord(ofs) eeprom_read_word((uint16_t *)(ofs))
+#define EeReadDword(ofs) eeprom_read_dword((uint32_t *)(ofs))
+#define EeWriteByte(ofs,b) eeprom_write_byte((uint8_t *)(ofs),b)
+#define EeWriteWord(ofs,w) eeprom_write_word((uint16_t *)(ofs),w)
+#define EeWriteDword(ofs,dw) eeprom_write_dword((uint32_t *)(ofs),dw)
+#endif // SETTINGS_CACHE
@@ -0,0 +1,26 @@
+// -*- C++ -*-
+#pragma once
+//
+// integer energy arithmetic for EnergyMeter. kept free of other firmware
+// dependencies so utils/calcusage_test can build it on the host
+//
+
+#define EM_NWS_PER_MWS 1000000UL
+#define EM_NWS_PER_WS 1000000000UL
+#define EM_MWS_PER_WH 3600000UL
+
+// mV * mA * ms = nanowatt-seconds, exact
+static inline uint64_t emNws(uint32_t mv,uint32_t ma,uint32_t dms)
+{
+  return (uint64_t)mv * ma * dms;
+}
+
+// returns (n + *rem) / d, and leaves the remainder in *rem, so nothing
+// is lost across calls
+static inline uint64_t emDivRem(uint64_t n,uint32_t d,uint32_t *rem)
+{
+  n += *rem;
+  uint64_t q = n / d;
+  *rem = (uint32_t)(n - q * d);
+  return q;
+}
@@ -1,6 +1,10 @@
 #include "open_evse.h"
 
 #ifdef KWH_RECORDING
+#include "EnergyMath.h"
+#if defined(SESSION_LOG) || defined(LOAD_PROFILE_SPILL)
+#include <util/crc16.h>
+#endif
 
 EnergyMeter g_EnergyMeter;
 
@@ -9,7 +13,11 @@ EnergyMeter::EnergyMeter()
 {
   m_bFlags = 0;
   m_wattSeconds = 0;
+  m_mwsSession = 0;
+  m_nwsRem = 0;
+  m_mwsTotRem = 0;
 
+#ifndef EEPROM_JOURNAL
   // check for unitialized eeprom condition so it can begin at 0kWh
   if (eeprom_read_dword((uint32_t*)EOFS_KWH_ACCUMULATED) == 0xffffffff) {
     // set the four bytes to zero just once in the case of unitialized eeprom
@@ -18,10 +26,29 @@ EnergyMeter::EnergyMeter()
   
   // get the stored value for the kWh from eeprom
   m_wattHoursTot = eeprom_read_dword((uint32_t*)EOFS_KWH_ACCUMULATED);
+#endif // !EEPROM_JOURNAL
+
+#ifdef SESSION_LOG
+  // find the newest session record
+  m_lastSeq = 0;
+  m_recWrIdx = SESSION_REC_SIZE;
+  for (uint8_t i=0;i < SESSION_LOG_CNT;i++) {
+    eeprom_read_block(&m_Rec,(void *)(EOFS_SESSION_LOG + i*SESSION_REC_SIZE),SESSION_REC_SIZE);
+    if ((recCrc(&m_Rec) == m_Rec.crc) && m_Rec.seq &&
+	(!m_lastSeq || ((int16_t)(m_Rec.seq - m_lastSeq) > 0))) {
+      m_lastSeq = m_Rec.seq;
+    }
+  }
+#endif // SESSION_LOG
 }
 
 void EnergyMeter::Update()
 {
+#ifdef LOAD_PROFILE
+  // intervals are recorded whether or not we're charging
+  g_LoadProfile.Update();
+#endif
+
   // 1. charging session begins when EV is connected, ends when EV disconnected
   // 2. we record only when the relay is closed
   // 3. total kWh updated only when session ends
@@ -41,11 +68,23 @@ void EnergyMeter::Update()
       if (!relayClosed()) {
 	// relay just closed - don't calc, just reset timer
 	m_lastUpdateMs = millis();
+	setCharged();
+#ifdef SESSION_LOG
+	m_Rec.reason = SLR_EV;
+#endif
       }
       else {
+#ifdef POWER_QUALITY_STATS
+	pqSample();
+#endif
 	calcUsage();
       }
     }
+#ifdef SESSION_LOG
+    else if (relayClosed()) {
+      m_Rec.reason = stopReason();
+    }
+#endif // SESSION_LOG
 
     if (relayclosed) setRelayClosed();
     else clrRelayClosed();
@@ -61,53 +100,141 @@ void EnergyMeter::calcUsage()
   unsigned long dms = curms - m_lastUpdateMs;
   if (dms > KWH_CALC_INTERVAL_MS) {
       uint32_t mv = g_EvseController.GetVoltage();
+#if AMMETER_CHANNELS > 1
+      // power is the sum over the phases
+      uint32_t ma = g_EvseController.GetTotalChargingCurrent();
+      for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+	m_wsPhase[ch] += (uint32_t)emDivRem(emNws(mv,g_EvseController.GetPhaseCurrent(ch),dms),EM_NWS_PER_WS,&m_nwsPhaseRem[ch]);
+      }
+#else
       uint32_t ma = g_EvseController.GetChargingCurrent();
+#endif
+#ifdef SESSION_LOG
+      // n.b. peak is per phase, so use the highest phase current
+      uint16_t da = g_EvseController.GetChargingCurrent() / 100;
+      if (da > m_Rec.peakDa) m_Rec.peakDa = da;
+      // stop at 1M samples (~69h) so m_dvSum can't overflow
+      if (m_dvCnt < 1000000UL) {
+	m_dvSum += mv/100;
+	m_dvCnt++;
+      }
+#endif // SESSION_LOG
       /*
-       * The straightforward formula to compute 'milliwatt-seconds' would be:
-       *     mws = (mv/1000) * (ma/1000) * dms;
+       * mV * mA * ms = nanowatt-seconds. The product is computed exactly
+       * in 64 bits, and whatever doesn't make a whole mWs is carried in
+       * m_nwsRem to the next call, so nothing is truncated no matter how
+       * often we're called. e.g. 260V * 80A * 3 phases * 1000ms = 6.2e13 nWs,
+       * which needs 46 bits, so dms may get arbitrarily large w/o overflow.
        *
-       * However, this has some serious drawbacks, namely, truncating values
-       * when using integer math. This can introduce a lot of error!
-       *     5900 milliamps -> 5.9 amps (float) -> 5 amps (integer)
-       *     0.9 amps difference / 5.9 amps -> 15.2% error
-       *
-       * The crazy equation below helps ensure our intermediate results always
-       * fit in a 32-bit unsigned integer, but retain as much precision as
-       * possible throughout the calculation. Here is how it was derived:
-       *     mws = (mv/1000) * (ma/1000) * dms;
-       *     mws = (mv/(2**3 * 5**3)) * (ma/(2**3 * 5**3)) * dms;
-       *     mws = (mv/2**3) * (ma/(2**3) / 5**6 * dms;
-       *     mws = (mv/2**4) * (ma/(2**2) / 5**6 * dms;
-       *
-       * By breaking 1000 into prime factors of 2 and 5, and shifting things
-       * around, we almost match the precision of floating-point math.
-       *
-       * Using 16 and 4 divisors, rather than 8 and 8, helps precision because
-       * mv is always greater than ~100000, but ma can be as low as ~6000.
-       *
-       * A final note- the divisions by factors of 2 are done with right shifts
-       * by the compiler, so the revised equation, although it looks quite
-       * complex, only requires one divide operation.
+       * This uses libgcc's 64-bit multiply and divide (__muldi3,
+       * __udivdi3): two multiplies and two divides per call, plus one
+       * divide per channel w/ AMMETER_CHANNELS > 1. Their cycle count and
+       * flash cost haven't been measured on an AVR, so whether
+       * KWH_CALC_INTERVAL_MS can be lowered at no extra cost is unknown.
+       * Accuracy doesn't depend on the interval - see utils/calcusage_test.
        */
-      uint32_t mws = (mv/16) * (ma/4) / 15625 * dms;
-#ifdef THREEPHASE
+#ifdef POWER_QUALITY_STATS
+      {
+	uint32_t maxma = g_EvseController.GetChargingCurrent();
+	// stop at ~69h, so the sums can't overflow
+	if (m_Pq.dvCnt < 1000000UL) {
+	  m_Pq.dvSum += mv/100;
+	  m_Pq.dvCnt++;
+	}
+	if ((m_bFlags & EMF_CURRENT_VALID) && (m_Pq.daCnt < 1000000UL)) {
+	  m_Pq.daSum += maxma/100;
+	  m_Pq.daCnt++;
+	}
+#ifdef OVERCURRENT_THRESHOLD
+	if (maxma > (g_EvseController.GetCurrentCapacity()+OVERCURRENT_THRESHOLD)*1000UL)
+#else
+	if (maxma > g_EvseController.GetCurrentCapacity()*1000UL)
+#endif
+	  m_Pq.overCurrentMs += dms;
+      }
+#endif // POWER_QUALITY_STATS
+      uint64_t nws = emNws(mv,ma,dms);
+#if defined(THREEPHASE) && (AMMETER_CHANNELS == 1)
       // Multiply calculation by 3 to get 3-phase energy.
       // Typically you'd multiply by sqrt(3), but because voltage is measured to
       // ground (230V) rather than between phases (400 V), 3 is the correct multiple.
-      mws *= 3;
-#endif // THREEPHASE
-      // convert milliwatt-seconds to watt-seconds and increment counter
-      m_wattSeconds += mws / 1000;
+      nws *= 3;
+#endif // THREEPHASE && AMMETER_CHANNELS == 1
+      uint64_t mws = emDivRem(nws,EM_NWS_PER_MWS,&m_nwsRem);
+      m_mwsSession += mws;
+      m_wattSeconds = (uint32_t)(m_mwsSession / 1000);
+#ifdef LOAD_PROFILE
+      g_LoadProfile.AddSample((uint32_t)mws,mv,g_EvseController.GetChargingCurrent());
+#endif
 
       m_lastUpdateMs = curms;
   }
 }
 
+// present power, from the last voltage/current readings
+uint32_t EnergyMeter::GetPowerW()
+{
+#if AMMETER_CHANNELS > 1
+  int32_t ma = g_EvseController.GetTotalChargingCurrent();
+#else
+  int32_t ma = g_EvseController.GetChargingCurrent();
+#endif
+  if (ma <= 0) return 0;
+  uint32_t w = (uint32_t)(((uint64_t)g_EvseController.GetVoltage() * ma) / 1000000UL);
+#if defined(THREEPHASE) && (AMMETER_CHANNELS == 1)
+  w *= 3;
+#endif
+  return w;
+}
+
+// GetSessionWs() projected from the last calcUsage() to now at the present
+// power
+uint32_t EnergyMeter::GetSessionWsNow()
+{
+  uint32_t ws = m_wattSeconds;
+  if (relayClosed()) {
+    ws += (uint32_t)(((uint64_t)GetPowerW() * (millis() - m_lastUpdateMs)) / 1000UL);
+  }
+  return ws;
+}
+
 void EnergyMeter::startSession()
 {
   endSession();
   m_wattSeconds = 0;
+  m_mwsSession = 0;
+  m_nwsRem = 0;
+#if AMMETER_CHANNELS > 1
+  for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+    m_wsPhase[ch] = 0;
+    m_nwsPhaseRem[ch] = 0;
+  }
+#endif
   m_lastUpdateMs = millis();
+  clrRelayClosed();
+  clrCharged();
+#ifdef POWER_QUALITY_STATS
+  pqReset();
+#endif
+#ifdef SESSION_LOG
+  // previous record must be out of m_Rec before we reuse it
+  while (m_recWrIdx < SESSION_REC_SIZE) {
+    Service();
+  }
+  m_Rec.seq = m_lastSeq + 1;
+  if (!m_Rec.seq) m_Rec.seq = 1;
+#ifdef RTC
+  extern uint32_t GetRTCUnixtime();
+  m_Rec.start = GetRTCUnixtime();
+#else
+  m_Rec.start = 0;
+#endif
+  m_Rec.peakDa = 0;
+  m_Rec.reason = SLR_EV;
+  m_dvSum = 0;
+  m_dvCnt = 0;
+  m_sessionStartMs = m_lastUpdateMs;
+#endif // SESSION_LOG
   setInSession();
 }
 
@@ -115,17 +242,299 @@ void EnergyMeter::endSession()
 {
   if (inSession()) {
     clrInSession();
-    if (m_wattSeconds) {
-    m_wattHoursTot += (m_wattSeconds / 3600UL);
-      SaveTotkWh();
+#ifdef SESSION_LOG
+    if (charged()) {
+      if (relayClosed()) {
+	// unplugged while charging
+	m_Rec.reason = SLR_EV;
+      }
+      logSession();
+    }
+#endif // SESSION_LOG
+    if (m_mwsSession) {
+      // carry the sub-Wh remainder into the next session instead of
+      // dropping it. it only lives in RAM, so at most 1Wh is lost on reboot
+      uint32_t wh = (uint32_t)emDivRem(m_mwsSession,EM_MWS_PER_WH,&m_mwsTotRem);
+      if (wh) {
+	SetTotkWh(GetTotkWh() + wh);
+	SaveTotkWh();
+      }
+    }
+  }
+}
+
+#ifdef POWER_QUALITY_STATS
+void EnergyMeter::pqReset()
+{
+  memset(&m_Pq,0,sizeof(m_Pq));
+  m_Pq.minDv = 0xffff;
+  m_Pq.minDa = 0xffff;
+  clrBits(m_bFlags,EMF_IN_SAG|EMF_CURRENT_VALID);
+}
+
+// called every Update() while the relay is closed
+void EnergyMeter::pqSample()
+{
+  uint32_t mv = g_EvseController.GetVoltage();
+  uint16_t dv = mv / 100;
+  if (dv < m_Pq.minDv) m_Pq.minDv = dv;
+  if (dv > m_Pq.maxDv) m_Pq.maxDv = dv;
+
+  // count each sag once. 1% hysteresis so noise around the threshold
+  // isn't counted as multiple sags
+  uint32_t nominal = (g_EvseController.GetCurSvcLevel() == 1) ? MV_FOR_L1 : MV_FOR_L2;
+  if (!(m_bFlags & EMF_IN_SAG)) {
+    if (mv < (nominal / 100) * PQ_SAG_PCT) {
+      m_Pq.sagCnt++;
+      setBits(m_bFlags,EMF_IN_SAG);
+    }
+  }
+  else if (mv >= (nominal / 100) * (PQ_SAG_PCT+1)) {
+    clrBits(m_bFlags,EMF_IN_SAG);
+  }
+
+  // charging current reads 0 until the ammeter's moving average fills
+  // after the relay closes, so don't let that count as the minimum
+  uint32_t ma = g_EvseController.GetChargingCurrent();
+  if (ma) setBits(m_bFlags,EMF_CURRENT_VALID);
+  if (m_bFlags & EMF_CURRENT_VALID) {
+    uint16_t da = ma / 100;
+    if (da < m_Pq.minDa) m_Pq.minDa = da;
+    if (da > m_Pq.maxDa) m_Pq.maxDa = da;
+  }
+}
+#endif // POWER_QUALITY_STATS
+
+#ifdef SESSION_LOG
+uint8_t *EnergyMeter::recAddr(uint16_t seq)
+{
+  return (uint8_t *)(EOFS_SESSION_LOG + (seq % SESSION_LOG_CNT)*SESSION_REC_SIZE);
+}
+
+uint8_t EnergyMeter::recCrc(const SESSION_REC *rec)
+{
+  const uint8_t *p = (const uint8_t *)rec;
+  uint8_t crc = 0;
+  for (uint8_t i=0;i < SESSION_REC_SIZE-1;i++) {
+    crc = _crc8_ccitt_update(crc,p[i]);
+  }
+  return crc;
+}
+
+// called when the relay opens
+uint8_t EnergyMeter::stopReason()
+{
+  if (g_EvseController.LimitSleepIsSet()) return SLR_LIMIT;
+  if (g_EvseController.InFaultState()) return SLR_FAULT;
+  uint8_t state = g_EvseController.GetState();
+  if ((state == EVSE_STATE_SLEEPING) || (state == EVSE_STATE_DISABLED)) return SLR_USER;
+  return SLR_EV;
+}
+
+// HardFault() spins w/o calling Update(), so it tells us directly
+void EnergyMeter::SetFaultStop()
+{
+  if (inSession() && relayClosed()) {
+    m_Rec.reason = SLR_FAULT;
+    clrRelayClosed();
+  }
+}
+
+void EnergyMeter::logSession()
+{
+  m_Rec.duration = (millis() - m_sessionStartMs) / 1000;
+  m_Rec.wh = (uint32_t)(m_mwsSession / 3600000UL);
+  m_Rec.avgDv = m_dvCnt ? (m_dvSum / m_dvCnt) : 0;
+  m_Rec.crc = recCrc(&m_Rec);
+  m_recWrIdx = 0;
+}
+
+// call from ProcessInputs(). like EepromJournal::Service(), writes at most
+// one byte and never waits on the EEPROM
+void EnergyMeter::Service()
+{
+  if ((m_recWrIdx < SESSION_REC_SIZE) && eeprom_is_ready()) {
+    eeprom_update_byte(recAddr(m_Rec.seq)+m_recWrIdx,((uint8_t *)&m_Rec)[m_recWrIdx]);
+    if (++m_recWrIdx == SESSION_REC_SIZE) {
+      m_lastSeq = m_Rec.seq;
+    }
+  }
+}
+
+// idx: 0 = newest
+// returns 0 if found, 1 if no such record
+int8_t EnergyMeter::GetSessionRec(uint8_t idx,SESSION_REC *rec)
+{
+  if (!m_lastSeq || (idx >= SESSION_LOG_CNT)) return 1;
+  uint16_t seq = m_lastSeq - idx;
+  eeprom_read_block(rec,recAddr(seq),SESSION_REC_SIZE);
+  if ((recCrc(rec) != rec->crc) || (rec->seq != seq) || !seq) return 1;
+  return 0;
+}
+#endif // SESSION_LOG
+
+#ifdef LOAD_PROFILE
+LoadProfile g_LoadProfile;
+
+LoadProfile::LoadProfile()
+{
+  m_lastStart = 0;
+#ifdef LOAD_PROFILE_SPILL
+  // find the newest and oldest records
+  m_firstStart = 0;
+  m_recWrIdx = LP_REC_SIZE;
+  for (uint8_t i=0;i < LOAD_PROFILE_SPILL_CNT;i++) {
+    eeprom_read_block(&m_Rec,(void *)(EOFS_LOAD_PROFILE + i*LP_REC_SIZE),LP_REC_SIZE);
+    if ((recCrc(&m_Rec) == m_Rec.crc) && m_Rec.start &&
+	(recAddr(m_Rec.start) == (uint8_t *)(EOFS_LOAD_PROFILE + i*LP_REC_SIZE))) {
+      if (!m_lastStart || (m_Rec.start > m_lastStart)) m_lastStart = m_Rec.start;
+      if (!m_firstStart || (m_Rec.start < m_firstStart)) m_firstStart = m_Rec.start;
+    }
+  }
+#else
+  m_head = 0;
+  m_cnt = 0;
+#endif // LOAD_PROFILE_SPILL
+  m_mws = 0;
+  m_dvSum = 0;
+  m_dvCnt = 0;
+  m_maxDa = 0;
+  m_nextMs = 0; // sync on first Update()
+}
+
+// start a new interval and compute when it ends. called on every boundary,
+// so millis() drift vs the RTC never accumulates past one interval
+void LoadProfile::sync()
+{
+  unsigned long ms = millis();
+#ifdef RTC
+  extern uint32_t GetRTCUnixtime();
+  uint32_t now = GetRTCUnixtime();
+#else
+  // no RTC - intervals are aligned to boot time
+  uint32_t now = ms / 1000;
+#endif
+  uint32_t secs = LOAD_PROFILE_INTERVAL_SECS - (now % LOAD_PROFILE_INTERVAL_SECS);
+  if (secs < 30) {
+    // millis() ran fast and we're just short of the boundary - don't
+    // start a tiny interval
+    secs += LOAD_PROFILE_INTERVAL_SECS;
+  }
+  m_curStart = now + secs - LOAD_PROFILE_INTERVAL_SECS;
+  m_nextMs = ms + secs*1000UL;
+  if (!m_nextMs) m_nextMs = 1;
+}
+
+void LoadProfile::Update()
+{
+  if (!m_nextMs) {
+    sync(); // first interval is partial
+    return;
+  }
+  if ((long)(millis() - m_nextMs) < 0) return;
+
+#ifdef LOAD_PROFILE_SPILL
+  // m_lastStart is updated by Service() once the record is written
+  LP_BUCKET *b = &m_Rec.b;
+  m_Rec.start = m_curStart;
+#else
+  LP_BUCKET *b = &m_Buckets[m_head];
+#endif
+  uint32_t wh = (uint32_t)(m_mws / 3600000UL);
+  m_mws -= (uint64_t)wh * 3600000UL;
+  b->wh = (wh > 0xffff) ? 0xffff : wh;
+  b->maxDa = m_maxDa;
+  b->avgDv = m_dvCnt ? (m_dvSum / m_dvCnt) : 0;
+#ifdef LOAD_PROFILE_SPILL
+  m_Rec.crc = recCrc(&m_Rec);
+  m_recWrIdx = 0;
+#else
+  m_head = (m_head + 1) % LOAD_PROFILE_CNT;
+  if (m_cnt < LOAD_PROFILE_CNT) m_cnt++;
+  m_lastStart = m_curStart;
+#endif
+
+  m_dvSum = 0;
+  m_dvCnt = 0;
+  m_maxDa = 0;
+  sync();
+}
+
+// called from EnergyMeter::calcUsage()
+void LoadProfile::AddSample(uint32_t mws,uint32_t mv,uint32_t ma)
+{
+  m_mws += mws;
+  if (ma/100 > m_maxDa) m_maxDa = ma/100;
+  if (m_dvCnt < 0xffff) {
+    m_dvSum += mv/100;
+    m_dvCnt++;
+  }
+}
+
+#ifdef LOAD_PROFILE_SPILL
+uint8_t *LoadProfile::recAddr(uint32_t start)
+{
+  return (uint8_t *)(EOFS_LOAD_PROFILE + ((start / LOAD_PROFILE_INTERVAL_SECS) % LOAD_PROFILE_SPILL_CNT)*LP_REC_SIZE);
+}
+
+uint8_t LoadProfile::recCrc(const LP_REC *rec)
+{
+  const uint8_t *p = (const uint8_t *)rec;
+  uint8_t crc = 0;
+  for (uint8_t i=0;i < LP_REC_SIZE-1;i++) {
+    crc = _crc8_ccitt_update(crc,p[i]);
+  }
+  return crc;
+}
+
+// call from ProcessInputs(). like EnergyMeter::Service(), writes at most
+// one byte and never waits on the EEPROM
+void LoadProfile::Service()
+{
+  if ((m_recWrIdx < LP_REC_SIZE) && eeprom_is_ready()) {
+    eeprom_update_byte(recAddr(m_Rec.start)+m_recWrIdx,((uint8_t *)&m_Rec)[m_recWrIdx]);
+    if (++m_recWrIdx == LP_REC_SIZE) {
+      if (!m_lastStart) m_firstStart = m_Rec.start;
+      m_lastStart = m_Rec.start;
     }
   }
 }
 
+uint8_t LoadProfile::GetCount()
+{
+  if (!m_lastStart) return 0;
+  // n.b. huge if the RTC was set back
+  uint32_t cnt = (m_lastStart - m_firstStart) / LOAD_PROFILE_INTERVAL_SECS + 1;
+  return (cnt < LOAD_PROFILE_SPILL_CNT) ? cnt : LOAD_PROFILE_SPILL_CNT;
+}
+
+void LoadProfile::GetBucket(uint8_t idx,LP_BUCKET *b)
+{
+  LP_REC rec;
+  uint32_t start = m_lastStart - idx*LOAD_PROFILE_INTERVAL_SECS;
+  eeprom_read_block(&rec,recAddr(start),LP_REC_SIZE);
+  if ((recCrc(&rec) == rec.crc) && (rec.start == start)) *b = rec.b;
+  else memset(b,0,sizeof(*b)); // not recorded - powered off
+}
+#else
+uint8_t LoadProfile::GetCount()
+{
+  return m_cnt;
+}
+
+void LoadProfile::GetBucket(uint8_t idx,LP_BUCKET *b)
+{
+  *b = m_Buckets[(m_head + LOAD_PROFILE_CNT - 1 - idx) % LOAD_PROFILE_CNT];
+}
+#endif // LOAD_PROFILE_SPILL
+#endif // LOAD_PROFILE
+
+#ifndef EEPROM_JOURNAL
 void EnergyMeter::SaveTotkWh()
 {
-  eeprom_write_dword((uint32_t*)EOFS_KWH_ACCUMULATED,m_wattHoursTot);
+  EeWriteDword(EOFS_KWH_ACCUMULATED,m_wattHoursTot);
 }
+#endif // !EEPROM_JOURNAL
 
 #endif // KWH_RECORDING
 
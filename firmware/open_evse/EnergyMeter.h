@@ -7,11 +7,76 @@
 #define EMF_IN_SESSION 0x01 // in a charging session
 #define EMF_EV_CONNECTED 0x02
 #define EMF_RELAY_CLOSED 0x04
+#define EMF_CHARGED 0x08 // relay has closed at least once this session
+#define EMF_IN_SAG 0x10 // POWER_QUALITY_STATS voltage is sagging
+#define EMF_CURRENT_VALID 0x20 // POWER_QUALITY_STATS got 1st current reading
+
+#ifdef POWER_QUALITY_STATS
+// per-session power quality statistics. updated on the fly while the relay
+// is closed, w/o storing any samples
+typedef struct pq_stats {
+  uint16_t minDv; // voltage, 0.1V
+  uint16_t maxDv;
+  uint16_t minDa; // current, 0.1A
+  uint16_t maxDa;
+  uint32_t dvSum; // for the means, sampled every KWH_CALC_INTERVAL_MS
+  uint32_t daSum;
+  uint32_t dvCnt;
+  uint32_t daCnt;
+  uint16_t sagCnt; // # of times voltage dropped below PQ_SAG_PCT of nominal
+  uint32_t overCurrentMs; // time current was > pilot + OVERCURRENT_THRESHOLD
+} PQ_STATS;
+#endif // POWER_QUALITY_STATS
+
+#ifdef SESSION_LOG
+// SESSION_REC.reason - why charging last stopped
+#define SLR_EV    0 // EV stopped charging, or was unplugged while charging
+#define SLR_LIMIT 1 // charge or time limit reached
+#define SLR_USER  2 // sleep/disable via button, RAPI or delay timer
+#define SLR_FAULT 3 // EVSE fault
+
+// one record per charging session, kept in a SESSION_LOG_CNT ring at
+// EOFS_SESSION_LOG. slot = seq % SESSION_LOG_CNT
+typedef struct session_rec {
+  uint16_t seq; // session number, starts at 1
+  uint32_t start; // RTC unixtime when EV connected, 0 if no RTC
+  uint32_t duration; // seconds EV was connected
+  uint32_t wh; // energy delivered
+  uint16_t peakDa; // peak charging current, 0.1A
+  uint16_t avgDv; // average voltage while relay closed, 0.1V
+  uint8_t reason; // SLR_xxx
+  uint8_t crc; // CRC8 of all preceding bytes
+} SESSION_REC;
+
+#define SESSION_LOG_CNT 16
+#define SESSION_REC_SIZE ((uint8_t)sizeof(SESSION_REC))
+#endif // SESSION_LOG
+
 class EnergyMeter {
   unsigned long m_lastUpdateMs;
+#ifndef EEPROM_JOURNAL
   uint32_t m_wattHoursTot; // accumulated across all charging sessions
-  uint32_t m_wattSeconds;  // current charging session
+#endif
+  uint32_t m_wattSeconds;  // current charging session, = m_mwsSession/1000
+  uint64_t m_mwsSession;   // current charging session, milliwatt-seconds
+  uint32_t m_nwsRem;       // sub-mWs remainder carried between calcUsage() calls
+  uint32_t m_mwsTotRem;    // sub-Wh remainder carried between sessions
+#if AMMETER_CHANNELS > 1
+  uint32_t m_wsPhase[AMMETER_CHANNELS]; // current charging session, per phase
+  uint32_t m_nwsPhaseRem[AMMETER_CHANNELS]; // sub-Ws remainder
+#endif
   uint8_t m_bFlags;
+#ifdef SESSION_LOG
+  SESSION_REC m_Rec; // current session, then the one being written
+  unsigned long m_sessionStartMs;
+  uint32_t m_dvSum; // for avgDv
+  uint32_t m_dvCnt;
+  uint16_t m_lastSeq; // newest record in EEPROM, 0 = none
+  uint8_t m_recWrIdx; // next byte of m_Rec to write, SESSION_REC_SIZE = idle
+#endif // SESSION_LOG
+#ifdef POWER_QUALITY_STATS
+  PQ_STATS m_Pq;
+#endif
 
   uint8_t inSession() { return m_bFlags & EMF_IN_SESSION ? 1 : 0; }
   void setInSession() { setBits(m_bFlags,EMF_IN_SESSION); }
@@ -25,6 +90,19 @@ class EnergyMeter {
   void setRelayClosed() { setBits(m_bFlags,EMF_RELAY_CLOSED); }
   void clrRelayClosed() { clrBits(m_bFlags,EMF_RELAY_CLOSED); }
 
+  uint8_t charged() { return m_bFlags & EMF_CHARGED ? 1 : 0; }
+  void setCharged() { setBits(m_bFlags,EMF_CHARGED); }
+  void clrCharged() { clrBits(m_bFlags,EMF_CHARGED); }
+#ifdef POWER_QUALITY_STATS
+  void pqReset();
+  void pqSample();
+#endif
+#ifdef SESSION_LOG
+  static uint8_t *recAddr(uint16_t seq);
+  static uint8_t recCrc(const SESSION_REC *rec);
+  uint8_t stopReason();
+  void logSession();
+#endif // SESSION_LOG
 
   void calcUsage();
   void startSession();
@@ -34,14 +112,98 @@ public:
   EnergyMeter();
 
   void Update();
+#ifdef EEPROM_JOURNAL
+  // lifetime Wh lives in the journal, which takes care of saving it
+  void SaveTotkWh() {}
+  void SetTotkWh(uint32_t whtot) { g_EeJournal.SetWhTot(whtot); }
+  uint32_t GetTotkWh() { return g_EeJournal.GetWhTot(); }
+#else
   void SaveTotkWh();
   void SetTotkWh(uint32_t whtot) { m_wattHoursTot = whtot; }
   uint32_t GetTotkWh() { return m_wattHoursTot; }
+#endif // EEPROM_JOURNAL
   uint32_t GetSessionWs() { return m_wattSeconds; }
+  uint32_t GetSessionWsNow();
+  uint32_t GetPowerW();
+#if AMMETER_CHANNELS > 1
+  uint32_t GetPhaseSessionWs(uint8_t ch) { return m_wsPhase[ch]; }
+#endif
+#ifdef POWER_QUALITY_STATS
+  PQ_STATS *GetPqStats() { return &m_Pq; }
+#endif
+#ifdef SESSION_LOG
+  void Service();
+  void SetFaultStop();
+  int8_t GetSessionRec(uint8_t idx,SESSION_REC *rec);
+#endif // SESSION_LOG
 };
 
 
 extern EnergyMeter g_EnergyMeter;
+
+#ifdef LOAD_PROFILE
+// completed interval
+typedef struct lp_bucket {
+  uint16_t wh; // energy delivered
+  uint16_t maxDa; // max charging current, 0.1A
+  uint16_t avgDv; // average voltage while charging, 0.1V
+} LP_BUCKET;
+
+#ifdef LOAD_PROFILE_SPILL
+// completed interval in the LOAD_PROFILE_SPILL_CNT ring at EOFS_LOAD_PROFILE
+// slot = (start / LOAD_PROFILE_INTERVAL_SECS) % LOAD_PROFILE_SPILL_CNT, so
+// intervals missed while powered off read back as empty
+typedef struct lp_rec {
+  uint32_t start; // RTC unixtime
+  LP_BUCKET b;
+  uint8_t crc; // CRC8 of all preceding bytes
+} LP_REC;
+
+#define LP_REC_SIZE ((uint8_t)sizeof(LP_REC))
+#endif // LOAD_PROFILE_SPILL
+
+// records energy, max current and avg voltage into fixed intervals, which
+// are aligned to the RTC, e.g. :00 :15 :30 :45 for 15 min
+class LoadProfile {
+#ifdef LOAD_PROFILE_SPILL
+  LP_REC m_Rec; // newest completed interval, while being written
+  uint8_t m_recWrIdx; // next byte of m_Rec to write, LP_REC_SIZE = idle
+  uint32_t m_firstStart; // start time of oldest record
+#else
+  LP_BUCKET m_Buckets[LOAD_PROFILE_CNT]; // ring of completed intervals
+  uint8_t m_head; // next slot to fill
+  uint8_t m_cnt; // # of valid slots
+#endif // LOAD_PROFILE_SPILL
+  uint32_t m_lastStart; // start time of newest completed interval, 0 = none
+  uint32_t m_curStart; // start time of current interval
+  unsigned long m_nextMs; // millis() when current interval ends
+  // current interval
+  uint64_t m_mws; // carries sub-Wh remainder to the next interval
+  uint32_t m_dvSum;
+  uint16_t m_dvCnt;
+  uint16_t m_maxDa;
+
+  void sync();
+#ifdef LOAD_PROFILE_SPILL
+  static uint8_t *recAddr(uint32_t start);
+  static uint8_t recCrc(const LP_REC *rec);
+#endif
+
+public:
+  LoadProfile();
+  void Update();
+#ifdef LOAD_PROFILE_SPILL
+  void Service();
+#endif
+  void AddSample(uint32_t mws,uint32_t mv,uint32_t ma);
+  uint8_t GetCount();
+  uint32_t GetLastStart() { return m_lastStart; }
+  // idx: 0 = newest
+  void GetBucket(uint8_t idx,LP_BUCKET *b);
+};
+
+extern LoadProfile g_LoadProfile;
+#endif // LOAD_PROFILE
 #endif // KWH_RECORDING
 
 
@@ -55,55 +55,91 @@ static inline unsigned long ulong_sqrt(unsigned long in)
   return out;
 }
 
+// all current channels are sampled round robin in a single pass, so
+// the phases are measured over the same mains cycles. each channel
+// integrates over one full cycle between its own 1st and 3rd zero crossings
 void J1772EVSEController::readAmmeter()
 {
   WDT_RESET();
 
-  unsigned long sum = 0;
-  uint8_t zero_crossings = 0;
-  unsigned long last_zero_crossing_time = 0, now_ms;
+  unsigned long sum[AMMETER_ADC_CNT];
+  unsigned int sample_count[AMMETER_ADC_CNT];
+  unsigned long last_zero_crossing_time[AMMETER_ADC_CNT];
+  uint16_t last_sample[AMMETER_ADC_CNT];
+  uint8_t zero_crossings[AMMETER_ADC_CNT];
+  uint8_t ch,done = 0;
+  for (ch=0;ch < AMMETER_ADC_CNT;ch++) {
+    sum[ch] = 0;
+    sample_count[ch] = 0;
+    last_zero_crossing_time[ch] = 0;
+    zero_crossings[ch] = 0;
+    // if we run out of time, assume that it's simply not oscillating any.
+    m_AmmeterReading[ch] = 0;
+  }
   uint8_t is_first_sample = 1;
-  uint16_t last_sample;
-  unsigned int sample_count = 0;
+  unsigned long now_ms;
   for(unsigned long start = millis(); ((now_ms = millis()) - start) < CURRENT_SAMPLE_INTERVAL; ) {
-    // the A/d is 0 to 1023.
-    uint16_t sample = adcCurrent.read();
-    // If this isn't the first sample, and if the sign of the value differs from the
-    // sign of the previous value, then count that as a zero crossing.
-    if (!is_first_sample && ((last_sample > 512) != (sample > 512))) {
-      // Once we've seen a zero crossing, don't look for one for a little bit.
-      // It's possible that a little noise near zero could cause a two-sample
-      // inversion.
-      if ((now_ms - last_zero_crossing_time) > CURRENT_ZERO_DEBOUNCE_INTERVAL) {
-        zero_crossings++;
-        last_zero_crossing_time = now_ms;
+    for (ch=0;ch < AMMETER_ADC_CNT;ch++) {
+      if (zero_crossings[ch] == 3) continue; // this channel is done
+      // the A/d is 0 to 1023.
+      uint16_t sample = adcCurrent[ch].read();
+      // If this isn't the first sample, and if the sign of the value differs from the
+      // sign of the previous value, then count that as a zero crossing.
+      if (!is_first_sample && ((last_sample[ch] > 512) != (sample > 512))) {
+	// Once we've seen a zero crossing, don't look for one for a little bit.
+	// It's possible that a little noise near zero could cause a two-sample
+	// inversion.
+	if ((now_ms - last_zero_crossing_time[ch]) > CURRENT_ZERO_DEBOUNCE_INTERVAL) {
+	  zero_crossings[ch]++;
+	  last_zero_crossing_time[ch] = now_ms;
+	}
+      }
+      last_sample[ch] = sample;
+      if (zero_crossings[ch] == 3) {
+	// The answer is the square root of the mean of the squares.
+	// But additionally, that value must be scaled to a real current value.
+	// we will do that elsewhere
+	m_AmmeterReading[ch] = ulong_sqrt(sum[ch] / sample_count[ch]);
+	if (++done == AMMETER_ADC_CNT) return;
+      }
+      else if (zero_crossings[ch]) {
+	// Gather the sum-of-the-squares and count how many samples we've collected.
+	sum[ch] += (unsigned long)(((long)sample - 512) * ((long)sample - 512));
+	sample_count[ch]++;
       }
     }
     is_first_sample = 0;
-    last_sample = sample;
-    switch(zero_crossings) {
-    case 0:
-      continue; // Still waiting to start sampling
-    case 1:
-    case 2:
-      // Gather the sum-of-the-squares and count how many samples we've collected.
-      sum += (unsigned long)(((long)sample - 512) * ((long)sample - 512));
-      sample_count++;
-      continue;
-    case 3:
-      // The answer is the square root of the mean of the squares.
-      // But additionally, that value must be scaled to a real current value.
-      // we will do that elsewhere
-      m_AmmeterReading = ulong_sqrt(sum / sample_count);
-      return;
-    }
   }
-  // ran out of time. Assume that it's simply not oscillating any.
-  m_AmmeterReading = 0;
 
   WDT_RESET();
 }
 
+// convert a readAmmeter() reading to mA
+int32_t J1772EVSEController::calibratedCurrent(uint8_t ch,unsigned long reading)
+{
+  int32_t ma = reading * m_CurrentScaleFactor[ch] - m_AmmeterCurrentOffset[ch];
+  return (ma < 0) ? 0 : ma;
+}
+
+// channel 0 uses the original EEPROM locations
+// offset: 0 = scale factor, 1 = offset
+uint16_t *J1772EVSEController::currentCalAddr(uint8_t ch,uint8_t offset)
+{
+  if (ch == 0) {
+    return (uint16_t *)(offset ? EOFS_AMMETER_CURR_OFFSET : EOFS_CURRENT_SCALE_FACTOR);
+  }
+#ifdef MAINS_CT
+  if (ch == MAINS_CT_CH) {
+    return (uint16_t *)(EOFS_MAINS_CT_CAL + offset*2);
+  }
+#endif
+#if AMMETER_CHANNELS > 1
+  return (uint16_t *)(EOFS_CURRENT_CAL + (ch-1)*4 + offset*2);
+#else
+  return NULL;
+#endif
+}
+
 #define MA_PTS 32 // # points in moving average MUST BE power of 2
 #define MA_BITS 5 // log2(MA_PTS)
 /*
@@ -125,38 +161,55 @@ uint32_t MovingAverage(uint32_t samp)
 // to save memory
 // instead of doing a real moving average we just do a non-overlapping
 // sliding window and output a value every MA_PTS
-uint32_t MovingAverage(uint32_t samp)
+// returns 1 when avg[] has been updated for all channels
+uint8_t MovingAverage(const unsigned long *samp,uint32_t *avg)
 {
-  static uint32_t tot = 0;
+  static uint32_t tot[AMMETER_CHANNELS];
   static int8_t curidx = 0;
-  
-  if (curidx == 0) {
-    tot = 0;
-  }
 
-  tot += samp;
+  for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+    if (curidx == 0) {
+      tot[ch] = 0;
+    }
+    tot[ch] += samp[ch];
+  }
 
   if (++curidx == MA_PTS) {
     curidx = 0;
-    return tot >> MA_BITS; // tot / MA_PTS
+    for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+      avg[ch] = tot[ch] >> MA_BITS; // tot / MA_PTS
+    }
+    return 1;
   }
-  return 0xffffffff;
+  return 0;
 }
 
 #endif // AMMETER
 
 J1772EVSEController::J1772EVSEController() :
   adcPilot(PILOT_PIN)
-#ifdef CURRENT_PIN
-  , adcCurrent(CURRENT_PIN)
-#endif
 #ifdef VOLTMETER_PIN
   , adcVoltMeter(VOLTMETER_PIN)
 #endif
 {
+#ifdef CURRENT_PIN
+  adcCurrent[0].init(CURRENT_PIN);
+#if AMMETER_CHANNELS > 1
+  adcCurrent[1].init(CURRENT_PIN_2);
+#endif
+#if AMMETER_CHANNELS > 2
+  adcCurrent[2].init(CURRENT_PIN_3);
+#endif
+#ifdef MAINS_CT
+  adcCurrent[MAINS_CT_CH].init(MAINS_CT_PIN);
+#endif
+#endif // CURRENT_PIN
 #ifdef STATE_TRANSITION_REQ_FUNC
   m_StateTransitionReqFunc = NULL;
 #endif // STATE_TRANSITION_REQ_FUNC
+#ifdef DUOSHARE
+  m_ShareDa = 0;
+#endif
 }
 
 void J1772EVSEController::SaveSettings()
@@ -169,7 +222,7 @@ void J1772EVSEController::SaveSettings()
   else {
     dest = (uint8_t *)EOFS_CURRENT_CAPACITY_L2;
   }
-  eeprom_write_byte(dest, GetCurrentCapacity());
+  EeWriteByte(dest, GetCurrentCapacity());
   SaveEvseFlags();
 }
 
@@ -204,6 +257,13 @@ void J1772EVSEController::Reboot()
     wdt_delay(3000);
   }
 
+#ifdef EEPROM_JOURNAL
+  g_EeJournal.Flush();
+#endif
+#ifdef SETTINGS_CACHE
+  g_EeSettings.Flush();
+#endif
+
   // hardware reset by forcing watchdog to timeout
   wdt_enable(WDTO_1S);   // enable watchdog timer
   delay(1500);
@@ -347,13 +407,16 @@ void J1772EVSEController::chargingOff()
   m_ChargeOffTimeMS = millis();
 
 #ifdef AMMETER
-  m_ChargingCurrent = 0;
+  ZeroChargingCurrent();
 #endif
 }
 
 void J1772EVSEController::HardFault(int8_t recoverable)
 {
   SetHardFault();
+#ifdef SESSION_LOG
+  g_EnergyMeter.SetFaultStop();
+#endif
   g_OBD.Update(OBD_UPD_HARDFAULT);
 #ifdef RAPI
   RapiSendEvseState();
@@ -594,7 +657,7 @@ void J1772EVSEController::SetSvcLevel(uint8_t svclvl,uint8_t updatelcd)
   uint8_t ampacity = GetMaxCurrentCapacity();
 
 
-  SetCurrentCapacity(ampacity,0,1);
+  SetCurrentCapacity(ampacity,0,1,1);
 
   if (updatelcd) {
     g_OBD.Update(OBD_UPD_FORCE);
@@ -604,7 +667,7 @@ void J1772EVSEController::SetSvcLevel(uint8_t svclvl,uint8_t updatelcd)
 uint8_t J1772EVSEController::GetMaxCurrentCapacity()
 {
   uint8_t svclvl = GetCurSvcLevel();
-  uint8_t ampacity =  eeprom_read_byte((uint8_t*)((svclvl == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2));
+  uint8_t ampacity =  EeReadByte((svclvl == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2);
 
   if ((ampacity == 0xff) || (ampacity == 0)) {
     ampacity = (svclvl == 1) ? DEFAULT_CURRENT_CAPACITY_L1 : DEFAULT_CURRENT_CAPACITY_L2;
@@ -934,7 +997,7 @@ void J1772EVSEController::Init()
   m_PrevEvseState = EVSE_STATE_UNKNOWN;
 
   // read settings from EEPROM
-  uint16_t rflgs = eeprom_read_word((uint16_t*)EOFS_FLAGS);
+  uint16_t rflgs = EeReadWord(EOFS_FLAGS);
 
 #ifdef RGBLCD
   if ((rflgs != 0xffff) && (rflgs & ECF_MONO_LCD)) {
@@ -943,8 +1006,8 @@ void J1772EVSEController::Init()
 #endif // RGBLCD
 
 #ifdef RELAY_PWM
-  m_relayCloseMs = eeprom_read_byte((uint8_t*)EOFS_RELAY_CLOSE_MS);
-  m_relayHoldPwm = eeprom_read_byte((uint8_t*)EOFS_RELAY_HOLD_PWM);
+  m_relayCloseMs = EeReadByte(EOFS_RELAY_CLOSE_MS);
+  m_relayHoldPwm = EeReadByte(EOFS_RELAY_HOLD_PWM);
   if (!m_relayCloseMs || (m_relayCloseMs == 255)) {
     m_relayCloseMs = DEFAULT_RELAY_CLOSE_MS;
     m_relayHoldPwm = DEFAULT_RELAY_HOLD_PWM;
@@ -1042,27 +1105,55 @@ void J1772EVSEController::Init()
 #endif
 
 #ifdef AMMETER
-  m_AmmeterCurrentOffset = eeprom_read_word((uint16_t*)EOFS_AMMETER_CURR_OFFSET);
-  m_CurrentScaleFactor = eeprom_read_word((uint16_t*)EOFS_CURRENT_SCALE_FACTOR);
+  for (uint8_t ch=0;ch < AMMETER_ADC_CNT;ch++) {
+    m_AmmeterCurrentOffset[ch] = EeReadWord(currentCalAddr(ch,1));
+    m_CurrentScaleFactor[ch] = EeReadWord(currentCalAddr(ch,0));
   
-  if (m_AmmeterCurrentOffset == (int16_t)0xffff) {
-    m_AmmeterCurrentOffset = DEFAULT_AMMETER_CURRENT_OFFSET;
-  }
-  if (m_CurrentScaleFactor == (int16_t)0xffff) {
-    m_CurrentScaleFactor = DEFAULT_CURRENT_SCALE_FACTOR;
-  }
+    if (m_AmmeterCurrentOffset[ch] == (int16_t)0xffff) {
+      m_AmmeterCurrentOffset[ch] = DEFAULT_AMMETER_CURRENT_OFFSET;
+    }
+    if (m_CurrentScaleFactor[ch] == (int16_t)0xffff) {
+      m_CurrentScaleFactor[ch] = DEFAULT_CURRENT_SCALE_FACTOR;
+    }
   
-  m_AmmeterReading = 0;
-  m_ChargingCurrent = 0;
+    m_AmmeterReading[ch] = 0;
+  }
+  ZeroChargingCurrent();
 #ifdef OVERCURRENT_THRESHOLD
   m_OverCurrentStartMs = 0;
 #endif //OVERCURRENT_THRESHOLD
+#ifdef MAINS_CT
+  m_MainsLimit = EeReadByte(EOFS_MAINS_LIMIT);
+  if (m_MainsLimit == 0xff) m_MainsLimit = 0;
+#endif // MAINS_CT
 
 #endif // AMMETER
 
+#ifdef CURRENT_RAMP
+  m_RampDa = 0;
+  m_RampRate = EeReadByte(EOFS_RAMP_RATE);
+  if (m_RampRate == 0xff) m_RampRate = CURRENT_RAMP_RATE;
+#endif
+#ifdef TEMPERATURE_DERATE
+  m_ThermDa = 0;
+#endif
+#ifdef TOU_SCHEDULE
+  m_TouAmps = 0;
+#endif
+#ifdef PILOT_CLASSIFIER
+  m_PilotConfCnt = 0;
+#endif
+#ifdef EXT_SETPOINT
+  m_ExtDa = 0;
+  m_ExtFallbackDa = MIN_CURRENT_CAPACITY_J1772*10;
+  m_ExtTimeoutMs = EXT_SETPOINT_TIMEOUT_MS;
+  m_ExtExpired = 0;
+  m_ExtRxDa = EXTSP_NONE;
+#endif
+
 #ifdef VOLTMETER
-  m_VoltOffset = eeprom_read_dword((uint32_t*)EOFS_VOLT_OFFSET);
-  m_VoltScaleFactor = eeprom_read_word((uint16_t*)EOFS_VOLT_SCALE_FACTOR);
+  m_VoltOffset = EeReadDword(EOFS_VOLT_OFFSET);
+  m_VoltScaleFactor = EeReadWord(EOFS_VOLT_SCALE_FACTOR);
   
   if (m_VoltOffset == 0xffffffff) {
     m_VoltOffset = DEFAULT_VOLT_OFFSET;
@@ -1078,21 +1169,21 @@ void J1772EVSEController::Init()
 
   m_wVFlags = ECVF_DEFAULT;
 
-  m_MaxHwCurrentCapacity = eeprom_read_byte((uint8_t*)EOFS_MAX_HW_CURRENT_CAPACITY);
+  m_MaxHwCurrentCapacity = EeReadByte(EOFS_MAX_HW_CURRENT_CAPACITY);
   if (!m_MaxHwCurrentCapacity || (m_MaxHwCurrentCapacity == (uint8_t)0xff)) {
     m_MaxHwCurrentCapacity = MAX_CURRENT_CAPACITY_L2;
   }
 
 #ifdef GFI
   m_GfiRetryCnt = 0;
-  m_GfiTripCnt = eeprom_read_byte((uint8_t*)EOFS_GFI_TRIP_CNT);
+  m_GfiTripCnt = readTripCnt(TRIPCNT_GFI);
 #endif // GFI
 #ifdef ADVPWR
   m_NoGndRetryCnt = 0;
-  m_NoGndTripCnt = eeprom_read_byte((uint8_t*)EOFS_NOGND_TRIP_CNT);
+  m_NoGndTripCnt = readTripCnt(TRIPCNT_NOGND);
 
   m_StuckRelayStartTimeMS = 0;
-  m_StuckRelayTripCnt = eeprom_read_byte((uint8_t*)EOFS_STUCK_RELAY_TRIP_CNT);
+  m_StuckRelayTripCnt = readTripCnt(TRIPCNT_STUCK_RELAY);
 
   m_NoGndRetryCnt = 0;
   m_NoGndStart = 0;
@@ -1163,8 +1254,8 @@ void J1772EVSEController::Init()
 
 #ifdef HEARTBEAT_SUPERVISION
   //Grab the EEPROM setpoints and see if they are legitimate
-  m_HsInterval = eeprom_read_word((uint16_t*)EOFS_HEARTBEAT_SUPERVISION_INTERVAL);
-  m_IFallback = eeprom_read_byte((uint8_t*)EOFS_HEARTBEAT_SUPERVISION_CURRENT);
+  m_HsInterval = EeReadWord(EOFS_HEARTBEAT_SUPERVISION_INTERVAL);
+  m_IFallback = EeReadByte(EOFS_HEARTBEAT_SUPERVISION_CURRENT);
   //Legit check:
   if (m_HsInterval == 0xffff) { //EEPROM not initialized, let's just load the default values eh?  <== CANADA
   	m_HsInterval = HS_INTERVAL_DEFAULT;
@@ -1175,6 +1266,32 @@ void J1772EVSEController::Init()
 
 }
 
+#if defined(GFI) || defined(ADVPWR)
+// trip counters are kept in the EEPROM journal, or w/o it, in the legacy
+// EOFS_xxx_TRIP_CNT bytes. which: TRIPCNT_xxx
+uint8_t J1772EVSEController::readTripCnt(uint8_t which)
+{
+#ifdef EEPROM_JOURNAL
+  return g_EeJournal.GetTripCnt(which);
+#else
+  return EeReadByte(EOFS_GFI_TRIP_CNT+which);
+#endif
+}
+
+// cnt: member holding the raw count (tripcnt-1). saturates at 254 trips
+void J1772EVSEController::incTripCnt(uint8_t *cnt,uint8_t which)
+{
+  if (((uint8_t)(*cnt+1)) < 254) {
+    (*cnt)++;
+#ifdef EEPROM_JOURNAL
+    g_EeJournal.SetTripCnt(which,*cnt);
+#else
+    EeWriteByte(EOFS_GFI_TRIP_CNT+which,*cnt);
+#endif
+  }
+}
+#endif // GFI || ADVPWR
+
 void J1772EVSEController::ReadPilot(uint16_t *plow,uint16_t *phigh)
 {
   uint16_t pl = 1023;
@@ -1218,6 +1335,69 @@ void J1772EVSEController::ReadPilot(uint16_t *plow,uint16_t *phigh)
   }
 }
 
+// returns EVSE_STATE_A-D, or EVSE_STATE_UNKNOWN. w/ PILOT_CLASSIFIER,
+// the thresholds around prevstate are moved PILOT_HYST away from it, and
+// margin returns the distance to the nearest threshold
+uint8_t J1772EVSEController::ClassifyPilot(uint16_t phigh,uint8_t prevstate,uint16_t *margin)
+{
+  uint16_t thresh[4];
+  thresh[0] = m_ThreshData.m_ThreshAB;
+  thresh[1] = m_ThreshData.m_ThreshBC;
+  thresh[2] = m_ThreshData.m_ThreshCD;
+  thresh[3] = m_ThreshData.m_ThreshD + 1; // State D is > m_ThreshD
+
+  uint8_t i;
+  for (i=0;i < 4;i++) {
+    uint16_t t = thresh[i];
+#ifdef PILOT_CLASSIFIER
+    if (prevstate == EVSE_STATE_A+i) t -= PILOT_HYST;
+    else if ((i < 3) && (prevstate == EVSE_STATE_B+i)) t += PILOT_HYST;
+#endif
+    if (phigh >= t) break;
+  }
+
+  if (margin) {
+    int16_t m = 0;
+    if (i < 4) {
+      m = phigh - thresh[i];
+      if (i && ((int16_t)(thresh[i-1] - phigh) < m)) m = thresh[i-1] - phigh;
+    }
+    *margin = (m > 0) ? m : 0;
+  }
+
+  return (i < 4) ? EVSE_STATE_A+i : EVSE_STATE_UNKNOWN;
+}
+
+#ifdef PILOT_CLASSIFIER
+// PILOT_HIST_BINS/4 bins above the state's upper threshold, the rest below
+uint16_t J1772EVSEController::GetPilotHistBase(uint8_t state)
+{
+  uint16_t top;
+  if (state == EVSE_STATE_B) top = m_ThreshData.m_ThreshAB;
+  else if (state == EVSE_STATE_C) top = m_ThreshData.m_ThreshBC;
+  else if (state == EVSE_STATE_D) top = m_ThreshData.m_ThreshCD;
+  else return 1024 - (PILOT_HIST_BINS << PILOT_HIST_SHIFT);
+  return top + ((PILOT_HIST_BINS/4) << PILOT_HIST_SHIFT) - (PILOT_HIST_BINS << PILOT_HIST_SHIFT);
+}
+
+// readings outside the range go in the end bins. when a bin fills, the
+// whole histogram is halved, so it keeps its shape
+void J1772EVSEController::pilotHistAdd(uint16_t phigh)
+{
+  uint16_t *hist = GetPilotHist(m_PilotState);
+  uint16_t base = GetPilotHistBase(m_PilotState);
+  uint8_t bin = 0;
+  if (phigh > base) {
+    uint16_t b = (phigh - base) >> PILOT_HIST_SHIFT;
+    bin = (b < PILOT_HIST_BINS) ? b : (PILOT_HIST_BINS-1);
+  }
+  if (hist[bin] == 0xffff) {
+    for (uint8_t i=0;i < PILOT_HIST_BINS;i++) hist[i] >>= 1;
+  }
+  hist[bin]++;
+}
+#endif // PILOT_CLASSIFIER
+
 
 //TABLE A1 - PILOT LINE VOLTAGE RANGES (recommended.. adjust as necessary
 //                           Minimum Nominal Maximum
@@ -1258,8 +1438,11 @@ void J1772EVSEController::Update(uint8_t forcetransition)
       //    allow 3A slop for ammeter inaccuracy
 #ifdef AMMETER
       readAmmeter();
-      long instantma = m_AmmeterReading*m_CurrentScaleFactor - m_AmmeterCurrentOffset;
-      if (instantma < 0) instantma = 0;
+      long instantma = 0;
+      for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+	long ma = calibratedCurrent(ch,m_AmmeterReading[ch]);
+	if (ma > instantma) instantma = ma;
+      }
 #endif // AMMETER
       if ((phigh >= m_ThreshData.m_ThreshBC)
 #ifdef AMMETER
@@ -1322,10 +1505,8 @@ void J1772EVSEController::Update(uint8_t forcetransition)
     tmpevsestate = EVSE_STATE_NO_GROUND;
     m_EvseState = EVSE_STATE_NO_GROUND;
     chargingOff(); // open the relay
-    if ((prevevsestate != EVSE_STATE_NO_GROUND) &&
-        (((uint8_t)(m_NoGndTripCnt+1)) < 254)) {
-      m_NoGndTripCnt++;
-      eeprom_write_byte((uint8_t*)EOFS_NOGND_TRIP_CNT,m_NoGndTripCnt);
+    if (prevevsestate != EVSE_STATE_NO_GROUND) {
+      incTripCnt(&m_NoGndTripCnt,TRIPCNT_NOGND);
     }
     nofault = 0;
   }
@@ -1347,9 +1528,8 @@ void J1772EVSEController::Update(uint8_t forcetransition)
           m_EvseState = EVSE_STATE_NO_GROUND;
           
           chargingOff(); // open the relay
-          if ((prevevsestate != EVSE_STATE_NO_GROUND) && (((uint8_t)(m_NoGndTripCnt+1)) < 254)) {
-            m_NoGndTripCnt++;
-            eeprom_write_byte((uint8_t*)EOFS_NOGND_TRIP_CNT,m_NoGndTripCnt);
+          if (prevevsestate != EVSE_STATE_NO_GROUND) {
+            incTripCnt(&m_NoGndTripCnt,TRIPCNT_NOGND);
           }
           m_NoGndStart = curms;
           
@@ -1399,10 +1579,9 @@ void J1772EVSEController::Update(uint8_t forcetransition)
                  ((curms - m_StuckRelayStartTimeMS) > STUCK_RELAY_DELAY) ) ||  // start delay de-bounce
                (prevevsestate == EVSE_STATE_STUCK_RELAY) ) { // already in error state
             // stuck relay
-            if ((prevevsestate != EVSE_STATE_STUCK_RELAY) && (((uint8_t)(m_StuckRelayTripCnt+1)) < 254)) {
-              m_StuckRelayTripCnt++;
-              eeprom_write_byte((uint8_t*)EOFS_STUCK_RELAY_TRIP_CNT,m_StuckRelayTripCnt);
-            }   
+            if (prevevsestate != EVSE_STATE_STUCK_RELAY) {
+              incTripCnt(&m_StuckRelayTripCnt,TRIPCNT_STUCK_RELAY);
+            }
             tmpevsestate = EVSE_STATE_STUCK_RELAY;
             m_EvseState = EVSE_STATE_STUCK_RELAY;
             nofault = 0;
@@ -1420,10 +1599,7 @@ void J1772EVSEController::Update(uint8_t forcetransition)
     m_EvseState = EVSE_STATE_GFCI_FAULT;
 
     if (prevevsestate != EVSE_STATE_GFCI_FAULT) { // state transition
-      if (((uint8_t)(m_GfiTripCnt+1)) < 254) {
-	m_GfiTripCnt++;
-	eeprom_write_byte((uint8_t*)EOFS_GFI_TRIP_CNT,m_GfiTripCnt);
-      }
+      incTripCnt(&m_GfiTripCnt,TRIPCNT_GFI);
       m_GfiRetryCnt = 0;
       m_GfiFaultStartMs = curms;
     }
@@ -1472,6 +1648,8 @@ if (TempChkEnabled()) {
 
  uint8_t prevpilotstate = m_PilotState;
  uint8_t tmppilotstate = EVSE_STATE_UNKNOWN;
+ uint16_t margin = 0;
+ uint8_t confident = 0;
 
   if (nofault) {
     if ((prevevsestate >= EVSE_FAULT_STATE_BEGIN) &&
@@ -1482,22 +1660,24 @@ if (TempChkEnabled()) {
       m_EvseState = EVSE_STATE_UNKNOWN;
     }
 
+    uint8_t zone = ClassifyPilot(phigh,prevpilotstate,&margin);
     if (DiodeCheckEnabled() && (m_Pilot.GetState() == PILOT_STATE_PWM) && (plow >= m_ThreshData.m_ThreshDS)) {
       // diode check failed
       tmpevsestate = EVSE_STATE_DIODE_CHK_FAILED;
       tmppilotstate = EVSE_STATE_DIODE_CHK_FAILED;
+      margin = 0;
     }
-    else if (phigh >= m_ThreshData.m_ThreshAB) {
+    else if (zone == EVSE_STATE_A) {
       // 12V EV not connected
       tmpevsestate = EVSE_STATE_A;
       tmppilotstate = EVSE_STATE_A;
     }
-    else if (phigh >= m_ThreshData.m_ThreshBC) {
+    else if (zone == EVSE_STATE_B) {
       // 9V EV connected, waiting for ready to charge
       tmpevsestate = EVSE_STATE_B;
       tmppilotstate = EVSE_STATE_B;
     }
-    else if (phigh  >= m_ThreshData.m_ThreshCD) {
+    else if (zone == EVSE_STATE_C) {
       // 6V ready to charge
       tmppilotstate = EVSE_STATE_C;
       if (m_Pilot.GetState() == PILOT_STATE_PWM) {
@@ -1508,7 +1688,7 @@ if (TempChkEnabled()) {
 	tmpevsestate = EVSE_STATE_B;
       }
     }
-    else if (phigh > m_ThreshData.m_ThreshD) {
+    else if (zone == EVSE_STATE_D) {
       tmppilotstate = EVSE_STATE_D;
       // 3V ready to charge vent required
       if (VentReqEnabled()) {
@@ -1552,12 +1732,22 @@ if (TempChkEnabled()) {
     }
 #endif // FT_ENDURANCE
 
+#ifdef PILOT_CLASSIFIER
+    // confidence = consecutive readings in the same state, clear of the
+    // thresholds. a confident state is committed w/o waiting out the delay
+    if (margin < PILOT_FAST_MARGIN) m_PilotConfCnt = 0;
+    else if (tmppilotstate != m_TmpPilotState) m_PilotConfCnt = 1;
+    else if (m_PilotConfCnt < PILOT_CONFIRM_CNT) m_PilotConfCnt++;
+    confident = (m_PilotConfCnt >= PILOT_CONFIRM_CNT);
+#endif // PILOT_CLASSIFIER
+
     // debounce state transitions
     if (tmpevsestate != prevevsestate) {
       if (tmpevsestate != m_TmpEvseState) {
         m_TmpEvseStateStart = curms;
       }
-      else if ((curms - m_TmpEvseStateStart) >= ((tmpevsestate == EVSE_STATE_A) ? DELAY_STATE_TRANSITION_A : DELAY_STATE_TRANSITION)) {
+      else if (confident ||
+	       ((curms - m_TmpEvseStateStart) >= ((tmpevsestate == EVSE_STATE_A) ? DELAY_STATE_TRANSITION_A : DELAY_STATE_TRANSITION))) {
         m_EvseState = tmpevsestate;
       }
     }
@@ -1568,11 +1758,18 @@ if (TempChkEnabled()) {
     if (tmppilotstate != m_TmpPilotState) {
       m_TmpPilotStateStart = curms;
     }
-    else if ((curms - m_TmpPilotStateStart) >= DELAY_STATE_TRANSITION) {
+    else if (confident || ((curms - m_TmpPilotStateStart) >= DELAY_STATE_TRANSITION)) {
       m_PilotState = tmppilotstate;
     }
   }
 
+#ifdef PILOT_CLASSIFIER
+  if (nofault && (m_Pilot.GetState() != PILOT_STATE_N12) &&
+      (m_PilotState >= EVSE_STATE_A) && (m_PilotState <= EVSE_STATE_D)) {
+    pilotHistAdd(phigh);
+  }
+#endif // PILOT_CLASSIFIER
+
 
   m_TmpPilotState = tmppilotstate;
   m_TmpEvseState = tmpevsestate;
@@ -1639,6 +1836,12 @@ if (TempChkEnabled()) {
   
   // state transition
   if (forcetransition || (m_EvseState != prevevsestate)) {
+#ifdef CURRENT_REGULATION
+    regReset(); // each session starts unregulated
+#endif
+#ifdef CURRENT_RAMP
+    m_RampDa = 0;
+#endif
     if (m_EvseState == EVSE_STATE_A) { // EV not connected
       chargingOff(); // turn off charging current
       m_Pilot.SetState(PILOT_STATE_P12);
@@ -1667,14 +1870,21 @@ if (TempChkEnabled()) {
 	m_Pilot.SetState(PILOT_STATE_P12);
       }
       else {
-	m_Pilot.SetPWM(m_CurrentCapacity);
+	m_Pilot.SetPWMDa(pilotDa());
       }
 #else
-      m_Pilot.SetPWM(m_CurrentCapacity);
+      m_Pilot.SetPWMDa(pilotDa());
 #endif // AUTH_LOCK
     }
     else if (m_EvseState == EVSE_STATE_C) {
-      m_Pilot.SetPWM(m_CurrentCapacity);
+#ifdef CURRENT_RAMP
+      // soft start - ramp up from the minimum
+      if (m_RampRate && (setpointDa() > MIN_CURRENT_CAPACITY_J1772*10)) {
+	m_RampDa = MIN_CURRENT_CAPACITY_J1772*10;
+	m_RampMs = millis();
+      }
+#endif
+      m_Pilot.SetPWMDa(pilotDa());
 #if defined(UL_GFI_SELFTEST) && !defined(NOCHECKS)
       // test GFI before closing relay
       if (GfiSelfTestEnabled() && m_Gfi.SelfTest()) {
@@ -1728,7 +1938,7 @@ if (TempChkEnabled()) {
       // must leave pilot on so we can keep checking
       // N.B. J1772 specifies to go to State F (-12V) but we can't do that
       // and keep checking
-      m_Pilot.SetPWM(m_CurrentCapacity);
+      m_Pilot.SetPWMDa(pilotDa());
       m_Pilot.SetState(PILOT_STATE_P12);
       HardFault(1);
     }
@@ -1768,6 +1978,11 @@ if (TempChkEnabled()) {
       Serial.println(phigh);
     }
 #endif //#ifdef SERDBG
+
+#ifdef SETTINGS_CACHE
+    // don't leave setting changes pending across state changes
+    g_EeSettings.Commit();
+#endif
   } // state transition
 
 #ifdef AUTH_LOCK
@@ -1793,7 +2008,7 @@ if (TempChkEnabled()) {
   ReadVoltmeter();
 #endif // VOLTMETER
 #ifdef AMMETER
-  if (((m_EvseState == EVSE_STATE_C) && (m_CurrentScaleFactor > 0))
+  if (((m_EvseState == EVSE_STATE_C) && (m_CurrentScaleFactor[0] > 0))
 #ifdef ECVF_AMMETER_CAL  
       || AmmeterCalEnabled()
 #endif
@@ -1801,21 +2016,52 @@ if (TempChkEnabled()) {
     
 #ifndef FAKE_CHARGING_CURRENT
     readAmmeter();
-    uint32_t ma = MovingAverage(m_AmmeterReading);
-    if (ma != 0xffffffff) {
-      m_ChargingCurrent = ma * m_CurrentScaleFactor - m_AmmeterCurrentOffset;  // subtract it
-      if (m_ChargingCurrent < 0) {
-	m_ChargingCurrent = 0;
+    uint32_t ma[AMMETER_CHANNELS];
+    if (MovingAverage(m_AmmeterReading,ma)) {
+      // m_ChargingCurrent is the highest phase current, since that's
+      // what the pilot limits
+      m_ChargingCurrent = 0;
+      for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+	int32_t phasema = calibratedCurrent(ch,ma[ch]);
+#if AMMETER_CHANNELS > 1
+	m_PhaseCurrent[ch] = phasema;
+#endif
+	if (phasema > m_ChargingCurrent) m_ChargingCurrent = phasema;
       }
       g_OBD.SetAmmeterDirty(1);
+#ifdef CURRENT_REGULATION
+      if (m_EvseState == EVSE_STATE_C) regulateCurrent();
+#endif
     }
 #endif // !FAKE_CHARGING_CURRENT
   }
+#ifdef MAINS_CT
+  else if (m_MainsLimit && (m_EvseState == EVSE_STATE_B)) {
+    // limit the pilot before the EV starts drawing
+    readAmmeter();
+  }
+  if (m_MainsLimit &&
+      ((m_EvseState == EVSE_STATE_B) || (m_EvseState == EVSE_STATE_C))) {
+    mainsLimit();
+  }
+#endif // MAINS_CT
+#ifdef EXT_SETPOINT
+  extService();
+#endif
+#ifdef CURRENT_RAMP
+  rampService();
+#endif
 
 #ifdef OVERCURRENT_THRESHOLD
   if (m_EvseState == EVSE_STATE_C) {
     //testing    m_ChargingCurrent = (m_CurrentCapacity+OVERCURRENT_THRESHOLD+12)*1000L;
-    if (m_ChargingCurrent >= ((m_CurrentCapacity+OVERCURRENT_THRESHOLD)*1000L)) {
+#ifdef CURRENT_RAMP
+    // while ramping down, the EV follows the pilot
+    uint8_t ocamps = (m_RampDa > GetCurrentCapacityDa()) ? (m_RampDa+9)/10 : m_CurrentCapacity;
+#else
+    uint8_t ocamps = m_CurrentCapacity;
+#endif
+    if (m_ChargingCurrent >= ((ocamps+OVERCURRENT_THRESHOLD)*1000L)) {
       if (m_OverCurrentStartMs) { // already in overcurrent state
 	if ((millis()-m_OverCurrentStartMs) >= OVERCURRENT_TIMEOUT) {
 	  //
@@ -1855,7 +2101,9 @@ if (TempChkEnabled()) {
     this->HsExpirationCheck();  //Check to see if HS is engaged, and if so whether we missed a pulse
 #endif //HEARTBEAT_SUPERVISION
 
-#ifdef TEMPERATURE_MONITORING
+#ifdef TEMPERATURE_DERATE
+    thermDerate();
+#elif defined(TEMPERATURE_MONITORING)
     if(TempChkEnabled()) {
       uint8_t currcap = GetMaxCurrentCapacity();
       uint8_t setit = 0;
@@ -1878,9 +2126,9 @@ if (TempChkEnabled()) {
         else {
 	  g_TempMonitor.SetOverTemperatureShutdown(setit-3);
 	}
-	SetCurrentCapacity(currcap,0,1);
+	SetCurrentCapacity(currcap,0,1,1);
     	if (m_Pilot.GetState() != PILOT_STATE_PWM) {
-    	  m_Pilot.SetPWM(m_CurrentCapacity);
+    	  m_Pilot.SetPWMDa(pilotDa());
         }
       }
     }
@@ -1891,7 +2139,7 @@ if (TempChkEnabled()) {
     m_ElapsedChargeTime = (millis() - m_ChargeOnTimeMS) / 1000;
 
 
-#ifdef TEMPERATURE_MONITORING
+#if defined(TEMPERATURE_MONITORING) && !defined(TEMPERATURE_DERATE)
   if(TempChkEnabled()) {
     if (m_ElapsedChargeTime != m_ElapsedChargeTimePrev) {
       uint8_t currcap = GetMaxCurrentCapacity();
@@ -1916,9 +2164,9 @@ if (TempChkEnabled()) {
         else {
 	  g_TempMonitor.SetOverTemperatureShutdown(setit-3);
 	}
-	SetCurrentCapacity(currcap,0,1);
+	SetCurrentCapacity(currcap,0,1,1);
     	if (m_Pilot.GetState() != PILOT_STATE_PWM) {
-    	  m_Pilot.SetPWM(m_CurrentCapacity);
+    	  m_Pilot.SetPWMDa(pilotDa());
         }
       }
     }
@@ -1926,13 +2174,21 @@ if (TempChkEnabled()) {
 #endif // TEMPERATURE_MONITORING
 
 #ifdef CHARGE_LIMIT
-    if (m_chargeLimitTotWs && (g_EnergyMeter.GetSessionWs() >= m_chargeLimitTotWs)) {
-      ClrChargeLimit(); // clear charge limit
+    if (m_chargeLimitTotWs) {
+      // n.b. GetSessionWs() lags by up to KWH_CALC_INTERVAL_MS, so project
+      // it to now, and stop on the loop pass where the limit is crossed
+      uint32_t ws = g_EnergyMeter.GetSessionWsNow();
+      if (ws >= m_chargeLimitTotWs) {
+	ClrChargeLimit(); // clear charge limit
 #ifdef TIME_LIMIT
-      ClrTimeLimit(); // clear time limit
+	ClrTimeLimit(); // clear time limit
 #endif // TIME_LIMIT
-      SetLimitSleep(1);
-      Sleep();
+	SetLimitSleep(1);
+	Sleep();
+      }
+      else {
+	chargeLimitRamp(m_chargeLimitTotWs - ws);
+      }
     }
 #endif
 #ifdef TIME_LIMIT
@@ -2011,9 +2267,13 @@ void J1772EVSEController::Calibrate(PCALIB_DATA pcd)
 }
 #endif // CALIBRATE
 
-int J1772EVSEController::SetCurrentCapacity(uint8_t amps,uint8_t updatelcd,uint8_t nosave)
+// da: 0.1A. only whole amps are saved to EEPROM
+int J1772EVSEController::SetCurrentCapacityDa(uint16_t da,uint8_t updatelcd,uint8_t nosave,uint8_t now)
 {
   int rc = 0;
+#ifdef CURRENT_RAMP
+  uint16_t prevda = pilotDa();
+#endif
   uint8_t maxcurrentcap = (GetCurSvcLevel() == 1) ? MAX_CURRENT_CAPACITY_L1 : m_MaxHwCurrentCapacity;
 
   if (nosave) {
@@ -2030,10 +2290,12 @@ int J1772EVSEController::SetCurrentCapacity(uint8_t amps,uint8_t updatelcd,uint8
   }
 #endif // PP_AUTO_AMPACITY
 
-  if ((amps >= MIN_CURRENT_CAPACITY_J1772) && (amps <= maxcurrentcap)) {
-    m_CurrentCapacity = amps;
+  m_CurrentCapacityFrac = 0;
+  if ((da >= MIN_CURRENT_CAPACITY_J1772*10) && (da <= maxcurrentcap*10)) {
+    m_CurrentCapacity = da / 10;
+    m_CurrentCapacityFrac = da % 10;
   }
-  else if (amps < MIN_CURRENT_CAPACITY_J1772) {
+  else if (da < MIN_CURRENT_CAPACITY_J1772*10) {
     m_CurrentCapacity = MIN_CURRENT_CAPACITY_J1772;
     rc = 1;
   }
@@ -2046,11 +2308,17 @@ int J1772EVSEController::SetCurrentCapacity(uint8_t amps,uint8_t updatelcd,uint8
 	#ifdef DEBUG_HS
 	  Serial.println(F("SetCurrentCapacity: Writing to EEPROM!"));
 	#endif
-    eeprom_write_byte((uint8_t*)((GetCurSvcLevel() == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2),(byte)m_CurrentCapacity);
+    EeWriteByte((GetCurSvcLevel() == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2,(byte)m_CurrentCapacity);
   }
 
+#ifdef CURRENT_REGULATION
+  regReset(); // restart from the new target
+#endif
+#ifdef CURRENT_RAMP
+  rampHold(prevda,now);
+#endif
   if (m_Pilot.GetState() == PILOT_STATE_PWM) {
-    m_Pilot.SetPWM(m_CurrentCapacity);
+    m_Pilot.SetPWMDa(pilotDa());
   }
 
   if (updatelcd) {
@@ -2060,6 +2328,165 @@ int J1772EVSEController::SetCurrentCapacity(uint8_t amps,uint8_t updatelcd,uint8
   return rc;
 }
 
+// call after a limit in targetDa() has changed. prevda: pilotDa() before
+// the change. now: a decrease skips the CURRENT_RAMP
+void J1772EVSEController::pilotChanged(uint16_t prevda,uint8_t now)
+{
+#ifdef CURRENT_REGULATION
+  regReset();
+#endif
+#ifdef CURRENT_RAMP
+  rampHold(prevda,now);
+#endif
+  if ((m_Pilot.GetState() == PILOT_STATE_PWM) && (pilotDa() != prevda)) {
+    m_Pilot.SetPWMDa(pilotDa());
+  }
+}
+
+#ifdef TOU_SCHEDULE
+// amps: limit of the current delay timer window, 0 = none
+void J1772EVSEController::SetTouLimit(uint8_t amps)
+{
+  if (amps != m_TouAmps) {
+    uint16_t prevda = pilotDa();
+    m_TouAmps = amps;
+    pilotChanged(prevda,0);
+  }
+}
+#endif // TOU_SCHEDULE
+
+#ifdef TEMPERATURE_DERATE
+// limit the pilot to g_TempMonitor's derating of the max current capacity
+void J1772EVSEController::thermDerate()
+{
+  uint8_t pct = TempChkEnabled() ? g_TempMonitor.GetDeratePct() : 100;
+  uint16_t da = 0;
+  if (pct < 100) {
+    da = ((uint16_t)GetMaxCurrentCapacity() * pct) / 10;
+    if (da < MIN_CURRENT_CAPACITY_J1772*10) da = MIN_CURRENT_CAPACITY_J1772*10;
+  }
+  if (da != m_ThermDa) {
+    uint16_t prevda = pilotDa();
+    m_ThermDa = da;
+    pilotChanged(prevda,1);
+  }
+}
+#endif // TEMPERATURE_DERATE
+
+#ifdef EXT_SETPOINT
+void J1772EVSEController::setExtDa(uint16_t da,uint8_t now)
+{
+  if (da != m_ExtDa) {
+    uint16_t prevda = pilotDa();
+    m_ExtDa = da;
+    pilotChanged(prevda,now);
+  }
+}
+
+// da: 0.1A, 0 = none. volatile, and w/o LCD update or $AT, so it can be
+// called several times per second. restarts the watchdog
+int J1772EVSEController::SetExtSetpointDa(uint16_t da)
+{
+  int rc = 0;
+  if (da && (da < MIN_CURRENT_CAPACITY_J1772*10)) {
+    da = MIN_CURRENT_CAPACITY_J1772*10;
+    rc = 1;
+  }
+  m_ExtMs = millis();
+  m_ExtExpired = 0;
+  setExtDa(da,0);
+  return rc;
+}
+
+// timeoutms: 0 = no watchdog
+void J1772EVSEController::SetExtWatchdog(uint16_t timeoutms,uint16_t fallbackda)
+{
+  if (fallbackda < MIN_CURRENT_CAPACITY_J1772*10) {
+    fallbackda = MIN_CURRENT_CAPACITY_J1772*10;
+  }
+  m_ExtTimeoutMs = timeoutms;
+  m_ExtFallbackDa = fallbackda;
+  m_ExtMs = millis();
+}
+
+// apply a setpoint received by the TWI ISR, and fall back to
+// m_ExtFallbackDa if the controller stops sending
+void J1772EVSEController::extService()
+{
+  if (m_ExtRxDa != EXTSP_NONE) {
+    uint16_t da;
+    {
+      AutoCriticalSection acs;
+      da = m_ExtRxDa;
+      m_ExtRxDa = EXTSP_NONE;
+    }
+    SetExtSetpointDa(da);
+  }
+
+  if (m_ExtDa && m_ExtTimeoutMs && !m_ExtExpired &&
+      ((millis() - m_ExtMs) >= m_ExtTimeoutMs)) {
+    m_ExtExpired = 1;
+    if (m_ExtFallbackDa < m_ExtDa) setExtDa(m_ExtFallbackDa,1);
+  }
+}
+#endif // EXT_SETPOINT
+
+#ifdef CURRENT_RAMP
+// rate: A/s, 0 = disabled
+void J1772EVSEController::SetRampRate(uint8_t rate)
+{
+  m_RampRate = rate;
+  EeWriteByte(EOFS_RAMP_RATE,rate);
+  if (!rate && m_RampDa) {
+    m_RampDa = 0;
+    m_Pilot.SetPWMDa(pilotDa());
+  }
+}
+
+// call after the pilot setpoint has changed. prevda: pilotDa() before
+// the change.
+// in State C, the pilot is held at prevda, and rampService() slews it to
+// setpointDa(). now: a decrease takes effect at once
+void J1772EVSEController::rampHold(uint16_t prevda,uint8_t now)
+{
+  uint16_t da = setpointDa();
+  if (!m_RampRate || (m_EvseState != EVSE_STATE_C) || (now && (da <= prevda))) {
+    m_RampDa = 0;
+  }
+  else if (da != prevda) {
+    if (!m_RampDa) m_RampMs = millis();
+    m_RampDa = prevda;
+  }
+}
+
+// slew the pilot toward setpointDa() at m_RampRate, in steps of at least
+// CURRENT_RAMP_STEP_MS. called every Update()
+void J1772EVSEController::rampService()
+{
+  if (!m_RampDa) return;
+  if (m_Pilot.GetState() != PILOT_STATE_PWM) {
+    m_RampDa = 0;
+    return;
+  }
+
+  unsigned long dt = millis() - m_RampMs;
+  if (dt < CURRENT_RAMP_STEP_MS) return;
+  // A/s = 0.1A per 100ms
+  uint32_t step = (dt * m_RampRate) / 100;
+  m_RampMs += (step * 100UL) / m_RampRate; // keep the remainder
+
+  uint16_t da = setpointDa();
+  if (da > m_RampDa) {
+    m_RampDa = (da - m_RampDa > step) ? m_RampDa + step : da;
+  }
+  else {
+    m_RampDa = (m_RampDa - da > step) ? m_RampDa - step : da;
+  }
+  if (m_RampDa == da) m_RampDa = 0; // done
+  m_Pilot.SetPWMDa(pilotDa());
+}
+#endif // CURRENT_RAMP
+
 #ifdef HEARTBEAT_SUPERVISION
 //Set the interval to 0 to suspend Heartbeat Supervision
 int J1772EVSEController::HeartbeatSupervision(uint16_t interval, uint8_t amps) {
@@ -2080,19 +2507,19 @@ int J1772EVSEController::HeartbeatSupervision(uint16_t interval, uint8_t amps) {
 	Serial.print(F("m_IFallback is: "));
 	Serial.println(m_IFallback);
   #endif
-  if (eeprom_read_word((uint16_t*)EOFS_HEARTBEAT_SUPERVISION_INTERVAL) != m_HsInterval) { //only write EEPROM if it is needful!
+  if (EeReadWord(EOFS_HEARTBEAT_SUPERVISION_INTERVAL) != m_HsInterval) { //only write EEPROM if it is needful!
     #ifdef DEBUG_HS
 	  Serial.print(F("Writing new m_HsInterval to EEPROM: "));
 	  Serial.println(m_HsInterval);
     #endif
-	eeprom_write_word((uint16_t*)EOFS_HEARTBEAT_SUPERVISION_INTERVAL, m_HsInterval);
+	EeWriteWord(EOFS_HEARTBEAT_SUPERVISION_INTERVAL, m_HsInterval);
   }
-  if (eeprom_read_byte((uint8_t*)EOFS_HEARTBEAT_SUPERVISION_CURRENT) != m_IFallback) { //only write EEPROM if it is needful!
+  if (EeReadByte(EOFS_HEARTBEAT_SUPERVISION_CURRENT) != m_IFallback) { //only write EEPROM if it is needful!
     #ifdef DEBUG_HS
 	  Serial.print(F("Writing new m_IFallback to EEPROM: "));
 	  Serial.println(m_IFallback);
     #endif
-    eeprom_write_byte((uint8_t*)EOFS_HEARTBEAT_SUPERVISION_CURRENT, m_IFallback);
+    EeWriteByte(EOFS_HEARTBEAT_SUPERVISION_CURRENT, m_IFallback);
   }
   return 0; // No error codes yet
 }
@@ -2162,7 +2589,7 @@ int J1772EVSEController::HsExpirationCheck() {
 	  #ifdef DEBUG_HS
 	    Serial.println(F("HsExpirationCheck: Reducing Current capacity"));
 	  #endif
-      rc=SetCurrentCapacity(m_IFallback,1,1);  //Drop the current, update the display, and do not write it to EEPROM 	  
+      rc=SetCurrentCapacity(m_IFallback,1,1,1);  //Drop the current, update the display, and do not write it to EEPROM 	  
     }
     //m_HsInterval timed out, and as a result we may have to perturb the system ampacity setting.
     //We flag that here by setting m_HsTriggered = HS_MISSEDPULSE_NOACK
@@ -2236,9 +2663,9 @@ unsigned long J1772EVSEController::GetResetMs()
 void J1772EVSEController::SetVoltmeter(uint16_t scale,uint32_t offset)
 {
   m_VoltScaleFactor = scale;
-  eeprom_write_word((uint16_t*)EOFS_VOLT_SCALE_FACTOR,scale);
+  EeWriteWord(EOFS_VOLT_SCALE_FACTOR,scale);
   m_VoltOffset = offset;
-  eeprom_write_dword((uint32_t*)EOFS_VOLT_OFFSET,offset);
+  EeWriteDword(EOFS_VOLT_OFFSET,offset);
 }
 
 uint32_t J1772EVSEController::ReadVoltmeter()
@@ -2254,14 +2681,15 @@ uint32_t J1772EVSEController::ReadVoltmeter()
 #endif // VOLTMETER
 
 #ifdef CHARGE_LIMIT
-void J1772EVSEController::SetChargeLimitkWh(uint8_t kwh)
-{
-  if (kwh) {
-    m_chargeLimitkWh = kwh;
-    // extend session by kwh
-    //    m_chargeLimitTotWs = g_EnergyMeter.GetSessionWs() + (3600000ul * (uint32_t)kwh);
-    // set session kwh limit
-    m_chargeLimitTotWs = (3600000ul * (uint32_t)kwh);
+void J1772EVSEController::SetChargeLimitWh(uint32_t wh)
+{
+  if (wh) {
+    if (wh > MAX_CHARGE_LIMIT_WH) wh = MAX_CHARGE_LIMIT_WH;
+    // extend session by wh
+    //    m_chargeLimitTotWs = g_EnergyMeter.GetSessionWs() + (3600ul * wh);
+    // set session wh limit
+    m_chargeLimitTotWs = 3600ul * wh;
+    chargeLimitRampClr(); // the ramp was for the old limit
 #ifdef DELAYTIMER
   g_DelayTimer.SetManualOverride();
 #endif // DELAYTIMER
@@ -2274,8 +2702,201 @@ void J1772EVSEController::SetChargeLimitkWh(uint8_t kwh)
 #endif // DELAYTIMER
   }
 }
+
+void J1772EVSEController::ClrChargeLimit()
+{
+  m_chargeLimitTotWs = 0;
+  clrVFlags(ECVF_CHARGE_LIMIT);
+  chargeLimitRampClr();
+}
+
+// put the pilot back up after a chargeLimitRamp()
+void J1772EVSEController::chargeLimitRampClr()
+{
+  if (m_chargeLimitAmps) {
+    uint16_t prevda = pilotDa();
+    m_chargeLimitAmps = 0;
+    pilotChanged(prevda,0);
+  }
+}
+
+// remws: Ws left until the limit.
+// once less than CHARGE_LIMIT_RAMP_SECS of charging at the present power
+// remains, lower the pilot so that the rest would take CHARGE_LIMIT_RAMP_SECS
+// at the new current. the EV reaches the limit at low power, so the energy
+// delivered while it responds to Sleep() is small. the pilot only goes down
+// until the limit is cleared
+void J1772EVSEController::chargeLimitRamp(uint32_t remws)
+{
+  if (m_Pilot.GetState() != PILOT_STATE_PWM) return;
+
+  uint32_t w = g_EnergyMeter.GetPowerW();
+  if (!w || (m_ChargingCurrent <= 0) ||
+      (remws >= w * CHARGE_LIMIT_RAMP_SECS)) return;
+
+  // power is proportional to current, so scale the present current
+  uint32_t ma = (uint32_t)(((uint64_t)m_ChargingCurrent * remws) / (w * CHARGE_LIMIT_RAMP_SECS));
+  uint8_t amps = (ma + 999) / 1000;
+  if (amps < MIN_CURRENT_CAPACITY_J1772) amps = MIN_CURRENT_CAPACITY_J1772;
+  if (!m_chargeLimitAmps || (amps < m_chargeLimitAmps)) {
+    uint16_t prevda = pilotDa();
+    m_chargeLimitAmps = amps;
+    pilotChanged(prevda,1);
+  }
+}
 #endif // CHARGE_LIMIT
 
+#ifdef DUOSHARE
+// da: this EVSE's share of the group capacity in 0.1A, 0 = no limit
+void J1772EVSEController::SetShareDa(uint16_t da)
+{
+  if (da != m_ShareDa) {
+    uint16_t prevda = pilotDa();
+    m_ShareDa = da;
+    pilotChanged(prevda,1); // the circuit may be overloaded
+  }
+}
+#endif // DUOSHARE
+
+#ifdef MAINS_CT
+// amps: site limit, 0 = disabled
+void J1772EVSEController::SetMainsLimit(uint8_t amps)
+{
+  m_MainsLimit = amps;
+  EeWriteByte(EOFS_MAINS_LIMIT,amps);
+}
+
+// called each time readAmmeter() runs in State B/C.
+// the headroom is the site limit minus the site load other than this EVSE,
+// w/ the mains and charging current measured over the same mains cycles.
+// like the temperature throttling, the current capacity is set w/o saving.
+// it's cut back as soon as the headroom drops below it, and raised back
+// up toward GetMaxCurrentCapacity() once the headroom has been at least
+// MAINS_RAISE_DA higher for MAINS_RAISE_MS
+void J1772EVSEController::mainsLimit()
+{
+  m_MainsCurrent = calibratedCurrent(MAINS_CT_CH,m_AmmeterReading[MAINS_CT_CH]);
+  int32_t otherma = m_MainsCurrent;
+  if (m_EvseState == EVSE_STATE_C) {
+    int32_t evma = 0;
+    for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+      int32_t ma = calibratedCurrent(ch,m_AmmeterReading[ch]);
+      if (ma > evma) evma = ma;
+    }
+    otherma -= evma;
+    if (otherma < 0) otherma = 0;
+  }
+
+  int32_t availda = ((int32_t)m_MainsLimit*1000L - otherma) / 100 - MAINS_MARGIN_DA;
+  int32_t maxda = GetMaxCurrentCapacity()*10;
+  if (availda > maxda) availda = maxda;
+  if (availda < MIN_CURRENT_CAPACITY_J1772*10) availda = MIN_CURRENT_CAPACITY_J1772*10;
+
+  unsigned long curms = millis();
+  int32_t curda = GetCurrentCapacityDa();
+  if (availda < curda) {
+    m_MainsThrottled = 1;
+    SetCurrentCapacityDa(availda,0,1,1);
+    m_MainsRaiseMs = curms;
+  }
+  else if (!m_MainsThrottled || (availda < curda + MAINS_RAISE_DA)
+#ifdef TEMPERATURE_MONITORING
+	   || g_TempMonitor.OverTemperature()
+#endif
+	   ) {
+    m_MainsRaiseMs = curms;
+  }
+  else if ((curms - m_MainsRaiseMs) >= MAINS_RAISE_MS) {
+    SetCurrentCapacityDa(availda,0,1);
+    if (availda == maxda) m_MainsThrottled = 0;
+    m_MainsRaiseMs = curms;
+  }
+}
+#endif // MAINS_CT
+
+#ifdef CURRENT_REGULATION
+void J1772EVSEController::EnableCurrentReg(uint8_t tf)
+{
+  if (tf) {
+    m_wFlags |= ECF_CURRENT_REG;
+  }
+  else {
+    m_wFlags &= ~ECF_CURRENT_REG;
+    if (m_RegDa) {
+      uint16_t prevda = pilotDa();
+      regReset();
+      pilotChanged(prevda,0);
+    }
+  }
+  SaveEvseFlags();
+}
+
+// go back to advertising targetDa(). the caller updates the pilot
+void J1772EVSEController::regReset()
+{
+  m_RegDa = 0;
+}
+
+// closed loop current regulation, called in State C each time
+// m_ChargingCurrent is updated. adjusts the pilot so that the measured
+// current tracks targetDa(), for EVs that draw more or less than advertised.
+// velocity form PI in 0.1A: the pilot itself is the integral, so clamping
+// it to [MIN_CURRENT_CAPACITY_J1772,targetDa()+CURRENT_REG_MAX_BOOST_DA] is
+// the anti-windup. increases are slew limited to CURRENT_REG_SLEW_DA per
+// step. when the EV is more than CURRENT_REG_OVER_DA over the target, the
+// whole overshoot is cut at once, w/o waiting for the next step
+void J1772EVSEController::regulateCurrent()
+{
+  if (!CurrentRegEnabled() || (m_Pilot.GetState() != PILOT_STATE_PWM)) return;
+#ifdef CURRENT_RAMP
+  if (m_RampDa) return; // the EV hasn't caught up yet
+#endif
+
+  unsigned long curms = millis();
+  int16_t tgt = targetDa();
+  int16_t measda = m_ChargingCurrent / 100;
+  int16_t e = tgt - measda;
+
+  if (!m_RegDa) {
+    m_RegDa = tgt;
+    m_RegErr = e;
+    m_RegMs = curms;
+    return;
+  }
+
+  int16_t out = m_RegDa;
+  unsigned long dt = curms - m_RegMs;
+  if ((e < -CURRENT_REG_OVER_DA) && (dt >= CURRENT_REG_FAST_MS)) {
+    out += e;
+    e = 0; // no proportional kick on the next step
+  }
+  else if (dt >= CURRENT_REG_STEP_MS) {
+    int16_t delta = (CURRENT_REG_KP*(e - m_RegErr) + CURRENT_REG_KI*e) / 16;
+    if (delta > CURRENT_REG_SLEW_DA) delta = CURRENT_REG_SLEW_DA;
+    out += delta;
+    // an EV that isn't following the pilot (still ramping up, or limited
+    // by its onboard charger) would just wind the pilot up to the max
+    if ((out > tgt) && (measda < m_RegDa - CURRENT_REG_FOLLOW_DA)) {
+      out = tgt;
+    }
+  }
+  else return;
+
+  m_RegErr = e;
+  m_RegMs = curms;
+
+  int16_t maxda = ((GetCurSvcLevel() == 1) ? MAX_CURRENT_CAPACITY_L1 : m_MaxHwCurrentCapacity) * 10;
+  if (maxda > tgt + CURRENT_REG_MAX_BOOST_DA) maxda = tgt + CURRENT_REG_MAX_BOOST_DA;
+  if (out > maxda) out = maxda;
+  if (out < MIN_CURRENT_CAPACITY_J1772*10) out = MIN_CURRENT_CAPACITY_J1772*10;
+
+  if (out != (int16_t)m_RegDa) {
+    m_RegDa = out;
+    m_Pilot.SetPWMDa(out);
+  }
+}
+#endif // CURRENT_REGULATION
+
 #ifdef TIME_LIMIT
 void J1772EVSEController::SetTimeLimit15(uint8_t mind15)
 {
@@ -2303,12 +2924,12 @@ void J1772EVSEController::SetTimeLimit15(uint8_t mind15)
 uint8_t J1772EVSEController::SetMaxHwCurrentCapacity(uint8_t amps)
 {
   if ((amps >= MIN_CURRENT_CAPACITY_J1772) && (amps <= MAX_CURRENT_CAPACITY_L2)) {
-    uint8_t eamps = eeprom_read_byte((uint8_t*)EOFS_MAX_HW_CURRENT_CAPACITY);
+    uint8_t eamps = EeReadByte(EOFS_MAX_HW_CURRENT_CAPACITY);
     if (!eamps || (eamps == (uint8_t)0xff)) {  // never been written
-      eeprom_write_byte((uint8_t*)EOFS_MAX_HW_CURRENT_CAPACITY,amps);
+      EeWriteByte(EOFS_MAX_HW_CURRENT_CAPACITY,amps);
       m_MaxHwCurrentCapacity = amps;
       if (m_CurrentCapacity > m_MaxHwCurrentCapacity) {
-	SetCurrentCapacity(amps,1,1);
+	SetCurrentCapacity(amps,1,1,1);
       }
       return 0;
     }
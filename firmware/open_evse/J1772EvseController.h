@@ -84,6 +84,7 @@ typedef uint8_t (*EvseStateTransitionReqFunc)(uint8_t prevPilotState,uint8_t cur
 #define ECF_GFI_TEST_DISABLED  0x0200 // no GFI self test
 #define ECF_TEMP_CHK_DISABLED  0x0400 // no Temperature Monitoring
 #define ECF_CGMI               0x1000 // continuous GMI
+#define ECF_CURRENT_REG        0x2000 // closed loop current regulation
 #define ECF_BUTTON_DISABLED    0x8000 // front panel button disabled
 #define ECF_DEFAULT            0x0000
 
@@ -113,6 +114,10 @@ typedef uint8_t (*EvseStateTransitionReqFunc)(uint8_t prevPilotState,uint8_t cur
 // used for RapiSendEvseState
 #define ECVF_CHANGED_TEST (ECVF_AUTH_LOCKED|ECVF_EV_CONNECTED|ECVF_TIME_LIMIT|ECVF_CHARGE_LIMIT|ECVF_HARD_FAULT)
 
+#ifdef EXT_SETPOINT
+#define EXTSP_NONE 0xffff // m_ExtRxDa - nothing received
+#endif
+
 
 #define HS_INTERVAL_DEFAULT     0x0000  //By default, on an unformatted EEPROM, Heartbeat Supervision is not activated
 #define HS_IFALLBACK_DEFAULT    0x00    //By default, on an unformatted EEPROM, HS fallback current is 0 Amperes 
@@ -140,7 +145,7 @@ class J1772EVSEController {
 #endif // GFI
   AdcPin adcPilot;
 #ifdef CURRENT_PIN
-  AdcPin adcCurrent;
+  AdcPin adcCurrent[AMMETER_ADC_CNT];
 #endif
 #ifdef VOLTMETER_PIN
   AdcPin adcVoltMeter;
@@ -190,6 +195,7 @@ class J1772EVSEController {
   unsigned long m_TmpPilotStateStart;
   uint8_t m_MaxHwCurrentCapacity; // max L2 amps that can be set
   uint8_t m_CurrentCapacity; // max amps we can output
+  uint8_t m_CurrentCapacityFrac; // + 0.1A, 0-9
   unsigned long m_ChargeOnTimeMS; // millis() when relay last closed
   unsigned long m_ChargeOffTimeMS; // millis() when relay last opened
   time_t m_ElapsedChargeTime;
@@ -254,23 +260,127 @@ class J1772EVSEController {
   void chargingOn();
   void chargingOff();
   uint8_t chargingIsOn() { return vFlagIsSet(ECVF_CHARGING_ON); }
+  // current the EV should draw in 0.1A. can be lower than
+  // GetCurrentCapacityDa()
+  uint16_t targetDa() {
+    uint16_t da = GetCurrentCapacityDa();
+#ifdef DUOSHARE
+    if (m_ShareDa && (m_ShareDa < da)) da = m_ShareDa;
+#endif
+#ifdef CHARGE_LIMIT
+    if (m_chargeLimitAmps && (m_chargeLimitAmps*10 < da)) da = m_chargeLimitAmps*10;
+#endif
+#ifdef EXT_SETPOINT
+    if (m_ExtDa && (m_ExtDa < da)) da = m_ExtDa;
+#endif
+#ifdef TEMPERATURE_DERATE
+    if (m_ThermDa && (m_ThermDa < da)) da = m_ThermDa;
+#endif
+#ifdef TOU_SCHEDULE
+    if (m_TouAmps && (m_TouAmps*10 < da)) da = m_TouAmps*10;
+#endif
+    return da;
+  }
+  // pilot in 0.1A before slew limiting
+  uint16_t setpointDa() {
+#ifdef CURRENT_REGULATION
+    if (m_RegDa) return m_RegDa;
+#endif
+    return targetDa();
+  }
+  void pilotChanged(uint16_t prevda,uint8_t now);
+#if defined(GFI) || defined(ADVPWR)
+  uint8_t readTripCnt(uint8_t which);
+  void incTripCnt(uint8_t *cnt,uint8_t which);
+#endif
+  // current to advertise on the pilot in 0.1A
+  uint16_t pilotDa() {
+#ifdef CURRENT_RAMP
+    if (m_RampDa) return m_RampDa;
+#endif
+    return setpointDa();
+  }
 
 #ifdef TIME_LIMIT
   uint8_t m_timeLimit15; // increments of 15min to extend charge time
   time_t m_timeLimitEnd; // end time
 #endif
+#ifdef CURRENT_RAMP
+  uint16_t m_RampDa; // pilot while slewing to setpointDa() in 0.1A, 0 = not ramping
+  uint8_t m_RampRate; // A/s, 0 = disabled
+  unsigned long m_RampMs; // time of last step
+
+  void rampHold(uint16_t prevda,uint8_t now);
+  void rampService();
+#endif
+#ifdef TOU_SCHEDULE
+  uint8_t m_TouAmps; // limit of the current schedule window, 0 = none
+#endif
+#ifdef TEMPERATURE_DERATE
+  uint16_t m_ThermDa; // thermal derating in 0.1A, 0 = none
+
+  void thermDerate();
+#endif
+#ifdef PILOT_CLASSIFIER
+  uint8_t m_PilotConfCnt; // consecutive readings clear of the thresholds
+  uint16_t m_PilotHist[4][PILOT_HIST_BINS]; // States A-D
+
+  void pilotHistAdd(uint16_t phigh);
+#endif
+#ifdef EXT_SETPOINT
+  uint16_t m_ExtDa; // external setpoint in 0.1A, 0 = none
+  uint16_t m_ExtFallbackDa; // setpoint after the watchdog expires
+  uint16_t m_ExtTimeoutMs; // watchdog timeout, 0 = none
+  unsigned long m_ExtMs; // time of last update
+  uint8_t m_ExtExpired;
+  volatile uint16_t m_ExtRxDa; // set by the TWI ISR, EXTSP_NONE = none
+
+  void setExtDa(uint16_t da,uint8_t now);
+  void extService();
+#endif
 
 #ifdef AMMETER
-  unsigned long m_AmmeterReading;
-  int32_t m_ChargingCurrent;
-  int16_t m_AmmeterCurrentOffset;
-  int16_t m_CurrentScaleFactor;
+  unsigned long m_AmmeterReading[AMMETER_ADC_CNT];
+  int32_t m_ChargingCurrent; // mA, highest of all phases
+#if AMMETER_CHANNELS > 1
+  int32_t m_PhaseCurrent[AMMETER_CHANNELS]; // mA
+#endif
+  int16_t m_AmmeterCurrentOffset[AMMETER_ADC_CNT];
+  int16_t m_CurrentScaleFactor[AMMETER_ADC_CNT];
 #ifdef CHARGE_LIMIT
-  uint8_t m_chargeLimitkWh; // kWh to extend session
   uint32_t m_chargeLimitTotWs; // total Ws limit
+  uint8_t m_chargeLimitAmps; // pilot while ramping down to the limit, 0 = none
+#endif
+
+#ifdef DUOSHARE
+  uint16_t m_ShareDa; // share of the group capacity in 0.1A, 0 = no limit
+#endif
+#ifdef MAINS_CT
+  uint8_t m_MainsLimit; // site limit in amps, 0 = disabled
+  uint8_t m_MainsThrottled;
+  int32_t m_MainsCurrent; // mA
+  unsigned long m_MainsRaiseMs; // start of the current headroom
+#endif
+#ifdef CURRENT_REGULATION
+  uint16_t m_RegDa; // regulated pilot in 0.1A, 0 = not regulating
+  int16_t m_RegErr; // previous error in 0.1A
+  unsigned long m_RegMs; // time of last step
 #endif
 
   void readAmmeter();
+#ifdef CHARGE_LIMIT
+  void chargeLimitRamp(uint32_t remws);
+  void chargeLimitRampClr();
+#endif
+#ifdef CURRENT_REGULATION
+  void regulateCurrent();
+  void regReset();
+#endif
+#ifdef MAINS_CT
+  void mainsLimit();
+#endif
+  int32_t calibratedCurrent(uint8_t ch,unsigned long reading);
+  uint16_t *currentCalAddr(uint8_t ch,uint8_t offset);
 #endif // AMMETER
 #ifdef VOLTMETER
   uint16_t m_VoltScaleFactor;
@@ -307,7 +417,7 @@ public:
   }
 
   void SaveEvseFlags() {
-    eeprom_write_word((uint16_t *)EOFS_FLAGS,m_wFlags);
+    EeWriteWord(EOFS_FLAGS,m_wFlags);
   }
 
   int8_t InFaultState() {
@@ -332,8 +442,13 @@ public:
   uint8_t GetCurrentCapacity() { 
     return m_CurrentCapacity; 
   }
+  uint16_t GetCurrentCapacityDa() { return m_CurrentCapacity*10 + m_CurrentCapacityFrac; }
   uint8_t GetMaxCurrentCapacity();
-  int SetCurrentCapacity(uint8_t amps,uint8_t updatelcd=0,uint8_t nosave=0);
+  // now: a decrease skips the CURRENT_RAMP. for safety derates
+  int SetCurrentCapacity(uint8_t amps,uint8_t updatelcd=0,uint8_t nosave=0,uint8_t now=0) {
+    return SetCurrentCapacityDa(amps*10,updatelcd,nosave,now);
+  }
+  int SetCurrentCapacityDa(uint16_t da,uint8_t updatelcd=0,uint8_t nosave=0,uint8_t now=0);
 
   time_t GetElapsedChargeTime() { 
     return m_ElapsedChargeTime+m_AccumulatedChargeTime; 
@@ -453,22 +568,37 @@ int GetHearbeatTrigger();
     return m_ChargingCurrent;
 #endif // OCPPDBG
   }
+#if AMMETER_CHANNELS > 1
+  int32_t GetPhaseCurrent(uint8_t ch) { return m_PhaseCurrent[ch]; }
+  // sum of all phases, for power calculation
+  int32_t GetTotalChargingCurrent() {
+    int32_t ma = 0;
+    for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) ma += m_PhaseCurrent[ch];
+    return ma;
+  }
+#endif // AMMETER_CHANNELS > 1
 #ifdef FAKE_CHARGING_CURRENT
   void SetChargingCurrent(int32_t current) {
     m_ChargingCurrent = current;
-    m_AmmeterReading = current;
+    for (uint8_t ch=0;ch < AMMETER_CHANNELS;ch++) {
+#if AMMETER_CHANNELS > 1
+      m_PhaseCurrent[ch] = current;
+#endif
+      m_AmmeterReading[ch] = current;
+    }
   }
 #endif
 
-  int16_t GetAmmeterCurrentOffset() { return m_AmmeterCurrentOffset; }
-  int16_t GetCurrentScaleFactor() { return m_CurrentScaleFactor; }
-  void SetAmmeterCurrentOffset(int16_t offset) {
-    m_AmmeterCurrentOffset = offset;
-    eeprom_write_word((uint16_t*)EOFS_AMMETER_CURR_OFFSET,offset);
+  // ch: current channel (phase), 0..AMMETER_CHANNELS-1, or MAINS_CT_CH
+  int16_t GetAmmeterCurrentOffset(uint8_t ch=0) { return m_AmmeterCurrentOffset[ch]; }
+  int16_t GetCurrentScaleFactor(uint8_t ch=0) { return m_CurrentScaleFactor[ch]; }
+  void SetAmmeterCurrentOffset(int16_t offset,uint8_t ch=0) {
+    m_AmmeterCurrentOffset[ch] = offset;
+    EeWriteWord(currentCalAddr(ch,1),offset);
   }
-  void SetCurrentScaleFactor(int16_t scale) {
-    m_CurrentScaleFactor = scale;
-    eeprom_write_word((uint16_t*)EOFS_CURRENT_SCALE_FACTOR,scale);
+  void SetCurrentScaleFactor(int16_t scale,uint8_t ch=0) {
+    m_CurrentScaleFactor[ch] = scale;
+    EeWriteWord(currentCalAddr(ch,0),scale);
   }
 #ifdef ECVF_AMMETER_CAL
   uint8_t AmmeterCalEnabled() { 
@@ -479,27 +609,66 @@ int GetHearbeatTrigger();
     else clrVFlags(ECVF_AMMETER_CAL);
   }
 #endif // ECVF_AMMETER_CAL
-  void ZeroChargingCurrent() { m_ChargingCurrent = 0; }
+  void ZeroChargingCurrent() {
+    m_ChargingCurrent = 0;
+#if AMMETER_CHANNELS > 1
+    memset(m_PhaseCurrent,0,sizeof(m_PhaseCurrent));
+#endif
+  }
   uint8_t GetInstantaneousChargingAmps() {
     readAmmeter();
-    return m_AmmeterReading / 1000;
+    return m_AmmeterReading[0] / 1000;
   }
 #ifdef CHARGE_LIMIT
-  void ClrChargeLimit() {
-    m_chargeLimitTotWs = 0;
-    m_chargeLimitkWh = 0;
-    clrVFlags(ECVF_CHARGE_LIMIT);
-  }
-  void SetChargeLimitkWh(uint8_t kwh);
+  void ClrChargeLimit();
+  void SetChargeLimitWh(uint32_t wh);
+  void SetChargeLimitkWh(uint8_t kwh) { SetChargeLimitWh(kwh*1000UL); }
   uint32_t GetChargeLimitTotWs() { return m_chargeLimitTotWs; }
-  uint8_t GetChargeLimitkWh() { return m_chargeLimitkWh; }
+  uint32_t GetChargeLimitWh() { return m_chargeLimitTotWs / 3600; }
+  // rounded up, so a fractional limit still shows as set
+  uint8_t GetChargeLimitkWh() { return (m_chargeLimitTotWs + 3599999UL) / 3600000UL; }
 #endif // CHARGE_LIMIT
+#ifdef DUOSHARE
+  void SetShareDa(uint16_t da);
+#endif
+#ifdef MAINS_CT
+  uint8_t GetMainsLimit() { return m_MainsLimit; }
+  void SetMainsLimit(uint8_t amps);
+  int32_t GetMainsCurrent() { return m_MainsCurrent; }
+  uint8_t MainsThrottled() { return m_MainsThrottled; }
+#endif // MAINS_CT
+#ifdef CURRENT_REGULATION
+  uint8_t CurrentRegEnabled() { return flagIsSet(ECF_CURRENT_REG) ? 1 : 0; }
+  void EnableCurrentReg(uint8_t tf);
+#endif // CURRENT_REGULATION
 #else // !AMMETER
   int32_t GetChargingCurrent() { return -1; }
 #endif // AMMETER
   uint8_t LimitsAllowed() {
     return ((GetState() == EVSE_STATE_B) || (GetState() == EVSE_STATE_C)) ? 1 : 0;
   }
+  uint16_t GetPilotDa() { return pilotDa(); }
+  uint16_t GetTargetDa() { return targetDa(); }
+#ifdef CURRENT_RAMP
+  uint8_t GetRampRate() { return m_RampRate; }
+  void SetRampRate(uint8_t rate);
+  uint8_t Ramping() { return m_RampDa ? 1 : 0; }
+  uint16_t GetSetpointDa() { return setpointDa(); }
+#endif
+#ifdef TEMPERATURE_DERATE
+  uint16_t GetThermDa() { return m_ThermDa; }
+#endif
+#ifdef TOU_SCHEDULE
+  void SetTouLimit(uint8_t amps);
+#endif
+#ifdef EXT_SETPOINT
+  int SetExtSetpointDa(uint16_t da);
+  void SetExtWatchdog(uint16_t timeoutms,uint16_t fallbackda);
+  uint16_t GetExtSetpointDa() { return m_ExtDa; }
+  uint8_t ExtSetpointExpired() { return m_ExtExpired; }
+  // called from TWI ISR
+  void ExtSetpointIsr(uint16_t da) { m_ExtRxDa = da; }
+#endif
 #ifdef TIME_LIMIT
   void ClrTimeLimit() {
     m_timeLimitEnd = 0;
@@ -512,6 +681,12 @@ int GetHearbeatTrigger();
   time_t GetTimeLimitEnd() { return m_timeLimitEnd; }
 #endif // TIME_LIMIT
   void ReadPilot(uint16_t *plow=NULL,uint16_t *phigh=NULL);
+  uint8_t ClassifyPilot(uint16_t phigh,uint8_t prevstate,uint16_t *margin=NULL);
+#ifdef PILOT_CLASSIFIER
+  uint16_t GetPilotHistBase(uint8_t state);
+  uint16_t *GetPilotHist(uint8_t state) { return m_PilotHist[state-EVSE_STATE_A]; }
+  void ClrPilotHist(uint8_t state) { memset(m_PilotHist[state-EVSE_STATE_A],0,sizeof(m_PilotHist[0])); }
+#endif
   void Reboot();
 #ifdef SHOW_DISABLED_TESTS
   void DisabledTest_P(PGM_P message);
@@ -78,23 +78,25 @@ void J1772Pilot::SetState(PILOT_STATE state)
 }
 
 
-// set EVSE current capacity in Amperes
+// set EVSE current capacity in 0.1 Amperes
 // duty cycle 
 // outputting a 1KHz square wave to digital pin 10 via Timer 1
+// PAFC_PWM resolves 0.0075A/count below 51A, 0.03A above.
+// fast PWM is 0.24A/count below 51A, 1A above, so da gets rounded down
 //
-int J1772Pilot::SetPWM(int amps)
+int J1772Pilot::SetPWMDa(int da)
 {
 
 #ifdef PAFC_PWM
   // duty cycle = OCR1A(B) / ICR1 * 100 %
 
   unsigned cnt;
-  if ((amps >= 6) && (amps <= 51)) {
+  if ((da >= 60) && (da <= 510)) {
     // amps = (duty cycle %) X 0.6
-    cnt = amps * (TOP/60);
-  } else if ((amps > 51) && (amps <= 80)) {
+    cnt = (uint32_t)da * TOP / 600;
+  } else if ((da > 510) && (da <= 800)) {
     // amps = (duty cycle % - 64) X 2.5
-    cnt = (amps * (TOP/250)) + (64*(TOP/100));
+    cnt = ((uint32_t)da * TOP / 2500) + (64*(TOP/100));
   }
   else {
     return 1;
@@ -112,10 +114,10 @@ int J1772Pilot::SetPWM(int amps)
   return 0;
 #else // fast PWM
   uint8_t ocr1b = 0;
-  if ((amps >= 6) && (amps <= 51)) {
-    ocr1b = 25 * amps / 6 - 1;  // J1772 states "Available current = (duty cycle %) X 0.6"
-  } else if ((amps > 51) && (amps <= 80)) {
-    ocr1b = amps + 159;  // J1772 states "Available current = (duty cycle % - 64) X 2.5"
+  if ((da >= 60) && (da <= 510)) {
+    ocr1b = 25 * da / 60 - 1;  // J1772 states "Available current = (duty cycle %) X 0.6"
+  } else if ((da > 510) && (da <= 800)) {
+    ocr1b = da / 10 + 159;  // J1772 states "Available current = (duty cycle % - 64) X 2.5"
   }
   else {
     return 1; // error
@@ -37,5 +37,6 @@ public:
   PILOT_STATE GetState() { 
     return m_State; 
   }
-  int SetPWM(int amps); // 12V 1KHz PWM
+  int SetPWM(int amps) { return SetPWMDa(amps*10); } // 12V 1KHz PWM
+  int SetPWMDa(int da); // SetPWM() in 0.1A
 };
@@ -166,13 +166,97 @@ OnboardDisplay g_OBD;
 #ifdef RTC
 RTC_DS1307 g_RTC;
 
+#ifdef SOFT_RTC
+SoftRtc g_SoftRtc;
+
+void SoftRtc::setTime(uint32_t unixtime)
+{
+  m_Unix = unixtime;
+  m_Frac = 0;
+  m_Ms = millis();
+  m_SyncMs = m_Ms;
+  m_CalUnix = unixtime;
+  m_CalMs = m_Ms;
+}
+
+void SoftRtc::Init()
+{
+  m_SecTicks = SOFT_RTC_SEC_TICKS;
+  setTime(g_RTC.now().unixtime());
+}
+
+uint32_t SoftRtc::Now()
+{
+  unsigned long ms = millis();
+  uint32_t frac = m_Frac + ((ms - m_Ms) << 4);
+  m_Ms = ms;
+  if (frac >= m_SecTicks) {
+    uint32_t secs = frac / m_SecTicks;
+    m_Unix += secs;
+    frac -= secs * m_SecTicks;
+  }
+  m_Frac = frac;
+  return m_Unix;
+}
+
+// read the RTC, and recalibrate the rate once the calibration window is
+// long enough for the RTC's 1 sec resolution not to matter
+void SoftRtc::Sync()
+{
+  uint32_t hw = g_RTC.now().unixtime();
+  uint32_t unixtime = Now();
+  m_SyncMs = m_Ms;
+
+  uint32_t calsecs = hw - m_CalUnix; // huge if the RTC went backwards
+  if ((calsecs >= SOFT_RTC_CAL_MIN_SECS) && (calsecs < 2*SOFT_RTC_CAL_MAX_SECS)) {
+    uint32_t ticks = ((m_Ms - m_CalMs) << 4) / calsecs;
+    if ((ticks >= SOFT_RTC_SEC_TICKS - SOFT_RTC_MAX_DRIFT) &&
+	(ticks <= SOFT_RTC_SEC_TICKS + SOFT_RTC_MAX_DRIFT)) {
+      m_SecTicks = ticks;
+    }
+  }
+  if (calsecs >= SOFT_RTC_CAL_MAX_SECS) {
+    m_CalUnix = hw;
+    m_CalMs = m_Ms;
+  }
+
+  // keep the fraction unless we're off by a second or more
+  if (unixtime != hw) {
+    m_Unix = hw;
+    m_Frac = 0;
+  }
+}
+
+void SoftRtc::Adjust(const DateTime &dt)
+{
+  g_RTC.adjust(dt);
+  setTime(dt.unixtime());
+}
+
+static DateTime rtcNow() { return DateTime(g_SoftRtc.Now()); }
+uint32_t GetRTCUnixtime() { return g_SoftRtc.Now(); }
+static void rtcAdjust(const DateTime &dt) { g_SoftRtc.Adjust(dt); }
+#else // !SOFT_RTC
+static DateTime rtcNow() { return g_RTC.now(); }
+uint32_t GetRTCUnixtime() { return g_RTC.now().unixtime(); }
+static void rtcAdjust(const DateTime &dt) { g_RTC.adjust(dt); }
+#endif // SOFT_RTC
+
 #if defined(RAPI)
 void SetRTC(uint8_t y,uint8_t m,uint8_t d,uint8_t h,uint8_t mn,uint8_t s) {
-  g_RTC.adjust(DateTime(y,m,d,h,mn,s));
+  rtcAdjust(DateTime(y,m,d,h,mn,s));
+#ifdef TOU_SCHEDULE
+  g_DelayTimer.Invalidate();
+#endif
 }
-void GetRTC(char *buf) {
-  DateTime t = g_RTC.now();
-  sprintf(buf,"%d %d %d %d %d %d",t.year()-2000,t.month(),t.day(),t.hour(),t.minute(),t.second());
+void GetRTC(uint8_t *ymdhms) {
+  DateTime t = rtcNow();
+  ymdhms[0] = t.year()-2000;
+  ymdhms[1] = t.month();
+  ymdhms[2] = t.day();
+  ymdhms[3] = t.hour();
+  ymdhms[4] = t.minute();
+  ymdhms[5] = t.second();
 }
 #endif // RAPI
 #endif // RTC
@@ -266,11 +350,11 @@ void wdt_init(void)
 #ifdef TEMPERATURE_MONITORING_NY
 void TempMonitor::LoadThresh()
 {
-  m_ambient_thresh = eeprom_read_word((uint16_t *)EOFS_THRESH_AMBIENT);
+  m_ambient_thresh = EeReadWord(EOFS_THRESH_AMBIENT);
   if (m_ambient_thresh == 0xffff) {
     m_ambient_thresh = TEMPERATURE_AMBIENT_THROTTLE_DOWN;
   }
-  m_ir_thresh = eeprom_read_word((uint16_t *)EOFS_THRESH_IR);
+  m_ir_thresh = EeReadWord(EOFS_THRESH_IR);
   if (m_ir_thresh == 0xffff) {
     m_ir_thresh = TEMPERATURE_INFRARED_THROTTLE_DOWN;
   }
@@ -278,14 +362,17 @@ void TempMonitor::LoadThresh()
 
 void TempMonitor::SaveThresh()
 {
-  eeprom_write_word((uint16_t *)EOFS_THRESH_AMBIENT,m_ambient_thresh);
-  eeprom_write_word((uint16_t *)EOFS_THRESH_IR,m_ir_thresh);
+  EeWriteWord(EOFS_THRESH_AMBIENT,m_ambient_thresh);
+  EeWriteWord(EOFS_THRESH_IR,m_ir_thresh);
 }
 #endif // TEMPERATURE_MONITORING_NY
 
 void TempMonitor::Init()
 {
   m_Flags = 0;
+#ifdef TEMPERATURE_DERATE
+  m_DeratePct = 100;
+#endif
   m_MCP9808_temperature = TEMPERATURE_NOT_INSTALLED;  // 230 means 23.0C  Using an integer to save on floating point library use
   m_DS3231_temperature = TEMPERATURE_NOT_INSTALLED;   // the DS3231 RTC has a built in temperature sensor
   m_TMP007_temperature = TEMPERATURE_NOT_INSTALLED;
@@ -348,9 +435,52 @@ void TempMonitor::Read()
 #endif // OPENEVSE_2
 #endif // RTC
 
+#ifdef TEMPERATURE_DERATE
+    uint8_t pct = deratePct(0);
+    if (pct > m_DeratePct) {
+      // cooling down
+      pct = deratePct(TEMPERATURE_DERATE_HYST);
+      if (pct > m_DeratePct + TEMPERATURE_DERATE_SLEW_PCT) {
+	pct = m_DeratePct + TEMPERATURE_DERATE_SLEW_PCT;
+      }
+      else if (pct < m_DeratePct) pct = m_DeratePct;
+    }
+    m_DeratePct = pct;
+    SetOverTemperature(pct < 100);
+    // blink the LCD from SHUTDOWN until the derating is fully eased off
+    if ((m_TMP007_temperature >= TEMPERATURE_INFRARED_SHUTDOWN) ||
+	(m_MCP9808_temperature >= TEMPERATURE_AMBIENT_SHUTDOWN) ||
+	(m_DS3231_temperature >= TEMPERATURE_AMBIENT_SHUTDOWN)) {
+      SetOverTemperatureShutdown(1);
+    }
+    else if (pct == 100) SetOverTemperatureShutdown(0);
+#endif // TEMPERATURE_DERATE
+
     m_LastUpdate = curms;
   }
 }
+
+#ifdef TEMPERATURE_DERATE
+// t: 10ths of a degree C
+static uint8_t derateCurve(int16_t t,int16_t tdown,int16_t tpanic)
+{
+  if (t <= tdown) return 100;
+  if (t >= tpanic) return TEMPERATURE_DERATE_MIN_PCT;
+  return 100 - ((int32_t)(t - tdown) * (100 - TEMPERATURE_DERATE_MIN_PCT)) / (tpanic - tdown);
+}
+
+// returns the derating for the hottest sensor, relative to its thresholds.
+// hyst: added to the temperatures
+uint8_t TempMonitor::deratePct(int16_t hyst)
+{
+  uint8_t pct = derateCurve(m_TMP007_temperature+hyst,TEMPERATURE_INFRARED_THROTTLE_DOWN,TEMPERATURE_INFRARED_PANIC);
+  uint8_t p = derateCurve(m_MCP9808_temperature+hyst,TEMPERATURE_AMBIENT_THROTTLE_DOWN,TEMPERATURE_AMBIENT_PANIC);
+  if (p < pct) pct = p;
+  p = derateCurve(m_DS3231_temperature+hyst,TEMPERATURE_AMBIENT_THROTTLE_DOWN,TEMPERATURE_AMBIENT_PANIC);
+  if (p < pct) pct = p;
+  return pct;
+}
+#endif // TEMPERATURE_DERATE
 #endif // TEMPERATURE_MONITORING
 
 
@@ -829,7 +959,7 @@ void OnboardDisplay::Update(int8_t updmode)
 #endif // GFI
 
 #ifdef RTC
-    DateTime currentTime = g_RTC.now();
+    DateTime currentTime = rtcNow();
 #endif
 
 #ifdef LCD16X2
@@ -1630,7 +1760,7 @@ Menu *MaxCurrentMenu::Select()
   g_OBD.LcdPrint(m_CurIdx);
   g_OBD.LcdPrint("A");
   delay(500);
-  eeprom_write_byte((uint8_t*)((g_EvseController.GetCurSvcLevel() == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2),m_CurIdx);  
+  EeWriteByte((g_EvseController.GetCurSvcLevel() == 1) ? EOFS_CURRENT_CAPACITY_L1 : EOFS_CURRENT_CAPACITY_L2,m_CurIdx);  
   g_EvseController.SetCurrentCapacity(m_CurIdx);
   return &g_SetupMenu;
 }
@@ -1730,7 +1860,7 @@ RTCMenuMonth::RTCMenuMonth()
 void RTCMenuMonth::Init()
 {
   g_OBD.LcdPrint_P(0,g_psRTC_Month);
-  DateTime t = g_RTC.now();
+  DateTime t = rtcNow();
   g_month = t.month();
   g_day = t.day();
   g_year = t.year() - 2000;
@@ -1854,7 +1984,10 @@ Menu *RTCMenuMinute::Select()
 {
   g_min = m_CurIdx;
   DtsStrPrint1(g_year,g_month,g_day,g_hour,m_CurIdx,4);
-  g_RTC.adjust(DateTime(g_year, g_month, g_day, g_hour, g_min, 0));
+  rtcAdjust(DateTime(g_year, g_month, g_day, g_hour, g_min, 0));
+#ifdef TOU_SCHEDULE
+  g_DelayTimer.Invalidate();
+#endif
   delay(500);
   return &g_SetupMenu;
 }
@@ -2275,10 +2408,10 @@ void BtnHandler::ChkBtn()
 #ifdef DELAYTIMER
 void DelayTimer::Init() {
   //Read EEPROM settings
-  uint8_t rtmp = eeprom_read_byte((uint8_t*)EOFS_TIMER_FLAGS);
+  uint8_t rtmp = EeReadByte(EOFS_TIMER_FLAGS);
   if (rtmp == 0xff) { // uninitialized EEPROM
     m_DelayTimerEnabled = 0x00;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
+    EeWriteByte(EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
   }
   else {
     m_DelayTimerEnabled = rtmp;
@@ -2287,48 +2420,150 @@ void DelayTimer::Init() {
   if (m_DelayTimerEnabled) g_EvseController.SetDelayTimerOnFlag();
   else g_EvseController.ClrDelayTimerOnFlag();
 
-  rtmp = eeprom_read_byte((uint8_t*)EOFS_TIMER_START_HOUR);
+  rtmp = EeReadByte(EOFS_TIMER_START_HOUR);
   if (rtmp == 0xff) { // uninitialized EEPROM
     m_StartTimerHour = DEFAULT_START_HOUR;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_START_HOUR, m_StartTimerHour);
+    EeWriteByte(EOFS_TIMER_START_HOUR, m_StartTimerHour);
   }
   else {
     m_StartTimerHour = rtmp;
   }
-  rtmp = eeprom_read_byte((uint8_t*)EOFS_TIMER_START_MIN);
+  rtmp = EeReadByte(EOFS_TIMER_START_MIN);
   if (rtmp == 0xff) { // uninitialized EEPROM
     m_StartTimerMin = DEFAULT_START_MIN;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_START_MIN, m_StartTimerMin);
+    EeWriteByte(EOFS_TIMER_START_MIN, m_StartTimerMin);
   }
   else {
     m_StartTimerMin = rtmp;
   }
-  rtmp = eeprom_read_byte((uint8_t*)EOFS_TIMER_STOP_HOUR);
+  rtmp = EeReadByte(EOFS_TIMER_STOP_HOUR);
   if (rtmp == 0xff) { // uninitialized EEPROM
     m_StopTimerHour = DEFAULT_STOP_HOUR;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_STOP_HOUR, m_StopTimerHour);
+    EeWriteByte(EOFS_TIMER_STOP_HOUR, m_StopTimerHour);
   }
   else {
     m_StopTimerHour = rtmp;
   }
-  rtmp = eeprom_read_byte((uint8_t*)EOFS_TIMER_STOP_MIN);
+  rtmp = EeReadByte(EOFS_TIMER_STOP_MIN);
   if (rtmp == 0xff) { // uninitialized EEPROM
     m_StopTimerMin = DEFAULT_STOP_MIN;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_STOP_MIN, m_StopTimerMin);
+    EeWriteByte(EOFS_TIMER_STOP_MIN, m_StopTimerMin);
   }
   else {
     m_StopTimerMin = rtmp;
   }
 
+#ifdef TOU_SCHEDULE
+  countWindows();
+  m_TouAmps = 0;
+#endif // TOU_SCHEDULE
+
   ClrManualOverride();
 }
 
+#ifdef TOU_SCHEDULE
+void DelayTimer::countWindows()
+{
+  m_TouCnt = 0;
+  for (uint8_t i=0;i < TOU_MAX_WINDOWS;i++) {
+    TOU_WINDOW win;
+    GetWindow(i,&win);
+    if (win.days) m_TouCnt++;
+  }
+  Invalidate();
+}
+
+// unused windows are returned w/ days = 0
+void DelayTimer::GetWindow(uint8_t idx,TOU_WINDOW *win)
+{
+  eeprom_read_block(win,(void *)(EOFS_TOU_SCHED + idx*sizeof(TOU_WINDOW)),sizeof(TOU_WINDOW));
+  if ((win->days > 0x7f) || (win->start > 95) || (win->stop > 95)) {
+    win->days = 0; // erased or invalid
+  }
+}
+
+// win->days = 0 = delete. returns 0 = ok
+uint8_t DelayTimer::SetWindow(uint8_t idx,TOU_WINDOW *win)
+{
+  if ((idx >= TOU_MAX_WINDOWS) || (win->days > 0x7f) ||
+      (win->start > 95) || (win->stop > 95)) return 1;
+  if (!win->days) memset(win,0xff,sizeof(TOU_WINDOW));
+  eeprom_update_block(win,(void *)(EOFS_TOU_SCHED + idx*sizeof(TOU_WINDOW)),sizeof(TOU_WINDOW));
+  countWindows();
+  return 0;
+}
+
+// read the RTC once, and work out whether we're in a window, its current
+// limit, and how long until the next window starts or ends. checks until
+// then just compare millis(), w/ a resync every TOU_RESYNC_MS in case the
+// RTC was adjusted
+void DelayTimer::compile()
+{
+  DateTime t = rtcNow();
+  uint16_t now = t.dayOfWeek()*(24u*60u) + t.hour()*60u + t.minute();
+  uint8_t awake = 0;
+  uint8_t amps = 0;
+  uint16_t next = TOU_WEEK_MINS;
+
+  for (uint8_t i=0;i < TOU_MAX_WINDOWS;i++) {
+    TOU_WINDOW win;
+    uint16_t startmin,stopmin;
+    if (m_TouCnt) {
+      GetWindow(i,&win);
+      if (!win.days) continue;
+      startmin = win.start * 15u;
+      stopmin = win.stop * 15u;
+    }
+    else {
+      // the $ST window, every day
+      if (i) break;
+      win.days = 0x7f;
+      win.amps = 0;
+      startmin = m_StartTimerHour * 60u + m_StartTimerMin;
+      stopmin = m_StopTimerHour * 60u + m_StopTimerMin;
+    }
+    uint16_t len = (stopmin > startmin) ? (stopmin - startmin) : (24u*60u - startmin + stopmin);
+
+    for (uint8_t d=0;d < 7;d++) {
+      if (!(win.days & (1 << d))) continue;
+      uint16_t s = d*(24u*60u) + startmin;
+      uint16_t since = (now + TOU_WEEK_MINS - s) % TOU_WEEK_MINS;
+      if (since < len) {
+	// in the window. overlapping windows get the highest limit
+	if (!awake || (amps && (!win.amps || (win.amps > amps)))) {
+	  amps = win.amps;
+	}
+	awake = 1;
+	if (len - since < next) next = len - since; // ends
+      }
+      else if (TOU_WEEK_MINS - since < next) {
+	next = TOU_WEEK_MINS - since; // starts
+      }
+    }
+  }
+
+  m_Awake = awake;
+  m_TouAmps = amps;
+  m_CompileMs = millis();
+  m_WaitMs = next * 60000ul - t.second() * 1000ul;
+  if (m_WaitMs > TOU_RESYNC_MS) m_WaitMs = TOU_RESYNC_MS;
+}
+#endif // TOU_SCHEDULE
+
 uint8_t DelayTimer::IsInAwakeTimeInterval()
 {
   uint8_t inTimeInterval = false;
 
+#ifdef TOU_SCHEDULE
   if (IsTimerEnabled() && IsTimerValid()) {
-    DateTime t = g_RTC.now();
+    if ((millis() - m_CompileMs) >= m_WaitMs) {
+      compile();
+    }
+    inTimeInterval = m_Awake;
+  }
+#else // !TOU_SCHEDULE
+  if (IsTimerEnabled() && IsTimerValid()) {
+    DateTime t = rtcNow();
     uint8_t currHour = t.hour();
     uint8_t currMin = t.minute();
     
@@ -2349,6 +2584,7 @@ uint8_t DelayTimer::IsInAwakeTimeInterval()
       }
     }
   }
+#endif // TOU_SCHEDULE
 
   return inTimeInterval;
 }
@@ -2363,6 +2599,9 @@ void DelayTimer::CheckTime()
     if ((curms - m_LastCheck) > 1000ul) {
       uint8_t inTimeInterval = IsInAwakeTimeInterval();
       uint8_t evseState = g_EvseController.GetState();
+#ifdef TOU_SCHEDULE
+      g_EvseController.SetTouLimit(inTimeInterval ? m_TouAmps : 0);
+#endif
 
       if (inTimeInterval) { // charge now
 	if (!ManualOverrideIsSet()) {
@@ -2401,7 +2640,7 @@ void DelayTimer::CheckTime()
 }
 void DelayTimer::Enable(){
   m_DelayTimerEnabled = 0x01;
-  eeprom_write_byte((uint8_t*)EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
+  EeWriteByte(EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
   ClrManualOverride();
   //  g_EvseController.SaveSettings();
   //  CheckTime();
@@ -2410,10 +2649,13 @@ void DelayTimer::Enable(){
 }
 void DelayTimer::Disable(){
   m_DelayTimerEnabled = 0x00;
-  eeprom_write_byte((uint8_t*)EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
+  EeWriteByte(EOFS_TIMER_FLAGS, m_DelayTimerEnabled);
   ClrManualOverride();
   //  g_EvseController.SaveSettings();
   g_EvseController.ClrDelayTimerOnFlag();
+#ifdef TOU_SCHEDULE
+  g_EvseController.SetTouLimit(0);
+#endif
   g_OBD.Update(OBD_UPD_FORCE);
 }
 void DelayTimer::PrintTimerIcon(){
@@ -2438,12 +2680,32 @@ void ProcessInputs()
 #ifdef TEMPERATURE_MONITORING
   g_TempMonitor.Read();  //   update temperatures once per second
 #endif
+#ifdef EEPROM_JOURNAL
+  // n.b. must be here rather than loop(), so that records still get written
+  // while HardFault() spins
+  g_EeJournal.Service();
+#endif
+#ifdef SETTINGS_CACHE
+  g_EeSettings.Service();
+#endif
+#ifdef SESSION_LOG
+  g_EnergyMeter.Service();
+#endif
+#ifdef LOAD_PROFILE_SPILL
+  g_LoadProfile.Service();
+#endif
+#ifdef DUOSHARE
+  g_DuoShare.Service();
+#endif
 }
 
 
 void EvseReset()
 {
   Wire.begin();
+#ifdef SOFT_RTC
+  g_SoftRtc.Init();
+#endif
   g_OBD.Init();
 
 #ifdef RAPI
@@ -2452,6 +2714,10 @@ void EvseReset()
 
   g_EvseController.Init();
 
+#ifdef DUOSHARE
+  g_DuoShare.Init(); // after RapiInit(), which may set up the I2C slave
+#endif
+
 #ifdef DELAYTIMER
   g_DelayTimer.Init(); // this *must* run after g_EvseController.Init() because it sets one of the vFlags
 #endif  // DELAYTIMER
@@ -2505,6 +2771,13 @@ void setup()
   g_EvseController.SetStateTransitionReqFunc(&StateTransitionReqFunc);
 #endif //PP_AUTO_AMPACITY
 
+#ifdef SETTINGS_CACHE
+  g_EeSettings.Init(); // must precede g_EvseController.Init()
+#endif
+#ifdef EEPROM_JOURNAL
+  g_EeJournal.Init(); // must precede g_EvseController.Init()
+#endif
+
   EvseReset();
 
 #ifdef TEMPERATURE_MONITORING
@@ -2519,6 +2792,10 @@ void loop()
 {
   WDT_RESET();
 
+#ifdef SOFT_RTC
+  g_SoftRtc.Service();
+#endif
+
   g_EvseController.Update();
 
 #ifdef KWH_RECORDING
@@ -87,6 +87,7 @@ typedef unsigned long time_t;
 
 // Enable three-phase energy calculation
 // Note: three-phase energy will always be calculated even if EV is only using singe-phase. Ony enable if always charging 3-phase EV and aware of this limitation.
+//  unless there is a CT on each phase - see AMMETER_CHANNELS
 //#define THREEPHASE
 
 // charging access control - if defined, enables RAPI G4/S4 commands
@@ -116,6 +117,10 @@ typedef unsigned long time_t;
 // enable sending of RAPI commands
 //#define RAPI_SENDER
 
+// share EOFS_GROUP_CURRENT_CAPACITY between EVSEs on one circuit, over I2C.
+// configured via $SP
+//#define DUOSHARE
+
 // EVSE must call state transition function for permission to change states
 //#define STATE_TRANSITION_REQ_FUNC
 
@@ -192,6 +197,55 @@ extern AutoCurrentCapacityController g_ACCController;
 
 #define HEARTBEAT_SUPERVISION // Heartbeat Supervision support
 
+// slew the pilot toward a new current capacity in State C instead of
+// stepping it, and soft start each charge from MIN_CURRENT_CAPACITY_J1772.
+// safety derates still cut back at once. rate set via $SW
+//#define CURRENT_RAMP
+#ifdef CURRENT_RAMP
+#ifndef CURRENT_RAMP_RATE
+#define CURRENT_RAMP_RATE 2 // default A/s
+#endif
+#define CURRENT_RAMP_STEP_MS 250UL // min time between pilot steps
+#endif // CURRENT_RAMP
+
+// volatile current setpoint for external controllers (e.g. PV surplus),
+// set via $SX up to several times per second w/o EEPROM writes, LCD updates
+// or $AT notifications. if updates stop for EXT_SETPOINT_TIMEOUT_MS, the
+// pilot falls back to MIN_CURRENT_CAPACITY_J1772. w/ RAPI_I2C, it can also
+// be set w/ a binary EXTSP_PKT
+//#define EXT_SETPOINT
+#ifdef EXT_SETPOINT
+#ifndef EXT_SETPOINT_TIMEOUT_MS
+#define EXT_SETPOINT_TIMEOUT_MS 5000 // default watchdog timeout
+#endif
+#endif // EXT_SETPOINT
+
+// fault trip counter index - EOFS_GFI_TRIP_CNT+TRIPCNT_xxx, or in the journal
+#define TRIPCNT_GFI 0
+#define TRIPCNT_NOGND 1
+#define TRIPCNT_STUCK_RELAY 2
+#define TRIPCNT_CNT 3
+
+// keep lifetime kWh and fault trip counters in a wear-levelled EEPROM journal
+// instead of rewriting them in place. the legacy values are migrated on
+// first boot and no longer updated, so firmware w/o EEPROM_JOURNAL sees
+// them as they were at migration
+//#define EEPROM_JOURNAL
+#ifdef EEPROM_JOURNAL
+#include "EepromJournal.h"
+#endif // EEPROM_JOURNAL
+
+// keep a RAM copy of the EEPROM settings block, written back when changed
+// costs 54 bytes of RAM (47 w/ EEPROM_JOURNAL)
+//#define SETTINGS_CACHE
+#include "EepromSettings.h"
+
+// # of current channels (CTs). w/ more than 1, each phase is measured and
+// metered separately, instead of multiplying L1 by 3 for THREEPHASE
+#ifndef AMMETER_CHANNELS
+#define AMMETER_CHANNELS 1
+#endif
+
 #ifdef AMMETER
 
 // if OVERCURRENT_THRESHOLD is defined, then EVSE will hard fault in
@@ -202,6 +256,45 @@ extern AutoCurrentCapacityController g_ACCController;
 // for OVERCURRENT_TIMEOUT ms
 //#define OVERCURRENT_TIMEOUT 10000UL // ms
 
+// closed loop current regulation - adjust the pilot so the measured
+// charging current tracks the current capacity. runtime enabled via $SR
+//#define CURRENT_REGULATION
+#ifdef CURRENT_REGULATION
+#ifndef CURRENT_REG_KP
+#define CURRENT_REG_KP 4 // proportional gain, /16
+#endif
+#ifndef CURRENT_REG_KI
+#define CURRENT_REG_KI 4 // integral gain, /16 per step
+#endif
+#ifndef CURRENT_REG_STEP_MS
+#define CURRENT_REG_STEP_MS 5000UL // EVs get up to 5s to follow the pilot
+#endif
+#ifndef CURRENT_REG_FAST_MS
+#define CURRENT_REG_FAST_MS 1000UL // min time between fast cut backs
+#endif
+#define CURRENT_REG_OVER_DA 5 // cut back at once when > target + 0.5A
+#define CURRENT_REG_SLEW_DA 10 // max increase per step, 0.1A
+#define CURRENT_REG_MAX_BOOST_DA 30 // max pilot above target, 0.1A
+#define CURRENT_REG_FOLLOW_DA 20 // EV drawing < pilot - 2A isn't following it
+#endif // CURRENT_REGULATION
+
+// site main breaker protection - a CT on the site mains is sampled by
+// readAmmeter() along w/ the charging current, and the current capacity is
+// throttled so that the site stays under the limit set by $SG.
+// the mains CT is calibrated via $SA/$GA channel MAINS_CT_CH
+//#define MAINS_CT
+#ifdef MAINS_CT
+#define MAINS_CT_CH AMMETER_CHANNELS
+#define AMMETER_ADC_CNT (AMMETER_CHANNELS+1)
+#ifndef MAINS_MARGIN_DA
+#define MAINS_MARGIN_DA 10 // stay this far under the site limit, 0.1A
+#endif
+#ifndef MAINS_RAISE_MS
+#define MAINS_RAISE_MS 5000UL // headroom must last this long to raise
+#endif
+#define MAINS_RAISE_DA 10 // min increase, 0.1A
+#endif // MAINS_CT
+
 // if there's no accurate voltmeter, hardcode voltages
 #ifndef MV_FOR_L1
 #define MV_FOR_L1 120000L       // conventional for North America
@@ -220,12 +313,59 @@ extern AutoCurrentCapacityController g_ACCController;
 // during this interval
 #define KWH_CALC_INTERVAL_MS (250UL)
 
+// keep a per-session charge history in EEPROM, retrievable via $GR
+// costs 35 bytes of RAM
+//#define SESSION_LOG
+
+// per-session min/max/mean voltage and current, voltage sag count and
+// time over current limit, retrievable via $GW
+//#define POWER_QUALITY_STATS
+#ifdef POWER_QUALITY_STATS
+#ifndef PQ_SAG_PCT
+#define PQ_SAG_PCT 90 // sag = voltage < PQ_SAG_PCT% of MV_FOR_Lx
+#endif
+#endif // POWER_QUALITY_STATS
+
+// record energy/max current/avg voltage in RTC aligned intervals,
+// retrievable via $GB. uses 6*LOAD_PROFILE_CNT+~40 bytes of RAM
+//#define LOAD_PROFILE
+#ifdef LOAD_PROFILE
+#ifndef LOAD_PROFILE_INTERVAL_SECS
+#define LOAD_PROFILE_INTERVAL_SECS (15UL*60UL)
+#endif
+#ifndef LOAD_PROFILE_CNT
+#define LOAD_PROFILE_CNT 8 // # of completed intervals kept
+#endif
+// keep the intervals in an EEPROM ring at EOFS_LOAD_PROFILE instead of RAM,
+// so they survive a reboot. requires RTC
+//#define LOAD_PROFILE_SPILL
+#ifdef LOAD_PROFILE_SPILL
+#ifndef LOAD_PROFILE_SPILL_CNT
+#define LOAD_PROFILE_SPILL_CNT 40 // # of intervals kept, 11 bytes each
+#endif
+#endif // LOAD_PROFILE_SPILL
+#endif // LOAD_PROFILE
+
+#ifdef CHARGE_LIMIT
+// start ramping the pilot down when this many seconds of charging at the
+// present power are left before the charge limit
+#ifndef CHARGE_LIMIT_RAMP_SECS
+#define CHARGE_LIMIT_RAMP_SECS 30UL
+#endif
+#define MAX_CHARGE_LIMIT_WH 255000UL // GetChargeLimitkWh() is 8 bits
+#endif // CHARGE_LIMIT
+
 #include "EnergyMeter.h"
 #endif // KWH_RECORDING
 
 
 #endif //AMMETER
 
+// # of ADC channels sampled by readAmmeter()
+#ifndef AMMETER_ADC_CNT
+#define AMMETER_ADC_CNT AMMETER_CHANNELS
+#endif
+
 //Adafruit RGBLCD (MCP23017) - can have RGB or monochrome backlight
 #define RGBLCD
 
@@ -278,6 +418,10 @@ extern AutoCurrentCapacityController g_ACCController;
 #define RTC // enable RTC & timer functions
 
 #ifdef RTC
+// keep time from millis(), synced w/ the RTC every SOFT_RTC_SYNC_MS,
+// so reading the time doesn't cost an I2C transaction. costs 26 bytes of RAM
+//#define SOFT_RTC
+
 // Option for Delay Timer - GoldServe
 #define DELAYTIMER
 
@@ -285,6 +429,11 @@ extern AutoCurrentCapacityController g_ACCController;
 #define DELAYTIMER_MENU
 #endif
 
+// weekly time of use schedule for the delay timer - up to TOU_MAX_WINDOWS
+// charging windows, each w/ its own days of the week and current limit,
+// set via $SU. replaces the single $ST window when any are set
+//#define TOU_SCHEDULE
+
 #else // !RTC
 // this weird error comes out if RTC not defined, due to a bug in g++
 //D:\git\open_evse\firmware\open_evse\open_evse.ino: In function 'ProcessInputs'//:
@@ -359,6 +508,10 @@ extern AutoCurrentCapacityController g_ACCController;
 #undef BTN_MENU
 #endif // RGBLCD || I2CLCD
 
+#if defined(LOAD_PROFILE_SPILL) && !defined(RTC)
+#error INVALID CONFIG - LOAD_PROFILE_SPILL requires RTC
+#endif
+
 #if defined(OPENEVSE_2) && !defined(ADVPWR)
 #error INVALID CONFIG - OPENEVSE_2 implies/requires ADVPWR
 #endif
@@ -458,6 +611,24 @@ extern AutoCurrentCapacityController g_ACCController;
 //J1772EVSEController
 
 #define CURRENT_PIN 0 // analog current reading pin ADCx
+#if AMMETER_CHANNELS > 1
+// n.b. ADC6/ADC7 are only on the 32 pin packages
+#ifndef CURRENT_PIN_2
+#define CURRENT_PIN_2 6 // L2 current ADCx
+#endif
+#ifndef CURRENT_PIN_3
+#define CURRENT_PIN_3 7 // L3 current ADCx
+#endif
+#endif // AMMETER_CHANNELS > 1
+#if defined(MAINS_CT) && !defined(MAINS_CT_PIN)
+#if AMMETER_CHANNELS == 1
+#define MAINS_CT_PIN 6 // mains CT ADCx
+#elif AMMETER_CHANNELS == 2
+#define MAINS_CT_PIN 7 // mains CT ADCx
+#else
+#error MAINS_CT_PIN must be defined
+#endif
+#endif // MAINS_CT && !MAINS_CT_PIN
 #define PILOT_PIN 1 // analog pilot voltage reading pin ADCx
 #define PP_PIN 2 // PP_READ - ADC2
 #ifdef VOLTMETER
@@ -543,9 +714,9 @@ extern AutoCurrentCapacityController g_ACCController;
 // AMMETER stuff
 #define EOFS_CURRENT_SCALE_FACTOR 9 // 2 bytes
 #define EOFS_AMMETER_CURR_OFFSET  11 // 2 bytes
-#define EOFS_KWH_ACCUMULATED 13 // 4 bytes
+#define EOFS_KWH_ACCUMULATED 13 // 4 bytes - legacy w/ EEPROM_JOURNAL
 
-// fault counters
+// fault counters - legacy w/ EEPROM_JOURNAL
 #define EOFS_GFI_TRIP_CNT      17 // 1 byte
 #define EOFS_NOGND_TRIP_CNT    18 // 1 byte
 #define EOFS_STUCK_RELAY_TRIP_CNT 19 // 1 byte
@@ -556,14 +727,16 @@ extern AutoCurrentCapacityController g_ACCController;
 #define EOFS_THRESH_IR 28 // 2 bytes
 
 // for I2C RAPI
+// DUOSHARE: node address
 #define EOFS_LOCAL_I2C_ADDR 30 // 1 byte
 //
 // for DUOSHARE
 //
 // for shared power pool
 #define EOFS_GROUP_CURRENT_CAPACITY 31 // 1 byte
-// non-volatile flags
+// non-volatile flags - DUONV_xxx
 #define EOFS_DUO_NVFLAGS 32 // 1 byte
+// static share, used when no peers are heard
 #define EOFS_DUO_SHARED_AMPS 33 // 1 byte
 //
 // Reserved for HEARTBEAT_SUPERVISION (3 Bytes)
@@ -576,8 +749,37 @@ extern AutoCurrentCapacityController g_ACCController;
 #define EOFS_RELAY_CLOSE_MS 37 // 1 byte
 #define EOFS_RELAY_HOLD_PWM 38 // 1 byte
 
+// SETTINGS_CACHE CRC of bytes 0-38
+#define EOFS_SETTINGS_CRC 39 // 1 byte
+
+// EEPROM_JOURNAL ring
+#define EOFS_JOURNAL 40 // EEJ_SLOT_CNT*EEJ_REC_SIZE = 144 bytes
+
+// SESSION_LOG ring
+#define EOFS_SESSION_LOG 184 // SESSION_LOG_CNT*SESSION_REC_SIZE = 320 bytes
+
+// CURRENT_RAMP
+#define EOFS_RAMP_RATE 504 // A/s, 1 byte
+
+// MAINS_CT
+#define EOFS_MAINS_CT_CAL 505 // scale factor/offset, 4 bytes
+#define EOFS_MAINS_LIMIT 509 // site limit in amps, 1 byte
+
 #define EOFS_MAX_HW_CURRENT_CAPACITY 511 // 1 byte
 
+//
+// above the original 512 byte map. ATmega328P has 1K
+//
+// LOAD_PROFILE_SPILL ring
+#define EOFS_LOAD_PROFILE 512 // LOAD_PROFILE_SPILL_CNT*LP_REC_SIZE = 440 bytes, max 440
+
+// scale factor/offset for current channels 1..AMMETER_CHANNELS-1
+// channel 0 is at EOFS_CURRENT_SCALE_FACTOR/EOFS_AMMETER_CURR_OFFSET
+#define EOFS_CURRENT_CAL 952 // (AMMETER_CHANNELS-1)*4 bytes, max 8
+
+// TOU_SCHEDULE
+#define EOFS_TOU_SCHED 960 // TOU_MAX_WINDOWS*sizeof(TOU_WINDOW) = 32 bytes
+
 
 
 // must stay within thresh for this time in ms before switching states
@@ -586,6 +788,20 @@ extern AutoCurrentCapacityController g_ACCController;
 // but Leaf sometimes bounces from 3->1 so we will debounce it a little anyway
 #define DELAY_STATE_TRANSITION_A 25
 
+// classify the pilot w/ a hysteresis band around each threshold, and commit
+// a new state after PILOT_CONFIRM_CNT consecutive readings at least
+// PILOT_FAST_MARGIN from the thresholds, instead of waiting the delays above.
+// readings closer than that still wait the full delay.
+// also keeps per-state histograms of the readings for tuning, see $GK
+//#define PILOT_CLASSIFIER
+#ifdef PILOT_CLASSIFIER
+#define PILOT_HYST 8 // ADC counts, ~0.25V
+#define PILOT_FAST_MARGIN 24 // ADC counts, ~0.75V
+#define PILOT_CONFIRM_CNT 3
+#define PILOT_HIST_BINS 16
+#define PILOT_HIST_SHIFT 4 // 16 ADC counts per bin
+#endif // PILOT_CLASSIFIER
+
 // for ADVPWR
 #define GROUND_CHK_DELAY  1000 // delay after charging started to test, ms
 #define STUCK_RELAY_DELAY 1000 // delay after charging opened to test, ms
@@ -804,6 +1020,18 @@ extern AutoCurrentCapacityController g_ACCController;
 
 #endif // TESTING_TEMPERATURE_OPERATION
 
+// instead of halving the current at THROTTLE_DOWN and quartering it at
+// SHUTDOWN, scale the pilot linearly from 100% at THROTTLE_DOWN down to
+// TEMPERATURE_DERATE_MIN_PCT at PANIC. derating is reduced only once the
+// sensors have cooled by TEMPERATURE_DERATE_HYST, and at most
+// TEMPERATURE_DERATE_SLEW_PCT per TEMPMONITOR_UPDATE_INTERVAL
+//#define TEMPERATURE_DERATE
+#ifdef TEMPERATURE_DERATE
+#define TEMPERATURE_DERATE_MIN_PCT 25 // % of max current capacity at PANIC
+#define TEMPERATURE_DERATE_HYST 20 // 10ths of a degree C
+#define TEMPERATURE_DERATE_SLEW_PCT 2
+#endif // TEMPERATURE_DERATE
+
 #endif // TEMPERATURE_MONITORING
 
 // how long to show each disabled test on LCD
@@ -984,6 +1212,11 @@ public:
 class TempMonitor {
   uint8_t m_Flags;
   unsigned long m_LastUpdate;
+#ifdef TEMPERATURE_DERATE
+  uint8_t m_DeratePct; // 100 = not derated
+
+  uint8_t deratePct(int16_t hyst);
+#endif
 public:
 #ifdef MCP9808_IS_ON_I2C
   MCP9808 m_tempSensor;
@@ -1022,6 +1255,9 @@ public:
   int8_t OverTemperatureShutdown() { return (m_Flags & TMF_OVERTEMPERATURE_SHUTDOWN) ? 1 : 0; }
   uint8_t OverTemperatureLogged() { return (m_Flags & TMF_OVERTEMPERATURE_LOGGED) ? 1 : 0; }
   void ClrOverTemperatureLogged() { m_Flags &= ~TMF_OVERTEMPERATURE_LOGGED; }
+#ifdef TEMPERATURE_DERATE
+  uint8_t GetDeratePct() { return m_DeratePct; }
+#endif
 #ifdef TEMPERATURE_MONITORING_NY
   void LoadThresh();
   void SaveThresh();
@@ -1031,6 +1267,7 @@ public:
 
 #include "J1772Pilot.h"
 #include "J1772EvseController.h"
+#include "DuoShare.h"
 
 #ifdef BTN_MENU
 #define BTN_STATE_OFF   0
@@ -1310,7 +1547,57 @@ public:
 
 #endif // BTN_MENU
 
+#ifdef SOFT_RTC
+#define SOFT_RTC_SYNC_MS (10ul*60ul*1000ul)
+#define SOFT_RTC_SEC_TICKS 16000 // nominal millis() per second, 1/16 ms
+#define SOFT_RTC_MAX_DRIFT 160 // 1% - reject calibrations beyond this
+#define SOFT_RTC_CAL_MIN_SECS 3600ul // min window before updating the rate
+#define SOFT_RTC_CAL_MAX_SECS 86400ul // window restarted after this
+
+class DateTime;
+
+// the time is kept as unix seconds + a fraction, advanced from millis()
+// at a rate calibrated against the RTC, so between syncs it drifts w/ the
+// RTC instead of the CPU clock
+class SoftRtc {
+  uint32_t m_Unix; // seconds since 1/1/1970
+  uint32_t m_Frac; // 1/16 ms since m_Unix
+  unsigned long m_Ms; // millis() when m_Unix/m_Frac last advanced
+  uint16_t m_SecTicks; // millis() per RTC second, 1/16 ms
+  unsigned long m_SyncMs; // millis() at last sync
+  uint32_t m_CalUnix; // RTC time at start of calibration window
+  unsigned long m_CalMs; // millis() at start of calibration window
+
+  void setTime(uint32_t unixtime);
+public:
+  void Init();
+  void Sync();
+  // must be called at least every 74 hrs (every loop())
+  void Service() {
+    if ((millis() - m_SyncMs) >= SOFT_RTC_SYNC_MS) Sync();
+    else Now();
+  }
+  uint32_t Now();
+  void Adjust(const DateTime &dt);
+};
+
+extern SoftRtc g_SoftRtc;
+#endif // SOFT_RTC
+
 #ifdef DELAYTIMER
+#ifdef TOU_SCHEDULE
+#define TOU_MAX_WINDOWS 8
+#define TOU_WEEK_MINS (7u*24u*60u)
+#define TOU_RESYNC_MS (10ul*60ul*1000ul) // max time between RTC reads
+
+typedef struct tou_window {
+  uint8_t days; // bit 0 = Sunday .. bit 6 = Saturday, 0 = unused
+  uint8_t start; // 15 min slot, 0-95
+  uint8_t stop; // 15 min slot, 0-95. <= start = ends the next day
+  uint8_t amps; // current limit, 0 = none
+} TOU_WINDOW;
+#endif // TOU_SCHEDULE
+
 // Start Delay Timer class definition - GoldServe
 class DelayTimer {
   uint8_t m_DelayTimerEnabled;
@@ -1320,6 +1607,17 @@ class DelayTimer {
   uint8_t m_StopTimerMin;
   uint8_t m_ManualOverride;
   unsigned long m_LastCheck;
+#ifdef TOU_SCHEDULE
+  uint8_t m_TouCnt; // # of windows in use
+  // compiled schedule - valid until m_WaitMs after m_CompileMs
+  uint8_t m_Awake;
+  uint8_t m_TouAmps; // current limit, 0 = none
+  unsigned long m_CompileMs;
+  unsigned long m_WaitMs; // 0 = recompile
+
+  void countWindows();
+  void compile();
+#endif // TOU_SCHEDULE
 public:
   DelayTimer(){
     m_LastCheck = - (60ul * 1000ul);
@@ -1355,19 +1653,41 @@ public:
   void SetStartTimer(uint8_t hour, uint8_t min){
     m_StartTimerHour = hour;
     m_StartTimerMin = min;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_START_HOUR, m_StartTimerHour);
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_START_MIN, m_StartTimerMin);
+    EeWriteByte(EOFS_TIMER_START_HOUR, m_StartTimerHour);
+    EeWriteByte(EOFS_TIMER_START_MIN, m_StartTimerMin);
     //    g_EvseController.SaveSettings();
+#ifdef TOU_SCHEDULE
+    Invalidate();
+#endif
   };
   void SetStopTimer(uint8_t hour, uint8_t min){
     m_StopTimerHour = hour;
     m_StopTimerMin = min;
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_STOP_HOUR, m_StopTimerHour);
-    eeprom_write_byte((uint8_t*)EOFS_TIMER_STOP_MIN, m_StopTimerMin);
+    EeWriteByte(EOFS_TIMER_STOP_HOUR, m_StopTimerHour);
+    EeWriteByte(EOFS_TIMER_STOP_MIN, m_StopTimerMin);
     //    g_EvseController.SaveSettings();
+#ifdef TOU_SCHEDULE
+    Invalidate();
+#endif
   };
   uint8_t IsInAwakeTimeInterval(); //
+#ifdef TOU_SCHEDULE
+  // recompile on the next check, e.g. after the RTC is set
+  void Invalidate() { m_WaitMs = 0; }
+  void GetWindow(uint8_t idx,TOU_WINDOW *win);
+  uint8_t SetWindow(uint8_t idx,TOU_WINDOW *win);
+  uint8_t GetTouAmps() { return m_TouAmps; }
+  uint8_t IsAwake() { return m_Awake; }
+  // minutes until the compiled schedule expires
+  uint16_t GetWaitMins() {
+    unsigned long ms = millis() - m_CompileMs;
+    return (ms < m_WaitMs) ? (m_WaitMs - ms) / 60000ul : 0;
+  }
+#endif // TOU_SCHEDULE
   uint8_t IsTimerValid(){
+#ifdef TOU_SCHEDULE
+     if (m_TouCnt) return 1;
+#endif
      if (m_StartTimerHour || m_StartTimerMin || m_StopTimerHour || m_StopTimerMin){ // Check not all equal 0
        if ((m_StartTimerHour == m_StopTimerHour) && (m_StartTimerMin == m_StopTimerMin)){ // Check start time not equal to stop time
          return 0;
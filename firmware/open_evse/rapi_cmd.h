@@ -0,0 +1,92 @@
+// -*- C++ -*-
+#pragma once
+//
+// RAPI command descriptors, argument decoder and command lookup
+// only needs <stdint.h>, <string.h>, UNION4B and the avr/pgmspace.h
+// accessors, so utils/rapi_bench can build it on the host
+//
+
+// argument schema characters for RAPI_CMD.argFmt
+// numeric arguments are decimal, and are range checked by RapiCmdCtx::decode()
+#define RAF_BOOL   'b' // 0|1
+#define RAF_U8     'B'
+#define RAF_U16    'W'
+#define RAF_U32    'L'
+#define RAF_I32    'I' // signed
+#define RAF_CHAR   'c' // 1st character of token
+#define RAF_STRING 's' // consumes all remaining tokens, not decoded
+#define RAPI_MAX_DEC_ARGS 6 // max # decoded arguments
+
+class RapiCmdCtx;
+typedef int8_t (*RapiCmdHandler)(RapiCmdCtx *ctx); // return 0=$OK, else $NK
+
+// PROGMEM command descriptor
+typedef struct rapi_cmd {
+  char name[2];
+  uint8_t minArgs; // args in argFmt beyond minArgs are optional
+  const char *argFmt; // PROGMEM argument schema - RAF_xxx chars
+  RapiCmdHandler handler;
+} RAPI_CMD;
+
+// decode argv[] into arg[] according to argFmt (RAF_xxx)
+// return 0=OK, 1=wrong # of args or invalid/out of range argument
+static inline int8_t rapiDecodeArgs(const char *argFmt,uint8_t minArgs,char **argv,int8_t argc,UNION4B *arg)
+{
+  uint8_t fmtlen = strlen_P(argFmt);
+  if ((argc < minArgs) ||
+      ((argc > fmtlen) && !(fmtlen && (pgm_read_byte(argFmt+fmtlen-1) == RAF_STRING)))) {
+    return 1;
+  }
+
+  for (int8_t i=0;(i < argc) && (i < RAPI_MAX_DEC_ARGS);i++) {
+    char t = pgm_read_byte(argFmt+i);
+    if (t == RAF_STRING) break;
+
+    const char *s = argv[i];
+    if (t == RAF_CHAR) {
+      arg[i].u32 = *s;
+      continue;
+    }
+
+    uint8_t neg = 0;
+    if ((t == RAF_I32) && (*s == '-')) {
+      neg = 1;
+      s++;
+    }
+    if (!*s) return 1;
+    uint32_t u = 0;
+    while (*s) {
+      if ((*s < '0') || (*s > '9')) return 1;
+      u = u*10 + (*(s++) - '0');
+    }
+
+    if (((t == RAF_BOOL) && (u > 1)) ||
+	((t == RAF_U8) && (u > 0xff)) ||
+	((t == RAF_U16) && (u > 0xffff))) {
+      return 1;
+    }
+    arg[i].u32 = neg ? -(int32_t)u : u;
+  }
+  return 0;
+}
+
+// binary search cmds, which must be sorted by name, for token
+// return 1=found and copied to cmd, 0=not found
+static inline int8_t rapiFindCmd(const RAPI_CMD *cmds,uint8_t cnt,const char *token,RAPI_CMD *cmd)
+{
+  uint16_t key = ((uint16_t)token[0] << 8) | (uint8_t)token[1];
+  int8_t lo = 0;
+  int8_t hi = cnt-1;
+  while (lo <= hi) {
+    int8_t mid = (lo + hi) >> 1;
+    uint16_t mkey = ((uint16_t)pgm_read_byte(&cmds[mid].name[0]) << 8) |
+      pgm_read_byte(&cmds[mid].name[1]);
+    if (mkey == key) {
+      memcpy_P(cmd,&cmds[mid],sizeof(RAPI_CMD));
+      return 1;
+    }
+    else if (mkey < key) lo = mid + 1;
+    else hi = mid - 1;
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+// -*- C++ -*-
+//
+// RAPI command table. included by rapi_proc.cpp after the handlers, and by
+// utils/rapi_bench. the includer defines RAPI_HANDLER(h) to map handlers
+// N.B. *must* be sorted by name, because findCmd() does a binary search
+//
+
+// argument schemas
+static const char g_rafNone[] PROGMEM = "";
+static const char g_rafBool[] PROGMEM = "b";
+static const char g_rafU8[] PROGMEM = "B";
+static const char g_rafU32[] PROGMEM = "L";
+static const char g_rafChar[] PROGMEM = "c";
+static const char g_rafCharBool[] PROGMEM = "cb";
+static const char g_rafI32I32[] PROGMEM = "II";
+#ifdef AMMETER
+static const char g_rafSA[] PROGMEM = "IIB";
+#endif
+static const char g_rafU8U8[] PROGMEM = "BB";
+#ifdef LCD16X2
+static const char g_rafFP[] PROGMEM = "BBs";
+#endif
+#ifdef RTC
+static const char g_rafS1[] PROGMEM = "BBBBBB";
+#endif
+static const char g_rafSC[] PROGMEM = "Bc";
+static const char g_rafSD[] PROGMEM = "Wc";
+#ifdef VOLTMETER
+static const char g_rafSM[] PROGMEM = "WI";
+#endif
+#ifdef DUOSHARE
+static const char g_rafSP[] PROGMEM = "BBB";
+#endif
+#ifdef DELAYTIMER
+static const char g_rafST[] PROGMEM = "BBBB";
+#endif
+#ifdef EXT_SETPOINT
+static const char g_rafSX[] PROGMEM = "WWW";
+#endif
+#ifdef TOU_SCHEDULE
+static const char g_rafSU[] PROGMEM = "BBBBB";
+#endif
+#ifdef HEARTBEAT_SUPERVISION
+static const char g_rafSY[] PROGMEM = "WB";
+#endif
+
+static const RAPI_CMD g_RapiCmds[] PROGMEM = {
+  { {'F','0'},1,g_rafBool,RAPI_HANDLER(rapiF0) },
+#ifdef BTN_MENU
+  { {'F','1'},0,g_rafNone,RAPI_HANDLER(rapiF1) },
+#endif
+#ifdef LCD16X2
+  { {'F','B'},1,g_rafU8,RAPI_HANDLER(rapiFB) },
+#endif
+  { {'F','D'},0,g_rafNone,RAPI_HANDLER(rapiFD) },
+  { {'F','E'},0,g_rafNone,RAPI_HANDLER(rapiFE) },
+  { {'F','F'},2,g_rafCharBool,RAPI_HANDLER(rapiFF) },
+#ifdef LCD16X2
+  { {'F','P'},3,g_rafFP,RAPI_HANDLER(rapiFP) },
+#endif
+  { {'F','R'},0,g_rafNone,RAPI_HANDLER(rapiFR) },
+  { {'F','S'},0,g_rafNone,RAPI_HANDLER(rapiFS) },
+  { {'G','0'},0,g_rafNone,RAPI_HANDLER(rapiG0) },
+#ifdef TIME_LIMIT
+  { {'G','3'},0,g_rafNone,RAPI_HANDLER(rapiG3) },
+#endif
+#if defined(AUTH_LOCK) && !defined(AUTH_LOCK_REG)
+  { {'G','4'},0,g_rafNone,RAPI_HANDLER(rapiG4) },
+#endif
+#ifdef MENNEKES_LOCK
+  { {'G','5'},0,g_rafNone,RAPI_HANDLER(rapiG5) },
+#endif
+#ifdef AMMETER
+  { {'G','A'},0,g_rafU8,RAPI_HANDLER(rapiGA) },
+#endif
+#ifdef LOAD_PROFILE
+  { {'G','B'},0,g_rafU8,RAPI_HANDLER(rapiGB) },
+#endif
+  { {'G','C'},0,g_rafNone,RAPI_HANDLER(rapiGC) },
+#ifdef DELAYTIMER
+  { {'G','D'},0,g_rafNone,RAPI_HANDLER(rapiGD) },
+#endif
+  { {'G','E'},0,g_rafNone,RAPI_HANDLER(rapiGE) },
+  { {'G','F'},0,g_rafNone,RAPI_HANDLER(rapiGF) },
+#if defined(AMMETER)||defined(VOLTMETER)
+  { {'G','G'},0,g_rafNone,RAPI_HANDLER(rapiGG) },
+#endif
+#ifdef CHARGE_LIMIT
+  { {'G','H'},0,g_rafNone,RAPI_HANDLER(rapiGH) },
+#endif
+#ifdef MCU_ID_LEN
+  { {'G','I'},0,g_rafNone,RAPI_HANDLER(rapiGI) },
+#endif
+#ifdef PILOT_CLASSIFIER
+  { {'G','K'},1,g_rafU8U8,RAPI_HANDLER(rapiGK) },
+#endif
+  { {'G','L'},0,g_rafU8,RAPI_HANDLER(rapiGL) },
+#ifdef VOLTMETER
+  { {'G','M'},0,g_rafNone,RAPI_HANDLER(rapiGM) },
+#endif
+#ifdef SETTINGS_CACHE
+  { {'G','N'},0,g_rafNone,RAPI_HANDLER(rapiGN) },
+#endif
+#ifdef TEMPERATURE_MONITORING
+#ifdef TEMPERATURE_MONITORING_NY
+  { {'G','O'},0,g_rafNone,RAPI_HANDLER(rapiGO) },
+#endif
+  { {'G','P'},0,g_rafNone,RAPI_HANDLER(rapiGP) },
+#endif // TEMPERATURE_MONITORING
+#if defined(AMMETER) && (AMMETER_CHANNELS > 1)
+  { {'G','Q'},0,g_rafNone,RAPI_HANDLER(rapiGQ) },
+#endif
+#ifdef SESSION_LOG
+  { {'G','R'},1,g_rafU8,RAPI_HANDLER(rapiGR) },
+#endif
+  { {'G','S'},0,g_rafNone,RAPI_HANDLER(rapiGS) },
+#ifdef RTC
+  { {'G','T'},0,g_rafNone,RAPI_HANDLER(rapiGT) },
+#endif
+#ifdef KWH_RECORDING
+  { {'G','U'},0,g_rafNone,RAPI_HANDLER(rapiGU) },
+#endif
+  { {'G','V'},0,g_rafNone,RAPI_HANDLER(rapiGV) },
+#ifdef POWER_QUALITY_STATS
+  { {'G','W'},0,g_rafNone,RAPI_HANDLER(rapiGW) },
+#endif
+  { {'G','X'},0,g_rafNone,RAPI_HANDLER(rapiGX) },
+#ifdef HEARTBEAT_SUPERVISION
+  { {'G','Y'},0,g_rafNone,RAPI_HANDLER(rapiGY) },
+#endif
+#if defined(LCD16X2) && defined(RGBLCD)
+  { {'S','0'},1,g_rafBool,RAPI_HANDLER(rapiS0) },
+#endif
+#ifdef RTC
+  { {'S','1'},6,g_rafS1,RAPI_HANDLER(rapiS1) },
+#endif
+#if defined(AMMETER) && defined(ECVF_AMMETER_CAL)
+  { {'S','2'},1,g_rafBool,RAPI_HANDLER(rapiS2) },
+#endif
+#ifdef TIME_LIMIT
+  { {'S','3'},1,g_rafU8,RAPI_HANDLER(rapiS3) },
+#endif
+#if defined(AUTH_LOCK) && !defined(AUTH_LOCK_REG)
+  { {'S','4'},1,g_rafBool,RAPI_HANDLER(rapiS4) },
+#endif
+#ifdef MENNEKES_LOCK
+  { {'S','5'},1,g_rafChar,RAPI_HANDLER(rapiS5) },
+#endif
+#ifdef AMMETER
+  { {'S','A'},2,g_rafSA,RAPI_HANDLER(rapiSA) },
+#endif
+#ifdef RAPI_SERIAL
+  { {'S','B'},1,g_rafU32,RAPI_HANDLER(rapiSB) },
+#endif
+  { {'S','C'},1,g_rafSC,RAPI_HANDLER(rapiSC) },
+  { {'S','D'},1,g_rafSD,RAPI_HANDLER(rapiSD) },
+#ifdef CHARGE_LIMIT
+  { {'S','E'},1,g_rafU32,RAPI_HANDLER(rapiSE) },
+#endif
+#ifdef MAINS_CT
+  { {'S','G'},0,g_rafU8,RAPI_HANDLER(rapiSG) },
+#endif
+#ifdef CHARGE_LIMIT
+  { {'S','H'},1,g_rafU8,RAPI_HANDLER(rapiSH) },
+#endif
+#ifdef KWH_RECORDING
+  { {'S','K'},1,g_rafU32,RAPI_HANDLER(rapiSK) },
+#endif
+  { {'S','L'},1,g_rafChar,RAPI_HANDLER(rapiSL) },
+#ifdef VOLTMETER
+  { {'S','M'},2,g_rafSM,RAPI_HANDLER(rapiSM) },
+#endif
+#ifdef DUOSHARE
+  { {'S','P'},0,g_rafSP,RAPI_HANDLER(rapiSP) },
+#endif
+#ifdef CURRENT_REGULATION
+  { {'S','R'},0,g_rafBool,RAPI_HANDLER(rapiSR) },
+#endif
+#ifdef DELAYTIMER
+  { {'S','T'},4,g_rafST,RAPI_HANDLER(rapiST) },
+#endif
+#ifdef TOU_SCHEDULE
+  { {'S','U'},0,g_rafSU,RAPI_HANDLER(rapiSU) },
+#endif
+#if defined(KWH_RECORDING) && !defined(VOLTMETER)
+  { {'S','V'},1,g_rafU32,RAPI_HANDLER(rapiSV) },
+#endif
+#ifdef CURRENT_RAMP
+  { {'S','W'},0,g_rafU8,RAPI_HANDLER(rapiSW) },
+#endif
+#ifdef EXT_SETPOINT
+  { {'S','X'},0,g_rafSX,RAPI_HANDLER(rapiSX) },
+#endif
+#ifdef HEARTBEAT_SUPERVISION
+  { {'S','Y'},0,g_rafSY,RAPI_HANDLER(rapiSY) },
+#endif
+#if defined(RAPI_T_COMMANDS) && defined(FAKE_CHARGING_CURRENT)
+  { {'T','0'},1,g_rafU32,RAPI_HANDLER(rapiT0) },
+#endif
+#if defined(RELAY_HOLD_DELAY_TUNING)
+  { {'Z','0'},2,g_rafU8U8,RAPI_HANDLER(rapiZ0) },
+#endif
+};
+#define RAPI_CMD_CNT (sizeof(g_RapiCmds)/sizeof(g_RapiCmds[0]))
@@ -71,32 +71,46 @@ uint8_t htou8(const char *s)
   return u;
 }
 
-// convert decimal string to uint32_t
-uint32_t dtou32(const char *s)
+#ifdef RAPI_I2C
+extern "C" {
+#include "./twi.h"
+}
+
+// TWI slave callbacks - these are called from the TWI ISR
+// just move bytes here. commands are processed in the main loop
+static void i2cRapiRxEvent(uint8_t *data,int cnt)
 {
-  uint32_t u = 0;
-  while (*s) {
-    u *= 10;
-    u += *(s++) - '0';
+#ifdef EXT_SETPOINT
+  if ((cnt == sizeof(EXTSP_PKT)) && (data[0] == EXTSP_MAGIC)) {
+    if ((data[0] ^ data[1] ^ data[2]) == data[3]) {
+      g_EvseController.ExtSetpointIsr(data[1] | (data[2] << 8));
+    }
+    return;
   }
-  return u;
+#endif
+#ifdef DUOSHARE
+  if (g_DuoShare.rxIsr(data,cnt)) return;
+#endif
+  g_EIRP.rxIsr(data,cnt);
 }
 
-#ifdef RAPI_I2C
-//get data from master - HINT: this is a ISR call!
-//HINT2: do not handle stuff here!! this will NOT work
-//collect only data here and process it in the main loop!
-void receiveEvent(int numBytes)
+#ifndef RAPI_I2C_MASTER_TX
+static void i2cRapiTxEvent()
 {
-  //do nothing here
+  g_EIRP.txIsr();
 }
+#endif // !RAPI_I2C_MASTER_TX
 #endif // RAPI_I2C
 
 EvseRapiProcessor::EvseRapiProcessor()
 {
   curReceivedSeqId = INVALID_SEQUENCE_ID;
+  frameOk = 0;
 #ifdef RAPI_SENDER
   curSentSeqId = INVALID_SEQUENCE_ID;
+  for (uint8_t i=0;i < RAPIS_MAX_PENDING;i++) {
+    pending[i].seqId = INVALID_SEQUENCE_ID;
+  }
 #endif
 }
 
@@ -110,6 +124,10 @@ int EvseRapiProcessor::doCmd()
 {
   int rc = 1;
 
+#ifdef RAPI_SENDER
+  checkPendingTimeouts();
+#endif
+
   int bcnt = available();
   if (bcnt) {
     for (int i=0;i < bcnt;i++) {
@@ -150,32 +168,41 @@ int EvseRapiProcessor::doCmd()
 
 void EvseRapiProcessor::sendBootNotification()
 {
-  sprintf(g_sTmp,"%cAB %02x ",ESRAPI_SOC,g_EvseController.GetState());
-  char *s = g_sTmp+strlen(g_sTmp);
-  GetVerStr(s);
-  appendChk(g_sTmp);
   writeStart();
-  write(g_sTmp);
+  wrBegin();
+  wrStr("AB ");
+  wrHex(g_EvseController.GetState(),2);
+  wrByte(' ');
+  wrStr_P(VERSTR);
+  wrEnd();
   writeEnd();
 }
 
 
 void EvseRapiProcessor::sendEvseState()
 {
-    sprintf(g_sTmp,"%cAT %02x %02x %d %04x",ESRAPI_SOC,g_EvseController.GetState(),g_EvseController.GetPilotState(),g_EvseController.GetCurrentCapacity(),g_EvseController.GetVFlags());
-  appendChk(g_sTmp);
   writeStart();
-  write(g_sTmp);
+  wrBegin();
+  wrStr("AT ");
+  wrHex(g_EvseController.GetState(),2);
+  wrByte(' ');
+  wrHex(g_EvseController.GetPilotState(),2);
+  wrByte(' ');
+  wrDec(g_EvseController.GetCurrentCapacity());
+  wrByte(' ');
+  wrHex(g_EvseController.GetVFlags(),4);
+  wrEnd();
   writeEnd();
 }
 
 #ifdef RAPI_WF
 void EvseRapiProcessor::setWifiMode(uint8_t mode)
 {
-  sprintf(g_sTmp,"%cWF %02x",ESRAPI_SOC,(int)mode);
-  appendChk(g_sTmp);
   writeStart();
-  write(g_sTmp);
+  wrBegin();
+  wrStr("WF ");
+  wrHex(mode,2);
+  wrEnd();
   writeEnd();
 }
 #endif // RAPI_WF
@@ -183,10 +210,11 @@ void EvseRapiProcessor::setWifiMode(uint8_t mode)
 #ifdef RAPI_BTN
 void EvseRapiProcessor::sendButtonPress(uint8_t long_press)
 {
-  sprintf(g_sTmp,"%cAN %d", ESRAPI_SOC, long_press);
-  appendChk(g_sTmp);
   writeStart();
-  write(g_sTmp);
+  wrBegin();
+  wrStr("AN ");
+  wrDec(long_press);
+  wrEnd();
   writeEnd();
 }
 #endif // RAPI_BTN
@@ -231,620 +259,1029 @@ int EvseRapiProcessor::tokenize(char *buf)
 	   ((chktype == 1) && (hchkSum == achkSum)) ||
  	   ((chktype == 2) && (hchkSum == xchkSum))) ? 0 : 1;
   if (rc) tokenCnt = 0;
+  // a frame w/o a checksum could be line noise at the wrong baud rate
+  else if (chktype) frameOk = 1;
   //  sprintf(g_sTmp,"trc: %d",rc);
   //  g_EIRP.writeStr(g_sTmp);
 
   return rc;
 }
 
-uint8_t g_inRapiCommand = 0;
-int EvseRapiProcessor::processCmd()
-{
-  g_inRapiCommand = 1;
+//
+// RapiCmdCtx - argument decoder and response encoder
+//
 
-  UNION4B u1,u2,u3,u4;
-  int rc = -1;
+// decode argv[] according to argFmt (RAF_xxx)
+// return 0=OK, 1=wrong # of args or invalid/out of range argument
+int8_t RapiCmdCtx::decode(const char *argFmt,uint8_t minArgs)
+{
+  return rapiDecodeArgs(argFmt,minArgs,argv,argc,arg);
+}
 
-#ifdef RAPI_SENDER
-  // throw away extraneous responses that we weren't expecting
-  // these could be from commands that we already timed out
-  if (isRespToken()) {
-    g_inRapiCommand = 0;
-    return rc;
+// write $OK/$NK, if not already written
+void RapiCmdCtx::start()
+{
+  if (!started) {
+    rp->responseStart(!nak);
+    started = 1;
   }
-#endif // RAPI_SENDER
+}
 
-  curReceivedSeqId = INVALID_SEQUENCE_ID;
-  const char *seqtoken = tokens[tokenCnt-1];
-  if ((tokenCnt > 1) && (*seqtoken == ESRAPI_SOS)) {
-    curReceivedSeqId = htou8(++seqtoken);
-    tokenCnt--;
+void RapiCmdCtx::put(char c)
+{
+  start();
+  rp->wrByte(c);
+}
+
+// unsigned decimal, no separator
+void RapiCmdCtx::putDec(uint32_t u)
+{
+  start();
+  rp->wrDec(u);
+}
+
+void RapiCmdCtx::putI32(int32_t i)
+{
+  field();
+  if (i < 0) {
+    put('-');
+    i = -i;
   }
+  putDec(i);
+}
 
-  // we use bufCnt as a flag in response() to signify data to write
-  bufCnt = 0;
+// digits=0 -> no leading zeros
+void RapiCmdCtx::putHexDigits(uint16_t u,uint8_t digits,char alpha)
+{
+  start();
+  rp->wrHex(u,digits,alpha);
+}
 
-  char *s = tokens[0];
-  switch(*(s++)) {
-  case 'F': // function
-    switch(*s) {
-    case '0': // enable/disable LCD update
-      if (tokenCnt == 2) {
-	g_OBD.DisableUpdate((*tokens[1] == '0') ? 1 : 0);
-	if (*tokens[1] != '0') g_OBD.Update(OBD_UPD_FORCE);
-	rc = 0;
+// standard alphabet, padded w/ =
+void RapiCmdCtx::putBase64(const uint8_t *buf,uint8_t len)
+{
+  field();
+  while (len) {
+    uint8_t n = (len < 3) ? len : 3;
+    uint32_t u = (uint32_t)buf[0] << 16;
+    if (n > 1) u |= (uint16_t)buf[1] << 8;
+    if (n > 2) u |= buf[2];
+    for (int8_t i=0;i < 4;i++) {
+      if (i > n) {
+	put('=');
       }
-      break;
- #ifdef BTN_MENU
-    case '1': // simulate front panel short press
-      g_BtnHandler.DoShortPress(g_EvseController.InFaultState());
-      g_OBD.Update(OBD_UPD_FORCE);
-      rc = 0;
-      break;
+      else {
+	uint8_t v = (u >> 18) & 0x3f;
+	if (v < 26) put('A'+v);
+	else if (v < 52) put('a'+v-26);
+	else if (v < 62) put('0'+v-52);
+	else put((v == 62) ? '+' : '/');
+      }
+      u <<= 6;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+void RapiCmdCtx::putStr_P(const char *s)
+{
+  field();
+  rp->wrStr_P(s);
+}
+
+
+//
+// command handlers
+//
+
+static int8_t rapiF0(RapiCmdCtx *c) // enable/disable LCD update
+{
+  g_OBD.DisableUpdate(c->arg[0].u8 ? 0 : 1);
+  if (c->arg[0].u8) g_OBD.Update(OBD_UPD_FORCE);
+  return 0;
+}
+
+#ifdef BTN_MENU
+static int8_t rapiF1(RapiCmdCtx *c) // simulate front panel short press
+{
+  g_BtnHandler.DoShortPress(g_EvseController.InFaultState());
+  g_OBD.Update(OBD_UPD_FORCE);
+  return 0;
+}
 #endif // BTN_MENU
+
 #ifdef LCD16X2
-    case 'B': // LCD backlight
-      if (tokenCnt == 2) {
-	g_OBD.LcdSetBacklightColor(dtou32(tokens[1]));
-	rc = 0;
-      }
-      break;
+static int8_t rapiFB(RapiCmdCtx *c) // LCD backlight
+{
+  g_OBD.LcdSetBacklightColor(c->arg[0].u8);
+  return 0;
+}
 #endif // LCD16X2
-    case 'D': // disable EVSE
-      g_EvseController.Disable();
-      rc = 0;
-      break;
-    case 'E': // enable EVSE
-      g_EvseController.Enable();
-      rc = 0;
-      break;
-    case 'F': // enable/disable feature
-      if (tokenCnt == 3) {
-	u1.u8 = (uint8_t)(*tokens[2] - '0');
-	if (u1.u8 <= 1) {
-	  rc = 0;
-	  switch(*tokens[1]) {
+
+static int8_t rapiFD(RapiCmdCtx *c) // disable EVSE
+{
+  g_EvseController.Disable();
+  return 0;
+}
+
+static int8_t rapiFE(RapiCmdCtx *c) // enable EVSE
+{
+  g_EvseController.Enable();
+  return 0;
+}
+
+static int8_t rapiFF(RapiCmdCtx *c) // enable/disable feature
+{
+  uint8_t tf = c->arg[1].u8;
+  switch(c->arg[0].u8) {
 #ifdef BTN_MENU
-	  case 'B': // front button enable
-	    g_EvseController.ButtonEnable(u1.u8);
-	    break;
+  case 'B': // front button enable
+    g_EvseController.ButtonEnable(tf);
+    break;
 #endif // BTN_MENU
-	  case 'D': // diode check
-	    g_EvseController.EnableDiodeCheck(u1.u8);
-	    break;
-	  case 'E': // command echo
-	    echo = ((u1.u8 == '0') ? 0 : 1);
-	    break;
+  case 'D': // diode check
+    g_EvseController.EnableDiodeCheck(tf);
+    break;
+  case 'E': // command echo
+    c->rp->setEcho(tf);
+    break;
 #ifdef ADVPWR
-	  case 'F': // GFI self test
-	    g_EvseController.EnableGfiSelfTest(u1.u8);
-	    break;
-	  case 'G': // ground check
-	    g_EvseController.EnableGndChk(u1.u8);
-	    break;
-	  case 'R': // stuck relay check
-	    g_EvseController.EnableStuckRelayChk(u1.u8);
-	    break;
+  case 'F': // GFI self test
+    g_EvseController.EnableGfiSelfTest(tf);
+    break;
+  case 'G': // ground check
+    g_EvseController.EnableGndChk(tf);
+    break;
+  case 'R': // stuck relay check
+    g_EvseController.EnableStuckRelayChk(tf);
+    break;
 #endif // ADVPWR
 #ifdef TEMPERATURE_MONITORING
-	  case 'T': // temperature monitoring
-	    g_EvseController.EnableTempChk(u1.u8);
-	    break;
+  case 'T': // temperature monitoring
+    g_EvseController.EnableTempChk(tf);
+    break;
 #endif // TEMPERATURE_MONITORING
-	  case 'V': // vent required check
-	    g_EvseController.EnableVentReq(u1.u8);
-	    break;
-	  default: // unknown
-	    rc = -1;
-	  }
-	}
-      }
-      break;
-#ifdef LCD16X2
-    case 'P': // print to LCD
-      if ((tokenCnt >= 4) && !g_EvseController.InHardFault()) {
-	u1.u = dtou32(tokens[1]); // x
-	u2.u = dtou32(tokens[2]); // y
-	// now restore the spaces that were replaced w/ nulls by tokenizing
-	for (u3.i=4;u3.i < tokenCnt;u3.i++) {
-	  *(tokens[u3.i]-1) = ' ';
-	}
-	g_OBD.LcdPrint(u1.u,u2.u,tokens[3]);
-	rc = 0;
-      }
-      break;
-#endif // LCD16X2
-    case 'R': // reset EVSE
-      g_EvseController.Reboot();
-      rc = 0;
-      break;
-    case 'S': // sleep
-      g_EvseController.Sleep();
-      rc = 0;
-      break;
-    }
+  case 'V': // vent required check
+    g_EvseController.EnableVentReq(tf);
     break;
+  default: // unknown
+    return 1;
+  }
+  return 0;
+}
 
-  case 'S': // set parameter
-    switch(*s) {
 #ifdef LCD16X2
-    case '0': // set LCD type
-      if (tokenCnt == 2) {
-#ifdef RGBLCD
-	rc = g_EvseController.SetBacklightType((*tokens[1] == '0') ? BKL_TYPE_MONO : BKL_TYPE_RGB);
-#endif // RGBLCD
-      }
-      break;
+static int8_t rapiFP(RapiCmdCtx *c) // print to LCD
+{
+  if (g_EvseController.InHardFault()) return 1;
+  // now restore the spaces that were replaced w/ nulls by tokenizing
+  for (int8_t i=3;i < c->argc;i++) {
+    *(c->argv[i]-1) = ' ';
+  }
+  g_OBD.LcdPrint(c->arg[0].u8,c->arg[1].u8,c->argv[2]);
+  return 0;
+}
 #endif // LCD16X2
-#ifdef RTC
-    case '1': // set RTC
-      if (tokenCnt == 7) {
-	extern void SetRTC(uint8_t y,uint8_t m,uint8_t d,uint8_t h,uint8_t mn,uint8_t s);
-	SetRTC(dtou32(tokens[1]),dtou32(tokens[2]),dtou32(tokens[3]),
-	       dtou32(tokens[4]),dtou32(tokens[5]),dtou32(tokens[6]));
-	rc = 0;
-      }
-      break;
-#endif // RTC
-#if defined(AMMETER) && defined(ECVF_AMMETER_CAL)
-    case '2': // ammeter calibration mode
-      if (tokenCnt == 2) {
-	g_EvseController.EnableAmmeterCal((*tokens[1] == '1') ? 1 : 0);
-	rc = 0;
-      }
-      break;
-#endif // AMMETER && ECVF_AMMETER_CAL
-#ifdef TIME_LIMIT
-    case '3': // set time limit
-      if (tokenCnt == 2) {
-	if (g_EvseController.LimitsAllowed()) {
-	  g_EvseController.SetTimeLimit15(dtou32(tokens[1]));
-	  if (!g_OBD.UpdatesDisabled()) g_OBD.Update(OBD_UPD_FORCE);
-	  rc = 0;
-	}
-      }
-      break;
-#endif // TIME_LIMIT
-#if defined(AUTH_LOCK) && !defined(AUTH_LOCK_REG)
-    case '4': // auth lock
-      if (tokenCnt == 2) {
-	g_EvseController.AuthLock((int8_t)dtou32(tokens[1]),1);
-	rc = 0;
-      }
-      break;
-#endif // AUTH_LOCK && !AUTH_LOCK_REG
-#ifdef MENNEKES_LOCK
-    case '5': // mennekes setting
-      if (tokenCnt == 2) {
-	rc = 0;
-        switch(*tokens[1]) {
-        case '0':
-          g_EvseController.UnlockMennekes();
-          break;
-        case '1':
-          g_EvseController.LockMennekes();
-          break;
-        case 'A':
-          g_EvseController.ClrMennekesManual();
-          break;
-        case 'M':
-          g_EvseController.SetMennekesManual();
-          break;
-        default:
-          rc = 1;
-        }
-      }
-      break;
-#endif // MENNEKES_LOCK
-#ifdef AMMETER
-    case 'A':
-      if (tokenCnt == 3) {
-	g_EvseController.SetCurrentScaleFactor(dtou32(tokens[1]));
-	g_EvseController.SetAmmeterCurrentOffset(dtou32(tokens[2]));
-	rc = 0;
-      }
-      break;
-#endif // AMMETER
-    case 'C': // current capacity
-      if ((tokenCnt == 2) || (tokenCnt == 3)) {
-	u2.u8 = dtou32(tokens[1]);
-	if ((tokenCnt == 3) && (*tokens[2] == 'M')) {
-	  rc = g_EvseController.SetMaxHwCurrentCapacity(u2.u8);
-	  sprintf(buffer,"%d",(int)g_EvseController.GetMaxHwCurrentCapacity());
-	}
-	else {
-	  if (tokenCnt == 3) {
-	    // just make volatile no matter what character specified
-	    u1.u8 = 1; // nosave = 1
-	  }
-	  else {
-	    u1.u8 = 0; // nosave = 0
-	  }
-#ifdef TEMPERATURE_MONITORING
-	  if (g_TempMonitor.OverTemperature() &&
-	      (u2.u8 > g_EvseController.GetCurrentCapacity())) {
-	    // don't allow raising current capacity during
-	    // overtemperature event
-	    rc = 1;
-	  }
-	  else {
-	    rc = g_EvseController.SetCurrentCapacity(u2.u8,1,u1.u8);
-	  }
-#else // !TEMPERATURE_MONITORING
-	  rc = g_EvseController.SetCurrentCapacity(u2.u8,1,u1.u8);
-#endif // TEMPERATURE_MONITORING
-  
-	  sprintf(buffer,"%d",(int)g_EvseController.GetCurrentCapacity());
-	}
-	bufCnt = 1; // flag response text output
-      }
-      break;
-#ifdef CHARGE_LIMIT
-    case 'H': // cHarge limit
-      if (tokenCnt == 2) {
-	if (g_EvseController.LimitsAllowed()) {
-	  g_EvseController.SetChargeLimitkWh(dtou32(tokens[1]));
-	  if (!g_OBD.UpdatesDisabled()) g_OBD.Update(OBD_UPD_FORCE);
-	  rc = 0;
-	}
-      }
-      break;
-#endif // CHARGE_LIMIT
-#ifdef KWH_RECORDING
-    case 'K': // set accumulated kwh
-      g_EnergyMeter.SetTotkWh(dtou32(tokens[1]));
-      g_EnergyMeter.SaveTotkWh();
-      rc = 0;
-      break;
-#endif //KWH_RECORDING
-    case 'L': // service level
-      if (tokenCnt == 2) {
-      switch(*tokens[1]) {
-	case '1':
-	case '2':
-	  g_EvseController.SetSvcLevel(*tokens[1] - '0',1);
-#if defined(ADVPWR) && defined(AUTOSVCLEVEL)
-	  g_EvseController.EnableAutoSvcLevel(0);
-#endif
-	  rc = 0;
-	  break;
-#if defined(ADVPWR) && defined(AUTOSVCLEVEL)
-	case 'A':
-	  g_EvseController.EnableAutoSvcLevel(1);
-	  rc = 0;
-	  break;
-#endif // ADVPWR && AUTOSVCLEVEL
-	}
-      }
-      break;
-#ifdef VOLTMETER
-    case 'M':
-      if (tokenCnt == 3) {
-        g_EvseController.SetVoltmeter(dtou32(tokens[1]),dtou32(tokens[2]));
-	rc = 0;
-      }
-      break;
-#endif // VOLTMETER
-#ifdef DELAYTIMER     
-    case 'T': // timer
-      if (tokenCnt == 5) {
-	extern DelayTimer g_DelayTimer;
-	u1.u8 = (uint8_t)dtou32(tokens[1]);
-	u2.u8 = (uint8_t)dtou32(tokens[2]);
-	u3.u8 = (uint8_t)dtou32(tokens[3]);
-	u4.u8 = (uint8_t)dtou32(tokens[4]);
-	if ((u1.u8 == 0) && (u2.u8 == 0) && (u3.u8 == 0) && (u4.u8 == 0)) {
-	  g_DelayTimer.Disable();
-	}
-	else {
-	  g_DelayTimer.SetStartTimer(u1.u8,u2.u8);
-	  g_DelayTimer.SetStopTimer(u3.u8,u4.u8);
-	  g_DelayTimer.Enable();
-	}
-	rc = 0;
-      }
-      break;
-#endif // DELAYTIMER      
 
-#if defined(KWH_RECORDING) && !defined(VOLTMETER)
-    case 'V': // set voltage
-      if (tokenCnt == 2) {
-        g_EvseController.SetMV(dtou32(tokens[1]));
-	rc = 0;
-      }
-      break;
-#endif //defined(KWH_RECORDING) && !defined(VOLTMETER)
+static int8_t rapiFR(RapiCmdCtx *c) // reset EVSE
+{
+  g_EvseController.Reboot();
+  return 0;
+}
 
-#ifdef HEARTBEAT_SUPERVISION
-    case 'Y': // HEARTBEAT SUPERVISION
-      if (tokenCnt == 1)  { //This is a heartbeat
-        rc = g_EvseController.HsPulse(); //pet the dog
-      }
-      else if (tokenCnt == 3) { //This is a full HEARTBEAT_SUPERVISION setpoint command with both parameters
-	    rc = 0;
-        u1.u16 = (uint16_t)dtou32(tokens[1]);	// HS Interval in seconds.  0 = disabled
-        u2.u8 = (uint8_t)dtou32(tokens[2]);	// HS fallback current, in amperes 
-		if (u1.u16 == 0) { //Test for deactivation {
-          rc = g_EvseController.HsRestoreAmpacity();
-		}
-		rc |= g_EvseController.HeartbeatSupervision(u1.u16, u2.u8);
-      }
-      else if (tokenCnt == 2) { //This is a command to ack a heartbeat supervision miss
-        u1.u8 = (uint8_t)dtou32(tokens[1]); //Magic cookie
-        rc = g_EvseController.HsAckMissedPulse(u1.u8);
-      }
-      else { //Invalid number of tokens, return 1
-        rc = 1; //Invalid number of tokens
-      }
-      sprintf(buffer,"%d %d %d", g_EvseController.GetHearbeatInterval(), g_EvseController.GetHearbeatCurrent(), g_EvseController.GetHearbeatTrigger());
-      bufCnt = 1; 
-      break;
-#endif //HEARTBEAT_SUPERVISION
+static int8_t rapiFS(RapiCmdCtx *c) // sleep
+{
+  g_EvseController.Sleep();
+  return 0;
+}
 
-    }
-    break;
+static int8_t rapiG0(RapiCmdCtx *c) // get EV connect state
+{
+  uint8_t connstate;
+  if (g_EvseController.GetPilot()->GetState() == PILOT_STATE_N12) {
+    connstate = 2; // unknown
+  }
+  else {
+    connstate = g_EvseController.EvConnected() ? 1 : 0;
+  }
+  c->putU32(connstate);
+  return 0;
+}
 
-  case 'G': // get parameter
-    switch(*s) {
-    case '0': // get EV connect state
-      {
-	uint8_t connstate;
-	if (g_EvseController.GetPilot()->GetState() == PILOT_STATE_N12) {
-	  connstate = 2; // unknown
-	}
-	else {
-	  if (g_EvseController.EvConnected()) connstate = 1;
-	  else connstate = 0;
-	}
-	sprintf(buffer,"%d",(int)connstate);
-      }
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
 #ifdef TIME_LIMIT
-    case '3': // get time limit
-      sprintf(buffer,"%d",(int)g_EvseController.GetTimeLimit15());
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiG3(RapiCmdCtx *c) // get time limit
+{
+  c->putU32(g_EvseController.GetTimeLimit15());
+  return 0;
+}
 #endif // TIME_LIMIT
+
 #if defined(AUTH_LOCK) && !defined(AUTH_LOCK_REG)
-    case '4': // get auth lock
-      sprintf(buffer,"%d",(int)g_EvseController.AuthLockIsOn() ? 1 : 0);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiG4(RapiCmdCtx *c) // get auth lock
+{
+  c->putU32(g_EvseController.AuthLockIsOn() ? 1 : 0);
+  return 0;
+}
 #endif // AUTH_LOCK && !AUTH_LOCK_REG
+
 #ifdef MENNEKES_LOCK
-    case '5': // get mennekes setting
-      sprintf(buffer,"%d %c",g_EvseController.MennekesIsLocked(),
-              g_EvseController.MennekesIsManual() ? 'M' : 'A');
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiG5(RapiCmdCtx *c) // get mennekes setting
+{
+  c->putU32(g_EvseController.MennekesIsLocked());
+  c->putChar(g_EvseController.MennekesIsManual() ? 'M' : 'A');
+  return 0;
+}
 #endif // MENNEKES_LOCK
+
 #ifdef AMMETER
-    case 'A':
-      u1.i = g_EvseController.GetCurrentScaleFactor();
-      u2.i = g_EvseController.GetAmmeterCurrentOffset();
-      sprintf(buffer,"%d %d",u1.i,u2.i);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGA(RapiCmdCtx *c) // get ammeter settings
+{
+  uint8_t ch = (c->argc == 1) ? c->arg[0].u8 : 0;
+  if (ch >= AMMETER_ADC_CNT) return 1;
+  c->putI32(g_EvseController.GetCurrentScaleFactor(ch));
+  c->putI32(g_EvseController.GetAmmeterCurrentOffset(ch));
+  return 0;
+}
 #endif // AMMETER
-    case 'C': // get current capacity range
-      u1.i = MIN_CURRENT_CAPACITY_J1772;
-      if (g_EvseController.GetCurSvcLevel() == 2) {
-	u2.i = g_EvseController.GetMaxHwCurrentCapacity();
-      }
-      else {
-	u2.i = MAX_CURRENT_CAPACITY_L1;
-      }
-      u3.i = g_EvseController.GetCurrentCapacity();
-      u4.i = g_EvseController.GetMaxCurrentCapacity();
-      sprintf(buffer,"%d %d %d %d",u1.i,u2.i,u3.i,u4.i);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+
+static int8_t rapiGC(RapiCmdCtx *c) // get current capacity range
+{
+  c->putU32(MIN_CURRENT_CAPACITY_J1772);
+  if (g_EvseController.GetCurSvcLevel() == 2) {
+    c->putU32(g_EvseController.GetMaxHwCurrentCapacity());
+  }
+  else {
+    c->putU32(MAX_CURRENT_CAPACITY_L1);
+  }
+  c->putU32(g_EvseController.GetCurrentCapacity());
+  c->putU32(g_EvseController.GetMaxCurrentCapacity());
+  return 0;
+}
+
 #ifdef DELAYTIMER
-    case 'D': // get delay timer
-      extern DelayTimer g_DelayTimer;
-      if (g_DelayTimer.IsTimerEnabled()) {
-	u1.i = g_DelayTimer.GetStartTimerHour();
-	u2.i = g_DelayTimer.GetStartTimerMin();
-	u3.i = g_DelayTimer.GetStopTimerHour();
-	u4.i = g_DelayTimer.GetStopTimerMin();
-      }
-      else {
-	u1.i = 0;
-	u2.i = 0;
-	u3.i = 0;
-	u4.i = 0;
-      }
-      sprintf(buffer,"%d %d %d %d",u1.i,u2.i,u3.i,u4.i);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGD(RapiCmdCtx *c) // get delay timer
+{
+  if (g_DelayTimer.IsTimerEnabled()) {
+    c->putU32(g_DelayTimer.GetStartTimerHour());
+    c->putU32(g_DelayTimer.GetStartTimerMin());
+    c->putU32(g_DelayTimer.GetStopTimerHour());
+    c->putU32(g_DelayTimer.GetStopTimerMin());
+  }
+  else {
+    for (uint8_t i=0;i < 4;i++) c->putU32(0);
+  }
+  return 0;
+}
 #endif // DELAYTIMER
-    case 'E': // get settings
-      u1.u = g_EvseController.GetCurrentCapacity();
-      u2.u = g_EvseController.GetFlags();
-      sprintf(buffer,"%d %04x",u1.u,u2.u);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
-    case 'F': // get fault counters
+
+static int8_t rapiGE(RapiCmdCtx *c) // get settings
+{
+  c->putU32(g_EvseController.GetCurrentCapacity());
+  c->putHex(g_EvseController.GetFlags(),4);
+  c->putU32(g_EvseController.GetCurrentCapacityDa());
+  return 0;
+}
+
+static int8_t rapiGF(RapiCmdCtx *c) // get fault counters
+{
 #ifdef GFI
-      u1.u = g_EvseController.GetGfiTripCnt();
+  c->putHex(g_EvseController.GetGfiTripCnt());
 #else
-      u1.u = 0;
+  c->putHex(0);
 #endif // GFI
 #ifdef ADVPWR
-      u2.u = g_EvseController.GetNoGndTripCnt();
-      u3.u = g_EvseController.GetStuckRelayTripCnt();
+  c->putHex(g_EvseController.GetNoGndTripCnt());
+  c->putHex(g_EvseController.GetStuckRelayTripCnt());
 #else
-	  u2.u = 0;
-	  u3.u = 0;
+  c->putHex(0);
+  c->putHex(0);
 #endif // ADVPWR
-      sprintf(buffer,"%x %x %x",u1.u,u2.u,u3.u);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+  return 0;
+}
+
 #if defined(AMMETER)||defined(VOLTMETER)
-    case 'G':
-      u1.i32 = g_EvseController.GetChargingCurrent();
-      u2.i32 = (int32_t)g_EvseController.GetVoltage();
-      sprintf(buffer,"%ld %ld",u1.i32,u2.i32);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGG(RapiCmdCtx *c) // get charging current and voltage
+{
+  c->putI32(g_EvseController.GetChargingCurrent());
+  c->putI32((int32_t)g_EvseController.GetVoltage());
+  return 0;
+}
 #endif // AMMETER || VOLTMETER
+
+#if defined(AMMETER) && (AMMETER_CHANNELS > 1)
+static int8_t rapiGQ(RapiCmdCtx *c) // get per-phase current and energy
+{
+  uint8_t ch;
+  for (ch=0;ch < AMMETER_CHANNELS;ch++) {
+    c->putI32(g_EvseController.GetPhaseCurrent(ch));
+  }
+#ifdef KWH_RECORDING
+  for (ch=0;ch < AMMETER_CHANNELS;ch++) {
+    c->putU32(g_EnergyMeter.GetPhaseSessionWs(ch));
+  }
+#endif
+  return 0;
+}
+#endif // AMMETER && AMMETER_CHANNELS > 1
+
 #ifdef CHARGE_LIMIT
-    case 'H': // get cHarge limit
-      sprintf(buffer,"%d",(int)g_EvseController.GetChargeLimitkWh());
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGH(RapiCmdCtx *c) // get cHarge limit
+{
+  c->putU32(g_EvseController.GetChargeLimitkWh());
+  c->putU32(g_EvseController.GetChargeLimitWh());
+  return 0;
+}
 #endif // CHARGE_LIMIT
+
 #ifdef MCU_ID_LEN
-    case 'I': // get MCU ID
-      {
-        uint8_t mcuid[MCU_ID_LEN];
-        getMcuId(mcuid);
-        char *s = buffer;
-        *(s++) = ' ';
-        for (int i=0;i < 6;i++) {
-          *(s++) = mcuid[i];
-        }
-        for (int i=6;i < MCU_ID_LEN;i++) {
-          sprintf(s,"%02X",mcuid[i]);
-          s += 2;
-        }
-        bufCnt = 1; // flag response text output
-        rc = 0;
-      }
-      break;
+static int8_t rapiGI(RapiCmdCtx *c) // get MCU ID
+{
+  uint8_t mcuid[MCU_ID_LEN];
+  getMcuId(mcuid);
+  c->field();
+  c->put(' '); // legacy: mcuid has always been preceded by 2 spaces
+  for (int i=0;i < 6;i++) {
+    c->put(mcuid[i]);
+  }
+  for (int i=6;i < MCU_ID_LEN;i++) {
+    c->putHexDigits(mcuid[i],2,'A');
+  }
+  return 0;
+}
 #endif // MCU_ID_LEN
+
+#ifdef PILOT_CLASSIFIER
+static int8_t rapiGK(RapiCmdCtx *c) // get pilot histogram
+{
+  uint8_t state = c->arg[0].u8;
+  if ((state < EVSE_STATE_A) || (state > EVSE_STATE_D)) return 1;
+  uint16_t *hist = g_EvseController.GetPilotHist(state);
+  c->putU32(g_EvseController.GetPilotHistBase(state));
+  c->putU32(1 << PILOT_HIST_SHIFT);
+  c->field();
+  for (uint8_t i=0;i < PILOT_HIST_BINS;i++) {
+    c->putHexDigits(hist[i],4);
+  }
+  if ((c->argc == 2) && c->arg[1].u8) g_EvseController.ClrPilotHist(state);
+  return 0;
+}
+#endif // PILOT_CLASSIFIER
+
+static int8_t rapiGL(RapiCmdCtx *c); // get command list - needs g_RapiCmds
+
 #ifdef VOLTMETER
-    case 'M':
-      u1.i = g_EvseController.GetVoltScaleFactor();
-      u2.i32 = g_EvseController.GetVoltOffset();
-      sprintf(buffer,"%d %ld",u1.i,u2.i32);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGM(RapiCmdCtx *c) // get voltmeter settings
+{
+  c->putU32(g_EvseController.GetVoltScaleFactor());
+  c->putI32(g_EvseController.GetVoltOffset());
+  return 0;
+}
 #endif // VOLTMETER
+
 #ifdef TEMPERATURE_MONITORING
 #ifdef TEMPERATURE_MONITORING_NY
-    case 'O':
-      u1.i = g_TempMonitor.m_ambient_thresh;
-      u2.i = g_TempMonitor.m_ir_thresh;
-      sprintf(buffer,"%d %d",u1.i,u2.i);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGO(RapiCmdCtx *c) // get overtemperature thresholds
+{
+  c->putI32(g_TempMonitor.m_ambient_thresh);
+  c->putI32(g_TempMonitor.m_ir_thresh);
+  return 0;
+}
 #endif // TEMPERATURE_MONITORING_NY
-    case 'P':
-      sprintf(buffer,"%d %d %d",(int)g_TempMonitor.m_DS3231_temperature,
-	      (int)g_TempMonitor.m_MCP9808_temperature,
-	      (int)g_TempMonitor.m_TMP007_temperature);
-      /* this is bigger than using sprintf
-      strcpy(buffer,u2a(g_TempMonitor.m_DS3231_temperature));
-      strcat(buffer,g_sSpace);
-      strcat(buffer,u2a(g_TempMonitor.m_MCP9808_temperature));
-      strcat(buffer,g_sSpace);
-      strcat(buffer,u2a(g_TempMonitor.m_TMP007_temperature));
-      */
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+
+static int8_t rapiGP(RapiCmdCtx *c) // get temperatures
+{
+  c->putI32(g_TempMonitor.m_DS3231_temperature);
+  c->putI32(g_TempMonitor.m_MCP9808_temperature);
+  c->putI32(g_TempMonitor.m_TMP007_temperature);
+#ifdef TEMPERATURE_DERATE
+  c->putU32(g_TempMonitor.GetDeratePct());
+  c->putU32(g_EvseController.GetThermDa());
+#endif
+  return 0;
+}
 #endif // TEMPERATURE_MONITORING
-    case 'S': // get state
-      u1.u8 = g_EvseController.GetState();
-      u2.u8 = g_EvseController.GetPilotState();
-      u3.u16 = g_EvseController.GetVFlags();
-      sprintf(buffer,"%02x %ld %02x %04x",u1.u8,g_EvseController.GetElapsedChargeTime(),u2.u8,u3.u16);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+
+static int8_t rapiGS(RapiCmdCtx *c) // get state
+{
+  c->putHex(g_EvseController.GetState(),2);
+  c->putU32(g_EvseController.GetElapsedChargeTime());
+  c->putHex(g_EvseController.GetPilotState(),2);
+  c->putHex(g_EvseController.GetVFlags(),4);
+  return 0;
+}
+
 #ifdef RTC
-    case 'T': // get time
-      extern void GetRTC(char *buf);
-      GetRTC(buffer);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
+static int8_t rapiGT(RapiCmdCtx *c) // get time
+{
+  extern void GetRTC(uint8_t *ymdhms);
+  uint8_t ymdhms[6];
+  GetRTC(ymdhms);
+  for (uint8_t i=0;i < 6;i++) {
+    c->putU32(ymdhms[i]);
+  }
+  return 0;
+}
 #endif // RTC
+
 #ifdef KWH_RECORDING
-    case 'U':
-      sprintf(buffer,"%lu %lu",g_EnergyMeter.GetSessionWs(),g_EnergyMeter.GetTotkWh());
-      bufCnt = 1;
-      rc = 0;
-      break;
+static int8_t rapiGU(RapiCmdCtx *c) // get energy usage
+{
+  c->putU32(g_EnergyMeter.GetSessionWs());
+  c->putU32(g_EnergyMeter.GetTotkWh());
+  return 0;
+}
 #endif // KWH_RECORDING
-    case 'V': // get version
-      GetVerStr(buffer);
-      strcat(buffer," ");
-      strcat_P(buffer,RAPI_VER);
-      bufCnt = 1; // flag response text output
-      rc = 0;
-      break;
-	  
+
+#ifdef LOAD_PROFILE
+static int8_t rapiGB(RapiCmdCtx *c) // get load profile buckets
+{
+  uint8_t cnt = g_LoadProfile.GetCount();
+  if ((c->argc == 1) && (c->arg[0].u8 < cnt)) cnt = c->arg[0].u8;
+  c->putU32(LOAD_PROFILE_INTERVAL_SECS/60);
+  c->putU32(g_LoadProfile.GetLastStart());
+  c->putU32(cnt);
+  if (cnt) {
+    c->field();
+    for (uint8_t i=0;i < cnt;i++) {
+      LP_BUCKET b;
+      g_LoadProfile.GetBucket(i,&b);
+      c->putHexDigits(b.wh,4);
+      c->putHexDigits(b.maxDa,4);
+      c->putHexDigits(b.avgDv,4);
+    }
+  }
+  return 0;
+}
+#endif // LOAD_PROFILE
+
+#ifdef SETTINGS_CACHE
+static int8_t rapiGN(RapiCmdCtx *c) // get NVRAM (EEPROM) write stats
+{
+  c->putU32(g_EeSettings.GetChgCnt());
+  c->putU32(g_EeSettings.GetWrCnt());
+  c->putU32(g_EeSettings.IsIdle() ? 0 : 1);
+  return 0;
+}
+#endif // SETTINGS_CACHE
+
+#ifdef POWER_QUALITY_STATS
+static int8_t rapiGW(RapiCmdCtx *c) // get session power quality stats
+{
+  PQ_STATS *pq = g_EnergyMeter.GetPqStats();
+  c->putU32((pq->minDv == 0xffff) ? 0 : pq->minDv);
+  c->putU32(pq->maxDv);
+  c->putU32(pq->dvCnt ? pq->dvSum / pq->dvCnt : 0);
+  c->putU32((pq->minDa == 0xffff) ? 0 : pq->minDa);
+  c->putU32(pq->maxDa);
+  c->putU32(pq->daCnt ? pq->daSum / pq->daCnt : 0);
+  c->putU32(pq->sagCnt);
+  c->putU32(pq->overCurrentMs / 1000);
+  return 0;
+}
+#endif // POWER_QUALITY_STATS
+
+#ifdef SESSION_LOG
+static int8_t rapiGR(RapiCmdCtx *c) // get session history record
+{
+  SESSION_REC rec;
+  if (g_EnergyMeter.GetSessionRec(c->arg[0].u8,&rec)) return 1;
+  c->putU32(rec.seq);
+  c->putU32(rec.start);
+  c->putU32(rec.duration);
+  c->putU32(rec.wh);
+  c->putU32(rec.peakDa);
+  c->putU32(rec.avgDv);
+  c->putU32(rec.reason);
+  return 0;
+}
+#endif // SESSION_LOG
+
+static int8_t rapiGV(RapiCmdCtx *c) // get version
+{
+  c->putStr_P(VERSTR);
+  c->putStr_P(RAPI_VER);
+  return 0;
+}
+
+// $GX snapshot. little endian. fields are only ever appended, and
+// RSNAP_VERSION bumped when they are
+#define RSNAP_VERSION 1
+typedef struct rapi_snapshot {
+  uint8_t version; // RSNAP_VERSION
+  uint8_t evseState; // $GS
+  uint8_t pilotState;
+  uint16_t vFlags;
+  uint32_t elapsed;
+  uint16_t flags; // $GE
+  uint8_t currentCapacity;
+  int32_t ma; // $GG
+  int32_t mv;
+  uint32_t sessionWs; // $GU
+  uint32_t whTot;
+  uint8_t gfiTripCnt; // $GF
+  uint8_t noGndTripCnt;
+  uint8_t stuckRelayTripCnt;
+  uint32_t chargeLimitWh; // $GH
+  uint8_t timeLimit15; // $G3
+  uint32_t unixtime; // $GT
+} __attribute__((packed)) RAPI_SNAPSHOT;
+static_assert(sizeof(RAPI_SNAPSHOT) == 40,"update GX doc in rapi_proc.h");
+
+static int8_t rapiGX(RapiCmdCtx *c) // get snapshot
+{
+  RAPI_SNAPSHOT s;
+  memset(&s,0,sizeof(s));
+  s.version = RSNAP_VERSION;
+  s.evseState = g_EvseController.GetState();
+  s.pilotState = g_EvseController.GetPilotState();
+  s.vFlags = g_EvseController.GetVFlags();
+  s.elapsed = g_EvseController.GetElapsedChargeTime();
+  s.flags = g_EvseController.GetFlags();
+  s.currentCapacity = g_EvseController.GetCurrentCapacity();
+  s.ma = g_EvseController.GetChargingCurrent();
+  s.mv = g_EvseController.GetVoltage();
+#ifdef KWH_RECORDING
+  s.sessionWs = g_EnergyMeter.GetSessionWs();
+  s.whTot = g_EnergyMeter.GetTotkWh();
+#endif
+#ifdef GFI
+  s.gfiTripCnt = g_EvseController.GetGfiTripCnt();
+#endif
+#ifdef ADVPWR
+  s.noGndTripCnt = g_EvseController.GetNoGndTripCnt();
+  s.stuckRelayTripCnt = g_EvseController.GetStuckRelayTripCnt();
+#endif
+#ifdef CHARGE_LIMIT
+  s.chargeLimitWh = g_EvseController.GetChargeLimitWh();
+#endif
+#ifdef TIME_LIMIT
+  s.timeLimit15 = g_EvseController.GetTimeLimit15();
+#endif
+#ifdef RTC
+  extern uint32_t GetRTCUnixtime();
+  s.unixtime = GetRTCUnixtime();
+#endif
+  c->putBase64((const uint8_t *)&s,sizeof(s));
+  return 0;
+}
+
 #ifdef HEARTBEAT_SUPERVISION
-    case 'Y': // HEARTBEAT SUPERVISION
-	  sprintf(buffer,"%d %d %d", g_EvseController.GetHearbeatInterval(), g_EvseController.GetHearbeatCurrent(), g_EvseController.GetHearbeatTrigger());
-      bufCnt = 1; 
-	  rc = 0;
-      break;
+static int8_t rapiGY(RapiCmdCtx *c) // get heartbeat supervision status
+{
+  c->putI32(g_EvseController.GetHearbeatInterval());
+  c->putI32(g_EvseController.GetHearbeatCurrent());
+  c->putI32(g_EvseController.GetHearbeatTrigger());
+  return 0;
+}
 #endif //HEARTBEAT_SUPERVISION
-	   
-    }
+
+#if defined(LCD16X2) && defined(RGBLCD)
+static int8_t rapiS0(RapiCmdCtx *c) // set LCD type
+{
+  return g_EvseController.SetBacklightType(c->arg[0].u8 ? BKL_TYPE_RGB : BKL_TYPE_MONO);
+}
+#endif // LCD16X2 && RGBLCD
+
+#ifdef RTC
+static int8_t rapiS1(RapiCmdCtx *c) // set RTC
+{
+  extern void SetRTC(uint8_t y,uint8_t m,uint8_t d,uint8_t h,uint8_t mn,uint8_t s);
+  SetRTC(c->arg[0].u8,c->arg[1].u8,c->arg[2].u8,
+	 c->arg[3].u8,c->arg[4].u8,c->arg[5].u8);
+  return 0;
+}
+#endif // RTC
+
+#if defined(AMMETER) && defined(ECVF_AMMETER_CAL)
+static int8_t rapiS2(RapiCmdCtx *c) // ammeter calibration mode
+{
+  g_EvseController.EnableAmmeterCal(c->arg[0].u8);
+  return 0;
+}
+#endif // AMMETER && ECVF_AMMETER_CAL
+
+#ifdef TIME_LIMIT
+static int8_t rapiS3(RapiCmdCtx *c) // set time limit
+{
+  if (g_EvseController.LimitsAllowed()) {
+    g_EvseController.SetTimeLimit15(c->arg[0].u8);
+    if (!g_OBD.UpdatesDisabled()) g_OBD.Update(OBD_UPD_FORCE);
+    return 0;
+  }
+  return 1;
+}
+#endif // TIME_LIMIT
+
+#if defined(AUTH_LOCK) && !defined(AUTH_LOCK_REG)
+static int8_t rapiS4(RapiCmdCtx *c) // auth lock
+{
+  g_EvseController.AuthLock(c->arg[0].u8,1);
+  return 0;
+}
+#endif // AUTH_LOCK && !AUTH_LOCK_REG
+
+#ifdef MENNEKES_LOCK
+static int8_t rapiS5(RapiCmdCtx *c) // mennekes setting
+{
+  switch(c->arg[0].u8) {
+  case '0':
+    g_EvseController.UnlockMennekes();
+    break;
+  case '1':
+    g_EvseController.LockMennekes();
+    break;
+  case 'A':
+    g_EvseController.ClrMennekesManual();
+    break;
+  case 'M':
+    g_EvseController.SetMennekesManual();
     break;
+  default:
+    return 1;
+  }
+  return 0;
+}
+#endif // MENNEKES_LOCK
 
-#ifdef RAPI_T_COMMANDS
-  case 'T': // testing op
-    switch(*s) {
-#ifdef FAKE_CHARGING_CURRENT
-    case '0': // set fake charging current
-      if (tokenCnt == 2) {
-	g_EvseController.SetChargingCurrent(dtou32(tokens[1])*1000);
-	g_OBD.SetAmmeterDirty(1);
-	g_OBD.Update(OBD_UPD_FORCE);
-	rc = 0;
-      }
-      break;
-#endif // FAKE_CHARGING_CURRENT
+#ifdef AMMETER
+static int8_t rapiSA(RapiCmdCtx *c) // set ammeter settings
+{
+  uint8_t ch = (c->argc == 3) ? c->arg[2].u8 : 0;
+  if (ch >= AMMETER_ADC_CNT) return 1;
+  g_EvseController.SetCurrentScaleFactor(c->arg[0].i32,ch);
+  g_EvseController.SetAmmeterCurrentOffset(c->arg[1].i32,ch);
+  return 0;
+}
+#endif // AMMETER
+
+#ifdef RAPI_SERIAL
+static int8_t rapiSB(RapiCmdCtx *c) // serial baud rate
+{
+  return c->rp->setBaud(c->arg[0].u32);
+}
+#endif // RAPI_SERIAL
+
+static int8_t rapiSC(RapiCmdCtx *c) // current capacity
+{
+  int8_t rc;
+  uint8_t amps = c->arg[0].u8;
+  if ((c->argc == 2) && (c->arg[1].u8 == 'M')) {
+    rc = g_EvseController.SetMaxHwCurrentCapacity(amps);
+    c->setNak(rc);
+    c->putU32(g_EvseController.GetMaxHwCurrentCapacity());
+  }
+  else {
+    // just make volatile no matter what character specified
+    uint8_t nosave = (c->argc == 2) ? 1 : 0;
+#ifdef TEMPERATURE_MONITORING
+    if (g_TempMonitor.OverTemperature() &&
+	(amps > g_EvseController.GetCurrentCapacity())) {
+      // don't allow raising current capacity during
+      // overtemperature event
+      rc = 1;
     }
-    break;
-#endif //RAPI_T_COMMANDS
-#if defined(RELAY_HOLD_DELAY_TUNING)
-  case 'Z': // reserved op
-    switch(*s) {
-    case '0': // set relayCloseMs
-      if (tokenCnt == 3) {
-	u1.u8 = dtou32(tokens[1]);
-	u2.u8 = dtou32(tokens[2]);
-	g_EvseController.setPwmPinParms(u1.u8,u2.u8);
-	sprintf(g_sTmp,"\nZ0 %u %u",(unsigned)u1.u8,(unsigned)u2.u8);
-	Serial.println(g_sTmp);
-	eeprom_write_byte((uint8_t*)EOFS_RELAY_CLOSE_MS,u1.u8);
-	eeprom_write_byte((uint8_t*)EOFS_RELAY_HOLD_PWM,u2.u8);
-      }
-      rc = 0;
-      break;
+    else {
+      rc = g_EvseController.SetCurrentCapacity(amps,1,nosave);
+    }
+#else // !TEMPERATURE_MONITORING
+    rc = g_EvseController.SetCurrentCapacity(amps,1,nosave);
+#endif // TEMPERATURE_MONITORING
+    c->setNak(rc);
+    c->putU32(g_EvseController.GetCurrentCapacity());
+  }
+  return rc;
+}
+
+static int8_t rapiSD(RapiCmdCtx *c) // current capacity in Deciamps
+{
+  int8_t rc;
+  uint16_t da = c->arg[0].u16;
+  uint8_t nosave = (c->argc == 2) ? 1 : 0;
+#ifdef TEMPERATURE_MONITORING
+  if (g_TempMonitor.OverTemperature() &&
+      (da > g_EvseController.GetCurrentCapacityDa())) {
+    rc = 1;
+  }
+  else
+#endif // TEMPERATURE_MONITORING
+    rc = g_EvseController.SetCurrentCapacityDa(da,1,nosave);
+  c->setNak(rc);
+  c->putU32(g_EvseController.GetCurrentCapacityDa());
+  return rc;
+}
+
+#ifdef MAINS_CT
+static int8_t rapiSG(RapiCmdCtx *c) // site (Grid) limit
+{
+  if (c->argc) {
+    g_EvseController.SetMainsLimit(c->arg[0].u8);
+  }
+  c->putU32(g_EvseController.GetMainsLimit());
+  c->putI32(g_EvseController.GetMainsCurrent());
+  c->putU32(g_EvseController.MainsThrottled());
+  return 0;
+}
+#endif // MAINS_CT
+
+#ifdef CHARGE_LIMIT
+static int8_t rapiSH(RapiCmdCtx *c) // cHarge limit
+{
+  if (g_EvseController.LimitsAllowed()) {
+    g_EvseController.SetChargeLimitkWh(c->arg[0].u8);
+    if (!g_OBD.UpdatesDisabled()) g_OBD.Update(OBD_UPD_FORCE);
+    return 0;
+  }
+  return 1;
+}
+
+static int8_t rapiSE(RapiCmdCtx *c) // Energy (charge) limit in Wh
+{
+  if (g_EvseController.LimitsAllowed()) {
+    g_EvseController.SetChargeLimitWh(c->arg[0].u32);
+    if (!g_OBD.UpdatesDisabled()) g_OBD.Update(OBD_UPD_FORCE);
+    return 0;
+  }
+  return 1;
+}
+#endif // CHARGE_LIMIT
+
+#ifdef KWH_RECORDING
+static int8_t rapiSK(RapiCmdCtx *c) // set accumulated kwh
+{
+  g_EnergyMeter.SetTotkWh(c->arg[0].u32);
+  g_EnergyMeter.SaveTotkWh();
+  return 0;
+}
+#endif //KWH_RECORDING
 
+static int8_t rapiSL(RapiCmdCtx *c) // service level
+{
+  switch(c->arg[0].u8) {
+  case '1':
+  case '2':
+    g_EvseController.SetSvcLevel(c->arg[0].u8 - '0',1);
+#if defined(ADVPWR) && defined(AUTOSVCLEVEL)
+    g_EvseController.EnableAutoSvcLevel(0);
+#endif
+    return 0;
+#if defined(ADVPWR) && defined(AUTOSVCLEVEL)
+  case 'A':
+    g_EvseController.EnableAutoSvcLevel(1);
+    return 0;
+#endif // ADVPWR && AUTOSVCLEVEL
+  }
+  return 1;
+}
+
+#ifdef VOLTMETER
+static int8_t rapiSM(RapiCmdCtx *c) // set voltmeter settings
+{
+  g_EvseController.SetVoltmeter(c->arg[0].u16,c->arg[1].u32);
+  return 0;
+}
+#endif // VOLTMETER
+
+#ifdef CURRENT_REGULATION
+static int8_t rapiSR(RapiCmdCtx *c) // current Regulation
+{
+  if (c->argc) {
+    g_EvseController.EnableCurrentReg(c->arg[0].u8);
+  }
+  c->putU32(g_EvseController.CurrentRegEnabled());
+  c->putU32(g_EvseController.GetPilotDa());
+  c->putU32(g_EvseController.GetTargetDa());
+  return 0;
+}
+#endif // CURRENT_REGULATION
+
+#ifdef DUOSHARE
+static int8_t rapiSP(RapiCmdCtx *c) // shared Power pool
+{
+  if (c->argc == 3) {
+    uint8_t groupamps = c->arg[0].u8;
+    uint8_t fallbackamps = c->arg[1].u8;
+    uint8_t addr = c->arg[2].u8;
+    if ((groupamps < MIN_CURRENT_CAPACITY_J1772) ||
+	(fallbackamps < MIN_CURRENT_CAPACITY_J1772) ||
+	(fallbackamps > groupamps) || !addr || (addr > 0x7f)) {
+      return 1;
     }
-    break;
+    g_DuoShare.Reconfigure(groupamps,fallbackamps,addr);
+  }
+  else if (c->argc == 1) {
+    if (c->arg[0].u8) return 1;
+    g_DuoShare.Reconfigure(0,0,0);
+  }
+  else if (c->argc) return 1;
+
+  c->putU32(g_DuoShare.GetGroupAmps());
+  c->putU32(g_DuoShare.GetFallbackAmps());
+  c->putU32(g_DuoShare.GetAddr());
+  c->putU32(g_DuoShare.GetPeerCnt());
+  c->putU32(g_DuoShare.GetLimitDa());
+  return 0;
+}
+#endif // DUOSHARE
+
+#ifdef DELAYTIMER
+static int8_t rapiST(RapiCmdCtx *c) // timer
+{
+  if (!c->arg[0].u8 && !c->arg[1].u8 && !c->arg[2].u8 && !c->arg[3].u8) {
+    g_DelayTimer.Disable();
+  }
+  else {
+    g_DelayTimer.SetStartTimer(c->arg[0].u8,c->arg[1].u8);
+    g_DelayTimer.SetStopTimer(c->arg[2].u8,c->arg[3].u8);
+    g_DelayTimer.Enable();
+  }
+  return 0;
+}
+#endif // DELAYTIMER
+
+#ifdef TOU_SCHEDULE
+static int8_t rapiSU(RapiCmdCtx *c) // time of Use schedule
+{
+  if (c->argc == 0) {
+    g_DelayTimer.IsInAwakeTimeInterval(); // compile if stale
+    c->putU32(g_DelayTimer.IsAwake());
+    c->putU32(g_DelayTimer.GetTouAmps());
+    c->putU32(g_DelayTimer.GetWaitMins());
+    return 0;
+  }
+
+  uint8_t idx = c->arg[0].u8;
+  if (idx >= TOU_MAX_WINDOWS) return 1;
+  TOU_WINDOW win;
+  if (c->argc == 5) {
+    win.days = c->arg[1].u8;
+    win.start = c->arg[2].u8;
+    win.stop = c->arg[3].u8;
+    win.amps = c->arg[4].u8;
+    if (g_DelayTimer.SetWindow(idx,&win)) return 1;
+    if (win.days) g_DelayTimer.Enable();
+  }
+  else if (c->argc != 1) return 1;
+
+  g_DelayTimer.GetWindow(idx,&win);
+  c->putU32(win.days);
+  c->putU32(win.start);
+  c->putU32(win.stop);
+  c->putU32(win.amps);
+  return 0;
+}
+#endif // TOU_SCHEDULE
+
+#if defined(KWH_RECORDING) && !defined(VOLTMETER)
+static int8_t rapiSV(RapiCmdCtx *c) // set voltage
+{
+  g_EvseController.SetMV(c->arg[0].u32);
+  return 0;
+}
+#endif //defined(KWH_RECORDING) && !defined(VOLTMETER)
+
+#ifdef CURRENT_RAMP
+static int8_t rapiSW(RapiCmdCtx *c) // sleW rate
+{
+  if (c->argc) {
+    g_EvseController.SetRampRate(c->arg[0].u8);
+  }
+  c->putU32(g_EvseController.GetRampRate());
+  c->putU32(g_EvseController.Ramping());
+  c->putU32(g_EvseController.GetPilotDa());
+  c->putU32(g_EvseController.GetSetpointDa());
+  return 0;
+}
+#endif // CURRENT_RAMP
+
+#ifdef EXT_SETPOINT
+static int8_t rapiSX(RapiCmdCtx *c) // eXternal setpoint
+{
+  int8_t rc = 0;
+  if (c->argc == 2) return 1;
+  if (c->argc == 3) {
+    g_EvseController.SetExtWatchdog(c->arg[1].u16,c->arg[2].u16);
+  }
+  if (c->argc) {
+    rc = g_EvseController.SetExtSetpointDa(c->arg[0].u16);
+    c->setNak(rc);
+  }
+  c->putU32(g_EvseController.GetExtSetpointDa());
+  c->putU32(g_EvseController.GetPilotDa());
+  c->putU32(g_EvseController.ExtSetpointExpired());
+  return rc;
+}
+#endif // EXT_SETPOINT
+
+#ifdef HEARTBEAT_SUPERVISION
+static int8_t rapiSY(RapiCmdCtx *c) // HEARTBEAT SUPERVISION
+{
+  int8_t rc;
+  if (c->argc == 0) { //This is a heartbeat
+    rc = g_EvseController.HsPulse(); //pet the dog
+  }
+  else if (c->argc == 2) { //This is a full HEARTBEAT_SUPERVISION setpoint command with both parameters
+    rc = 0;
+    // arg[0] = HS Interval in seconds.  0 = disabled
+    // arg[1] = HS fallback current, in amperes
+    if (c->arg[0].u16 == 0) { //Test for deactivation
+      rc = g_EvseController.HsRestoreAmpacity();
+    }
+    rc |= g_EvseController.HeartbeatSupervision(c->arg[0].u16,c->arg[1].u8);
+  }
+  else { //This is a command to ack a heartbeat supervision miss
+    rc = g_EvseController.HsAckMissedPulse(c->arg[0].u8); //Magic cookie
+  }
+  c->setNak(rc);
+  rapiGY(c);
+  return rc;
+}
+#endif //HEARTBEAT_SUPERVISION
+
+#if defined(RAPI_T_COMMANDS) && defined(FAKE_CHARGING_CURRENT)
+static int8_t rapiT0(RapiCmdCtx *c) // set fake charging current
+{
+  g_EvseController.SetChargingCurrent(c->arg[0].u32*1000);
+  g_OBD.SetAmmeterDirty(1);
+  g_OBD.Update(OBD_UPD_FORCE);
+  return 0;
+}
+#endif // RAPI_T_COMMANDS && FAKE_CHARGING_CURRENT
+
+#if defined(RELAY_HOLD_DELAY_TUNING)
+static int8_t rapiZ0(RapiCmdCtx *c) // set relayCloseMs
+{
+  uint8_t closems = c->arg[0].u8;
+  uint8_t holdpwm = c->arg[1].u8;
+  g_EvseController.setPwmPinParms(closems,holdpwm);
+  sprintf(g_sTmp,"\nZ0 %u %u",(unsigned)closems,(unsigned)holdpwm);
+  Serial.println(g_sTmp);
+  EeWriteByte(EOFS_RELAY_CLOSE_MS,closems);
+  EeWriteByte(EOFS_RELAY_HOLD_PWM,holdpwm);
+  return 0;
+}
 #endif // RELAY_HOLD_DELAY_TUNING
 
-  default:
-    ; // do nothing
+
+#define RAPI_HANDLER(h) h
+#include "rapi_cmdtab.h"
+
+static int8_t rapiGL(RapiCmdCtx *c) // get command list
+{
+  uint8_t idx = c->argc ? c->arg[0].u8 : 0;
+  c->putU32(RAPI_CMD_CNT);
+  if (idx < RAPI_CMD_CNT) c->field();
+  for (uint8_t i=0;(i < RAPI_LIST_PAGE) && (idx < RAPI_CMD_CNT);i++,idx++) {
+    c->put(pgm_read_byte(&g_RapiCmds[idx].name[0]));
+    c->put(pgm_read_byte(&g_RapiCmds[idx].name[1]));
+  }
+  return 0;
+}
+
+// binary search g_RapiCmds for token
+// return 1=found and copied to cmd, 0=not found
+int8_t EvseRapiProcessor::findCmd(const char *token,RAPI_CMD *cmd)
+{
+  return rapiFindCmd(g_RapiCmds,RAPI_CMD_CNT,token,cmd);
+}
+
+uint8_t g_inRapiCommand = 0;
+int EvseRapiProcessor::processCmd()
+{
+  g_inRapiCommand = 1;
+
+  int rc = -1;
+
+#ifdef RAPI_SENDER
+  // responses to commands that we sent
+  if (isRespToken()) {
+    processResp();
+    reset();
+    g_inRapiCommand = 0;
+    return rc;
   }
+#endif // RAPI_SENDER
 
-  if (bufCnt != -1){
-    response((rc == 0) ? 1 : 0);
+  curReceivedSeqId = INVALID_SEQUENCE_ID;
+  const char *seqtoken = tokens[tokenCnt-1];
+  if ((tokenCnt > 1) && (*seqtoken == ESRAPI_SOS)) {
+    curReceivedSeqId = htou8(++seqtoken);
+    tokenCnt--;
   }
 
+  RAPI_CMD cmd;
+  RapiCmdCtx ctx(this,&tokens[1],tokenCnt-1);
+  if (findCmd(tokens[0],&cmd) &&
+      !ctx.decode(cmd.argFmt,cmd.minArgs)) {
+    rc = (*cmd.handler)(&ctx);
+  }
+
+  // handlers which output fields have already started the response
+  if (!ctx.isStarted()) {
+    responseStart((rc == 0) ? 1 : 0);
+  }
+  responseEnd();
+
   reset();
 
   g_inRapiCommand = 0;
@@ -855,51 +1292,108 @@ int EvseRapiProcessor::processCmd()
   return rc;
 }
 
-// append
-void EvseRapiProcessor::appendChk(char *buf)
+void EvseRapiProcessor::wrStr_P(const char *s)
 {
-  char *s = buf;
-  uint8_t chk = 0;
-  while (*s) {
-    chk ^= *(s++);
+  char c;
+  while ((c = pgm_read_byte(s++))) wrByte(c);
+}
+
+// unsigned decimal
+void EvseRapiProcessor::wrDec(uint32_t u)
+{
+  char d[10];
+  uint8_t n = 0;
+  do {
+    d[n++] = '0' + (u % 10);
+    u /= 10;
+  } while (u);
+  while (n) wrByte(d[--n]);
+}
+
+// digits=0 -> no leading zeros
+// alpha = 'a' for lowercase, 'A' for uppercase
+void EvseRapiProcessor::wrHex(uint16_t u,uint8_t digits,char alpha)
+{
+  int8_t nib = 3;
+  if (!digits) {
+    while ((nib > 0) && !(u >> (nib*4))) nib--;
+  }
+  else {
+    nib = digits-1;
+  }
+  for (;nib >= 0;nib--) {
+    uint8_t h = (u >> (nib*4)) & 0xf;
+    wrByte((h < 10) ? ('0' + h) : (alpha - 10 + h));
   }
-  sprintf(s,"^%02X",(unsigned)chk);
-  s[3] = ESRAPI_EOC;
-  s[4] = '\0';
 }
 
+void EvseRapiProcessor::wrSequenceId(uint8_t seqId)
+{
+  wrByte(' ');
+  wrByte(ESRAPI_SOS);
+  wrHex(seqId,2,'A');
+}
 
-void EvseRapiProcessor::response(uint8_t ok)
+// append checksum and EOC - checksum chars are not included in the checksum
+void EvseRapiProcessor::wrEnd()
+{
+  uint8_t chk = wrChk;
+  write('^');
+  for (int8_t nib=1;nib >= 0;nib--) {
+    uint8_t h = (chk >> (nib*4)) & 0xf;
+    write((uint8_t)((h < 10) ? ('0' + h) : ('A' - 10 + h)));
+  }
+  write(ESRAPI_EOC);
+}
+
+void EvseRapiProcessor::responseStart(uint8_t ok)
 {
   writeStart();
+  wrBegin();
+  wrByte(ok ? 'O' : 'N');
+  wrByte('K');
+}
 
-  sprintf(g_sTmp,"%c%s",ESRAPI_SOC,ok ? "OK" : "NK");
-  if (bufCnt) {
-    strcat(g_sTmp," ");
-    strcat(g_sTmp,buffer);
-  }
+void EvseRapiProcessor::responseEnd()
+{
   if (curReceivedSeqId != INVALID_SEQUENCE_ID) {
-    appendSequenceId(g_sTmp,curReceivedSeqId);
+    wrSequenceId(curReceivedSeqId);
   }
-  appendChk(g_sTmp);
-  write(g_sTmp);
+  wrEnd();
   if (echo) write('\n');
 
   writeEnd();
 }
 
-void EvseRapiProcessor::appendSequenceId(char *s,uint8_t seqId)
-{
-  sprintf(s+strlen(s)," %c%02X",ESRAPI_SOS,seqId);
-}
-
 #ifdef RAPI_SENDER
+// skips INVALID_SEQUENCE_ID and ids which are still in flight
 uint8_t EvseRapiProcessor::getSendSequenceId()
 {
-  if (++curSentSeqId == INVALID_SEQUENCE_ID) ++curSentSeqId;
+  do {
+    if (++curSentSeqId == INVALID_SEQUENCE_ID) ++curSentSeqId;
+  } while (findPending(curSentSeqId));
   return curSentSeqId;
 }
 
+RAPI_PENDING *EvseRapiProcessor::findPending(uint8_t seqId)
+{
+  if (seqId != INVALID_SEQUENCE_ID) {
+    for (uint8_t i=0;i < RAPIS_MAX_PENDING;i++) {
+      if (pending[i].seqId == seqId) return &pending[i];
+    }
+  }
+  return NULL;
+}
+
+uint8_t EvseRapiProcessor::pendingCnt()
+{
+  uint8_t cnt = 0;
+  for (uint8_t i=0;i < RAPIS_MAX_PENDING;i++) {
+    if (pending[i].seqId != INVALID_SEQUENCE_ID) cnt++;
+  }
+  return cnt;
+}
+
 int8_t EvseRapiProcessor::isAsyncToken()
 {
   if ((*tokens[0] == 'A') ||
@@ -925,86 +1419,94 @@ int8_t EvseRapiProcessor::isRespToken()
   }
 }
 
+// match a received $OK/$NK against the in-flight table and fire its callback
+// responses we aren't expecting, e.g. ones that already timed out, are dropped
+void EvseRapiProcessor::processResp()
+{
+  const char *seqtoken = tokens[tokenCnt-1];
+  if ((tokenCnt > 1) && (*seqtoken == ESRAPI_SOS)) {
+    RAPI_PENDING *p = findPending(htou8(++seqtoken));
+    if (p) {
+      RapiRespCallback callback = p->callback;
+      uint8_t seqId = p->seqId;
+      // free the slot first, so the callback can send another command
+      p->seqId = INVALID_SEQUENCE_ID;
+      if (callback) {
+	(*callback)(seqId,(*tokens[0] == 'O') ? 0 : 1,tokenCnt-2,&tokens[1]);
+      }
+    }
+  }
+}
 
-void EvseRapiProcessor::_sendCmd(const char *cmdstr)
+void EvseRapiProcessor::checkPendingTimeouts()
+{
+  uint16_t msnow = millis();
+  for (uint8_t i=0;i < RAPIS_MAX_PENDING;i++) {
+    RAPI_PENDING *p = &pending[i];
+    if ((p->seqId != INVALID_SEQUENCE_ID) &&
+	((uint16_t)(msnow - p->msSent) >= RAPIS_TIMEOUT_MS)) {
+      RapiRespCallback callback = p->callback;
+      uint8_t seqId = p->seqId;
+      p->seqId = INVALID_SEQUENCE_ID;
+      if (callback) (*callback)(seqId,-1,0,NULL);
+    }
+  }
+}
+
+void EvseRapiProcessor::_sendCmd(const char *cmdstr,uint8_t seqId)
 {
-  *sendbuf = ESRAPI_SOC;
-  strcpy(sendbuf+1,cmdstr);
-  appendSequenceId(sendbuf,getSendSequenceId());
-  appendChk(sendbuf);
   writeStart();
-  write(sendbuf);
+  wrBegin();
+  wrStr(cmdstr);
+  wrSequenceId(seqId);
+  wrEnd();
   writeEnd();
 }
 
-int8_t EvseRapiProcessor::receiveResp(unsigned long msstart)
+// send a command without waiting for the response
+// cmdstr: command without SOC, e.g. "GS" or "SC 16"
+// callback: called from doCmd() when the response arrives or times out
+//  can be NULL
+// return: sequence id of the command, INVALID_SEQUENCE_ID if too many
+//  commands are already in flight
+uint8_t EvseRapiProcessor::sendCmdAsync(const char *cmdstr,RapiRespCallback callback)
 {
-  tokenCnt = 0;
-  *sendbuf = 0;
-  int bufpos = 0;
-
-  // wait for response
-  do {
-    WDT_RESET();
-    int bytesavail = available();
-    if (bytesavail) {
-      for (int i=0;i < bytesavail;i++) {
-	char c = read();
-
-	if (!bufpos && c != ESRAPI_SOC) {
-	  // wait for start character
-	  continue;
-	}
-	else if (c == ESRAPI_EOC) {
-	  sendbuf[bufpos] = '\0';
-	  if (!tokenize(sendbuf)) return 0;
-	  else return 1;
-	  
-	}
-	else {
-	  sendbuf[bufpos++] = c;
-	  if (bufpos >= (RAPIS_BUFLEN-1)) return 2;
-	}
-      }
+  RAPI_PENDING *p = NULL;
+  for (uint8_t i=0;i < RAPIS_MAX_PENDING;i++) {
+    if (pending[i].seqId == INVALID_SEQUENCE_ID) {
+      p = &pending[i];
+      break;
     }
-  } while (!tokenCnt && ((millis() - msstart) < RAPIS_TIMEOUT_MS));
+  }
+  if (!p) return INVALID_SEQUENCE_ID;
 
-  return -1;
+  p->seqId = getSendSequenceId();
+  p->callback = callback;
+  p->msSent = millis();
+  _sendCmd(cmdstr,p->seqId);
+  return p->seqId;
 }
 
+static int8_t g_sendCmdRc;
+static void sendCmdCallback(uint8_t seqId,int8_t rc,int8_t argc,char **argv)
+{
+  g_sendCmdRc = rc;
+}
+
+// blocking send - waits up to RAPIS_TIMEOUT_MS for the response
+// incoming commands are processed while waiting
+// return: 0=$OK 1=$NK -1=timeout or too many commands in flight
 int8_t EvseRapiProcessor::sendCmd(const char *cmdstr)
 {
-  _sendCmd(cmdstr);
-
-  unsigned long msstart = millis();
- start:
-  while (receiveResp(msstart) > 0) WDT_RESET();
-  if (tokenCnt) {
-    uint8_t seqId = INVALID_SEQUENCE_ID;
-    const char *seqtoken = tokens[tokenCnt-1];
-    if ((tokenCnt > 1) && isRespToken() && (*seqtoken == ESRAPI_SOS)) {
-      seqId = htou8(++seqtoken);
-      tokenCnt--;
-    }
-    if (!strcmp(tokens[0],"OK")
-	&& (seqId == curSentSeqId)
-	) {
-      return 0;
-    }
-    else if (!strcmp(tokens[0],"NK")
-	     && (seqId == curSentSeqId)
-	     ) {
-      return 1;
-    }
-    else { // command or async notification received - process it
-      processCmd();
-      msstart = millis();
-      goto start;
-    }
-  }
-  else {
-    return -1;
+  uint8_t seqId = sendCmdAsync(cmdstr,sendCmdCallback);
+  if (seqId == INVALID_SEQUENCE_ID) return -1;
+
+  g_sendCmdRc = -1;
+  while (isPending(seqId)) {
+    WDT_RESET();
+    doCmd();
   }
+  return g_sendCmdRc;
 }
 
 #endif // RAPI_SENDER
@@ -1013,12 +1515,58 @@ int8_t EvseRapiProcessor::sendCmd(const char *cmdstr)
 #ifdef RAPI_SERIAL
 EvseSerialRapiProcessor::EvseSerialRapiProcessor()
 {
+  baud = SERIAL_BAUD;
+  nextBaud = 0;
+  baudTrialStartMs = 0;
 }
 
 void EvseSerialRapiProcessor::init()
 {
   EvseRapiProcessor::init();
 }
+
+// rates that are exact at 16MHz, plus the default
+static const uint32_t g_RapiBaudRates[] PROGMEM = { SERIAL_BAUD,250000,500000,1000000 };
+
+// schedule a baud rate change. takes effect after the current response
+// has been sent
+int8_t EvseSerialRapiProcessor::setBaud(uint32_t _baud)
+{
+  for (uint8_t i=0;i < sizeof(g_RapiBaudRates)/sizeof(g_RapiBaudRates[0]);i++) {
+    if (pgm_read_dword(&g_RapiBaudRates[i]) == _baud) {
+      nextBaud = _baud;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int EvseSerialRapiProcessor::doCmd()
+{
+  int rc = EvseRapiProcessor::doCmd();
+
+  if (nextBaud) {
+    Serial.flush(); // wait for $OK to go out at the old rate
+    prevBaud = baud;
+    baud = nextBaud;
+    nextBaud = 0;
+    Serial.begin(baud);
+    frameOk = 0;
+    baudTrialStartMs = millis() | 1;
+  }
+  else if (baudTrialStartMs) {
+    if (frameOk) {
+      baudTrialStartMs = 0; // peer is talking to us at the new rate
+    }
+    else if ((millis() - baudTrialStartMs) >= RAPI_BAUD_TIMEOUT_MS) {
+      baud = prevBaud;
+      Serial.begin(baud);
+      baudTrialStartMs = 0;
+    }
+  }
+
+  return rc;
+}
 #endif // RAPI_SERIAL
 
 
@@ -1030,12 +1578,108 @@ EvseI2cRapiProcessor::EvseI2cRapiProcessor()
 
 void EvseI2cRapiProcessor::init()
 {
+  rxHead = rxTail = rxFrameEnd = rxFrameCnt = rxDiscard = 0;
+#ifndef RAPI_I2C_MASTER_TX
+  txHead = txCommit = txTail = 0;
+  txFull = 0;
+#endif
+
   Wire.begin(RAPI_I2C_LOCAL_ADDR);
-  Wire.onReceive(receiveEvent);   // define the receive function for receiving data from master
+  // bypass Wire's slave callbacks. Wire shares its buffers w/ master mode,
+  // so they can get clobbered by our LCD/RTC I/O
+  twi_attachSlaveRxEvent(i2cRapiRxEvent);
+#ifndef RAPI_I2C_MASTER_TX
+  twi_attachSlaveTxEvent(i2cRapiTxEvent);
+#endif
 
   EvseRapiProcessor::init();
 }
 
+// TWI ISR - master wrote to us
+void EvseI2cRapiProcessor::rxIsr(uint8_t *data,int cnt)
+{
+  for (int i=0;i < cnt;i++) {
+    uint8_t c = data[i];
+    if (rxDiscard) {
+      if (c == ESRAPI_EOC) rxDiscard = 0;
+      continue;
+    }
+    uint8_t next = (rxHead + 1) & (RAPI_I2C_RXBUFLEN-1);
+    if (next == rxTail) {
+      // overflow - drop the partial frame
+      rxHead = rxFrameEnd;
+      if (c != ESRAPI_EOC) rxDiscard = 1;
+      continue;
+    }
+    rxBuf[rxHead] = c;
+    rxHead = next;
+    if (c == ESRAPI_EOC) {
+      rxFrameEnd = rxHead;
+      rxFrameCnt++;
+    }
+  }
+}
+
+// only report bytes once a complete frame has arrived
+int EvseI2cRapiProcessor::available()
+{
+  if (!rxFrameCnt) return 0;
+  AutoCriticalSection acs;
+  return (rxFrameEnd - rxTail) & (RAPI_I2C_RXBUFLEN-1);
+}
+
+int EvseI2cRapiProcessor::read()
+{
+  if (rxTail == rxHead) return -1;
+  uint8_t c = rxBuf[rxTail];
+  rxTail = (rxTail + 1) & (RAPI_I2C_RXBUFLEN-1);
+  if (c == ESRAPI_EOC) {
+    AutoCriticalSection acs;
+    rxFrameCnt--;
+  }
+  return c;
+}
+
+#ifndef RAPI_I2C_MASTER_TX
+// queue a byte for the remote master to read
+// if the queue is full, the rest of the message is dropped
+int EvseI2cRapiProcessor::write(uint8_t u8)
+{
+  if (txFull) return 0;
+  uint8_t next = (txHead + 1) & (RAPI_I2C_TXBUFLEN-1);
+  if (next == txTail) {
+    txFull = 1;
+    return 0;
+  }
+  txBuf[txHead] = u8;
+  txHead = next;
+  return 1;
+}
+
+// hand the message to txIsr(), or drop it whole if it didn't fit, so the
+// master never reads a truncated frame
+void EvseI2cRapiProcessor::writeEnd()
+{
+  if (txFull) txHead = txCommit;
+  else txCommit = txHead;
+}
+
+// TWI ISR - master is reading from us
+// always supply RAPI_I2C_TX_CHUNK bytes, padded w/ 0x00
+void EvseI2cRapiProcessor::txIsr()
+{
+  uint8_t chunk[RAPI_I2C_TX_CHUNK];
+  uint8_t i;
+  for (i=0;(i < RAPI_I2C_TX_CHUNK) && (txTail != txCommit);i++) {
+    chunk[i] = txBuf[txTail];
+    txTail = (txTail + 1) & (RAPI_I2C_TXBUFLEN-1);
+  }
+  for (;i < RAPI_I2C_TX_CHUNK;i++) {
+    chunk[i] = 0;
+  }
+  twi_transmit(chunk,RAPI_I2C_TX_CHUNK);
+}
+#endif // !RAPI_I2C_MASTER_TX
 
 #endif // RAPI_I2C
 
@@ -1058,8 +1702,8 @@ void RapiInit()
 #ifdef RAPI_I2C
   g_EIRP.init();
 #ifdef GPPBUGKLUDGE
-  static char g_rapiI2ClBuffer[ESRAPI_BUFLEN];
-  g_ESRP.setBuffer(g_rapiI2CBuffer);
+  static char g_rapiI2CBuffer[ESRAPI_BUFLEN];
+  g_EIRP.setBuffer(g_rapiI2CBuffer);
 #endif // GPPBUGKLUDGE
 #endif // RAPI_I2C
 }
@@ -1070,18 +1714,6 @@ void RapiDoCmd()
   g_ESRP.doCmd();
 #endif
 #ifdef RAPI_I2C
-  // kludge - delay below is needed when RapiDoCmd() is running in a tight loop
-  // such as during a hard fault. without the delay, I2C can't receive characters
-#define RDCDELAY 6
-#ifdef RDCDELAY
-  static unsigned long lastdocmd;
-  unsigned long msnow = millis();
-  if ((msnow-lastdocmd) < RDCDELAY) {
-    delay(RDCDELAY - (msnow-lastdocmd));
-  }
-  lastdocmd = msnow;
-#endif // RDCDELAY
-
   g_EIRP.doCmd();
 #endif // RAPI_I2C
 }
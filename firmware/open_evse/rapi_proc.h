@@ -171,7 +171,9 @@ S5 A|M|0|1 - Mennekes lock setting
    0 = unlock (valid only in manual mode)
    1 = lock (valid only in manual mode)
    n.b. requires MENNEKES_LOCK. manual mode is volatile - always boots in automatic mode
-SA currentscalefactor currentoffset - set ammeter settings
+SA currentscalefactor currentoffset [ch] - set ammeter settings
+ ch: current channel 0..AMMETER_CHANNELS-1, default 0
+   w/ MAINS_CT, ch AMMETER_CHANNELS is the mains CT
 SC amps [V|M]- set current capacity
  response:
    if amps < minimum current capacity, will set to minimum and return $NK ampsset
@@ -186,12 +188,36 @@ SC amps [V|M]- set current capacity
      to EEPROM. subsequent calls the $SC cannot exceed value set bye $SC M
      the value cannot be changed/erased via RAPI commands. Subsequent calls
      to $SC M will return $NK
+SD da [V] - set current capacity in Deciamps (0.1A)
+ same as SC, but w/ 0.1A resolution, and no M. only whole amps are saved
+ to EEPROM, so use V for fractional amps
+ response: $OK|$NK dasset
+   dasset: the resultant current capacity in 0.1A
+ the pilot resolves 0.0075A w/ PAFC_PWM, ~0.25A w/o, rounded down
+ $SD 165 V^57 - 16.5A, volatile
+SE Wh - set Energy (charge) limit to Wh
+ same as SH, but in Wh, so the limit can be a fraction of a kWh
+ Wh = 0 = cancel limit. max 255000
+ $SE 7500^10 - stop at 7.5kWh
+SG [amps] - get/set site (Grid) main breaker limit (requires MAINS_CT)
+ amps: site limit, 0 = disabled. saved to EEPROM
+ while connected, the current capacity is throttled so that the load
+ measured by the mains CT stays MAINS_MARGIN_DA under the limit. it can't
+ go below MIN_CURRENT_CAPACITY_J1772
+ response: $OK amps mainsma throttled
+   mainsma: site current measured by the mains CT in mA
+   throttled: 1 = current capacity is being limited
+ $SG^30 - get
+ $SG 100^21 - 100A main
 SH kWh - set cHarge limit to kWh
  NOTES:
   - allowed only when EV connected in State B or C
   - current session will stop when total kWh reached. the limit automatically
     gets cancelled when EV disconnected
   - temporarily disables delay timer until EV disconnected or limit reached
+  - when less than CHARGE_LIMIT_RAMP_SECS of charging at the present power
+    is left, the pilot is ramped down, so the EV reaches the limit at low
+    power
  response:
   $OK - accepted
   $NK - invalid EVSE state
@@ -202,13 +228,78 @@ SL 1|2|A  - set service level L1/L2/Auto
  $SL 2*15
  $SL A*24
 SM voltscalefactor voltoffset - set voltMeter settings
+SP [groupamps fallbackamps addr | 0] - get/set shared Power pool (requires DUOSHARE)
+ groupamps: capacity of the circuit shared by up to DUO_MAX_NODES EVSEs
+ fallbackamps: this EVSE's share when no peers are heard, <= groupamps
+ addr: this EVSE's address in the group's packets, 1-127, unique in the
+   group. packets are broadcast to the I2C general call address, so addr
+   is independent of the I2C slave address (RAPI_I2C_LOCAL_ADDR)
+ 0 = disable. saved to EEPROM
+ response: $OK groupamps fallbackamps addr peers limitda
+   peers: # of other EVSEs heard
+   limitda: current allotted to this EVSE in 0.1A
+ $SP^27 - get
+ $SP 40 20 1^30 - 40A circuit, 20A w/o peers, address 1
+ $SP 0^37 - disable
+SR [0|1] - get/set current Regulation (requires CURRENT_REGULATION)
+ 0 = disable, 1 = enable. saved to EEPROM
+ when enabled, the pilot is adjusted in State C so that the measured
+ charging current tracks the current capacity (or the charge limit ramp)
+ response: $OK enabled pilotda targetda
+   pilotda: current advertised by the pilot in 0.1A
+   targetda: current the EV should draw in 0.1A
+ $SR^25 - get
+ $SR 1^34 - enable
 ST starthr startmin endhr endmin - set timer
  $ST 0 0 0 0^23 - cancel timer
+SU [idx [days start stop amps]] - get/set time of Use schedule (requires TOU_SCHEDULE)
+ idx: window 0-7
+ days: bitmap, bit 0 = Sunday ... bit 6 = Saturday. 0 = delete window
+ start/stop: 15 minute slot of the day 0-95, i.e. hh*4 + mm/15
+ amps: current limit during the window, 0 = none
+ windows are saved to EEPROM. setting a window enables the delay timer
+ w/ no args, response: $OK awake amps waitmins
+   awake: 1 = in a window
+   amps: limit in effect, 0 = none
+   waitmins: minutes until the schedule is next evaluated
+ w/ idx, response: $OK days start stop amps
+ $SU^22 - get state
+ $SU 0^32 - get window 0
+ $SU 0 62 88 28 16^3B - window 0: Mon-Fri 22:00-07:00 at 16A
+ $SU 0 0 0 0 0^32 - delete window 0
 SV mv - Set Voltage for power calculations to mv millivolts
  $SV 223576 - set voltage to 223.576
  NOTES:
   - only available if VOLTMETER not defined and KWH_RECORDING defined
   - volatile - value is lost, and replaced with VOLTS_FOR_Lx at boot
+SW [rate] - get/set pilot sleW rate (requires CURRENT_RAMP)
+ rate: A/s, 0 = disabled. saved to EEPROM
+ in State C, the pilot is slewed toward the current capacity at rate
+ instead of stepped, starting from MIN_CURRENT_CAPACITY_J1772 when charging
+ starts. safety derates (temperature, mains, heartbeat fallback, shared
+ circuit) still cut the pilot at once
+ response: $OK rate ramping pilotda setpointda
+   ramping: 1 = pilot is being slewed
+   pilotda: current advertised by the pilot in 0.1A
+   setpointda: current the pilot is slewing toward in 0.1A
+ $SW^20 - get
+ $SW 5^35 - 5A/s
+ $SW 0^30 - disable
+SX [da [timeoutms fallbackda]] - set eXternal current setpoint (requires EXT_SETPOINT)
+ da: setpoint in 0.1A, 0 = none. the pilot is the lower of da and the
+   current capacity. volatile, and doesn't update the LCD or send $AT,
+   so a remote controller can send it several times per second
+ timeoutms fallbackda: watchdog. if no da is received for timeoutms, the
+   setpoint drops to fallbackda. timeoutms = 0 = no watchdog
+   default: EXT_SETPOINT_TIMEOUT_MS MIN_CURRENT_CAPACITY_J1772
+ w/ RAPI_I2C, da can also be written as a binary EXTSP_PKT
+ response: $OK da pilotda expired
+   pilotda: current advertised by the pilot in 0.1A
+   expired: 1 = watchdog expired
+ $SX^2F - get
+ $SX 125^39 - 12.5A
+ $SX 160 10000 60^0F - 16A, 6A if no update for 10s
+ $SX 0^3F - cancel setpoint
 SY heartbeatinterval hearbeatcurrentlimit
  Response includes heartbeatinterval hearbeatcurrentlimit hearbeattrigger
  hearbeattrigger: 0 - There has never been a missed pulse, 
@@ -245,10 +336,31 @@ G5 - get Mennekes settings
    Note: lock mode is also indicated by ECVF_MENNEKES_MANUAL
    n.b. requires MENNEKES_LOCK
 
-GA - get ammeter settings
+GA [ch] - get ammeter settings
+ ch: current channel 0..AMMETER_CHANNELS-1, default 0
+   w/ MAINS_CT, ch AMMETER_CHANNELS is the mains CT
  response: $OK currentscalefactor currentoffset
  $GA^22
 
+GB [cnt] - get load profile Buckets - requires LOAD_PROFILE
+ cnt: max # of intervals to return, default all. keep it small over I2C
+ response: $OK intervalmin start cnt hexdata
+ intervalmin - interval length in minutes
+ start - start time of the newest completed interval, RTC unixtime
+   (uptime in seconds if no RTC). interval n started at
+   start - n*intervalmin*60
+ cnt - # of intervals in hexdata
+ hexdata - cnt intervals, newest first, 12 hex digits each:
+   wwwwmmmmvvvv
+   wwww - Wh delivered
+   mmmm - max charging current in 0.1A
+   vvvv - average voltage while charging in 0.1V, 0 if not charging
+ intervals are aligned to the RTC, e.g. :00 :15 :30 :45. the interval
+ in progress at boot is partial
+ w/ LOAD_PROFILE_SPILL, up to LOAD_PROFILE_SPILL_CNT intervals are kept
+ in EEPROM across reboots, and intervals while powered off are all 0
+ $GB^21
+
 GC - get current capacity info
  response: $OK minamps hmaxamps pilotamps cmaxamps
  all values decimal
@@ -266,7 +378,8 @@ GD - get Delay timer
  $GD^27
 
 GE - get settings
- response: $OK amps(decimal) flags(hex)
+ response: $OK amps(decimal) flags(hex) da(decimal)
+ da: current capacity in 0.1A, see SD
  $GE^26
 
 GF - get fault counters
@@ -276,12 +389,14 @@ GF - get fault counters
 
 GG - get charging current and voltage
  response: $OK milliamps millivolts
+ w/ AMMETER_CHANNELS > 1, milliamps is the highest phase current
  AMMETER must be defined in order to get amps, otherwise returns -1 amps
  $GG^24
 
 GH - get cHarge limit
- response: $OK kWh
- kWh = 0 = no charge limit
+ response: $OK kWh Wh
+ kWh = 0 = no charge limit. rounded up if set w/ SE
+ Wh - limit in Wh
  $GH^2B
 
 GI - get MCU ID - requires MCU_ID_LEN to be defined
@@ -293,10 +408,31 @@ GI - get MCU ID - requires MCU_ID_LEN to be defined
 	unknown in 328P. The first 6 characters are ASCII, and the rest are
 	hexadecimal.
 
+GK state [clr] - get pilot histogram - requires PILOT_CLASSIFIER
+ state: 1=A 2=B 3=C 4=D
+ clr: 1 = clear the histogram after reading it
+ response: $OK base binwidth hexdata
+ base - ADC reading at the bottom of the first bin
+ binwidth - ADC counts per bin
+ hexdata - 16 bins, 4 hex digits each. counts of pilot readings taken
+   while in the state. readings outside the range are in the end bins.
+   the bins are halved when one fills up
+ $GK 2^3A - get State B histogram
+ $GK 3 1^2A - get State C histogram and clear it
+
 GM - get voltMeter settings
  response: $OK voltcalefactor voltoffset
  $GM^2E
 
+GN - get NVRAM (EEPROM) settings write stats - requires SETTINGS_CACHE
+ response: $OK changes writes pending
+ changes - # of setting writes that changed a value since boot
+ writes - # of bytes physically written to the EEPROM since boot
+ pending - 1 = changes not yet written to the EEPROM
+ n.b. changes are written after EES_QUIET_MS w/o further changes, or on
+   the next EVSE state change
+ $GN^2D
+
 GO get Overtemperature thresholds
  response: $OK ambientthresh irthresh
  thresholds are in 10ths of a degree Celcius
@@ -308,8 +444,36 @@ GP - get temPerature (v1.0.3+)
  tmp007temp - temperature from TMP007
  all temperatures are in 10th's of a degree Celcius
  if any temperature sensor is not installed, its return value is -2560
+ w/ TEMPERATURE_DERATE, the response also has: deratepct deratedda
+   deratepct: % of max current capacity allowed, 100 = not derated
+   deratedda: pilot limit in 0.1A, 0 = not derated
  $GP^33
 
+GQ - get per-phase current and energy - requires AMMETER_CHANNELS > 1
+ response: $OK ma1 .. maN ws1 .. wsN
+ ma1..maN - charging current of each phase in mA
+ ws1..wsN - Watt-seconds of each phase this charging session
+   (only w/ KWH_RECORDING)
+ N = AMMETER_CHANNELS. n.b. GG returns the highest phase current
+ $GQ^32
+
+GR idx - get session histoRy record - requires SESSION_LOG
+ idx: 0 = most recent session, 1 = the one before, ... SESSION_LOG_CNT-1
+ response: $OK seq start duration wh peakda avgdv reason
+ seq - session number, increments w/ each logged session
+ start - RTC unixtime when the EV was connected, 0 if no RTC
+ duration - seconds the EV was connected
+ wh - Wh delivered
+ peakda - peak charging current in 0.1A
+ avgdv - average voltage while charging in 0.1V
+ reason - why charging last stopped
+   0 = EV stopped or was unplugged, 1 = charge/time limit,
+   2 = sleep/disable by user, RAPI or delay timer, 3 = EVSE fault
+ $NK if there is no such record
+ only sessions where the relay closed are logged. to fetch new sessions,
+ read idx 0,1,... until a seq you already have
+ $GR 0^21
+
 GS - get state
  response: $OK evsestate elapsed pilotstate vflags
  evsestate(hex): EVSE_STATE_xxx
@@ -334,6 +498,42 @@ GV - get version
  ignore it, and test commands for compatibility, instead.
  $GV^35
 
+GW - get session poWer quality stats - requires POWER_QUALITY_STATS
+ response: $OK mindv maxdv avgdv minda maxda avgda sagcnt ocsecs
+ mindv maxdv avgdv - min/max/mean voltage in 0.1V
+ minda maxda avgda - min/max/mean charging current in 0.1A
+   (highest phase w/ AMMETER_CHANNELS > 1)
+ sagcnt - # of times voltage fell below PQ_SAG_PCT% of nominal
+ ocsecs - seconds current was above pilot amps + OVERCURRENT_THRESHOLD
+ stats cover the time the relay was closed during the current or last
+ session, and are reset when the EV is connected
+ $GW^34
+
+GX - get snapshot - state, settings, metering, counters and limits in one
+ response: $OK b64data
+ b64data - base64 of a 40 byte little endian record:
+   ofs len
+    0   1  version - currently 1. fields are only appended
+    1   1  evsestate (GS)
+    2   1  pilotstate (GS)
+    3   2  vflags (GS)
+    5   4  elapsed charge time, seconds (GS)
+    9   2  flags (GE)
+   11   1  current capacity, amps (GE)
+   12   4  charging current, mA, signed (GG)
+   16   4  voltage, mV, signed (GG)
+   20   4  session Watt-seconds (GU)
+   24   4  total Wh (GU)
+   28   1  GFI trip count (GF)
+   29   1  no ground trip count (GF)
+   30   1  stuck relay trip count (GF)
+   31   4  charge limit, Wh, 0 = none (GH)
+   35   1  time limit, 15 min increments, 0 = none (G3)
+   36   4  RTC unixtime, 0 if no RTC (GT)
+ fields for features that aren't compiled in are 0
+ decode w/ utils/rapi_snapshot. too long for a single I2C transfer
+ $GX^3B
+
 T commands for debugging only #define RAPI_T_COMMMANDS
 T0 amps - set fake charging current
  response: $OK
@@ -346,6 +546,45 @@ GY - Get Hearbeat Supervision Status
  1 - There was a missed pulse once, but it has since been acknkoledged. Ampacity has been successfully restored to max permitted 
  See SY above for worked expamples.
 
+GL [idx] - get list of supported commands
+ response: $OK cmdcnt cmds
+ cmdcnt(dec): total number of commands supported by this build
+ cmds: up to RAPI_LIST_PAGE concatenated 2-letter command names, starting at
+       index idx (default 0). page through the list by incrementing idx by
+       RAPI_LIST_PAGE until idx >= cmdcnt
+ $GL^2F
+ $GL 8 - fetch 2nd page
+
+RAPI_SENDER - sending commands to a peer
+ EvseRapiProcessor::sendCmdAsync() sends a command with a sequence id and
+ returns immediately. up to RAPIS_MAX_PENDING commands can be in flight.
+ the peer's $OK/$NK is matched by sequence id in doCmd(), which then calls
+ the command's RapiRespCallback. if no response arrives within
+ RAPIS_TIMEOUT_MS, the callback is called with rc=-1.
+ sendCmd() is a blocking wrapper around sendCmdAsync().
+
+RAPI_I2C - RAPI over I2C
+ the EVSE is an I2C slave at RAPI_I2C_LOCAL_ADDR. the remote master sends
+ commands by writing to it.
+ responses and asynchronous notifications are queued, and the remote master
+ fetches them by reading RAPI_I2C_TX_CHUNK bytes at a time from
+ RAPI_I2C_LOCAL_ADDR. 0x00 bytes are padding, and mean no more data is queued.
+ a message is only fetched once it has been queued whole. if it doesn't fit
+ in the RAPI_I2C_TXBUFLEN byte queue, the whole message is dropped
+ if RAPI_I2C_MASTER_TX is defined, the legacy behavior is used instead:
+ the EVSE becomes bus master and writes them to RAPI_I2C_REMOTE_ADDR
+
+SB baud - set serial baud rate (RAPI_SERIAL only)
+ baud: 115200|250000|500000|1000000
+ the response is sent at the old baud rate, and then the EVSE switches.
+ if no frame w/ a valid checksum is received at the new rate within
+ RAPI_BAUD_TIMEOUT_MS, the EVSE reverts to the old rate.
+ volatile - always boots at SERIAL_BAUD
+ $SB 1000000
+ response:
+  $OK - switching
+  $NK - unsupported baud rate
+
 Z0 FOR TESTING RELAY_AUTO_PWM_PIN ONLY
 Z0 closems holdpwm
    closems(dec) = # ms to apply DC to relay pin
@@ -357,7 +596,7 @@ Z0 closems holdpwm
 
 #ifdef RAPI
 
-#define RAPIVER "5.2.1"
+#define RAPIVER "5.3.0"
 
 #define WIFI_MODE_AP 0
 #define WIFI_MODE_CLIENT 1
@@ -370,11 +609,71 @@ Z0 closems holdpwm
 #define ESRAPI_MAX_ARGS 10
 // for RAPI_SENDER
 #define RAPIS_TIMEOUT_MS 500
-#define RAPIS_BUFLEN 20
+#define RAPIS_MAX_PENDING 4 // max # of in-flight commands
 
 #define INVALID_SEQUENCE_ID 0
 
+#include "rapi_cmd.h"
+#define RAPI_LIST_PAGE 8 // # of commands returned per $GL
+
+class EvseRapiProcessor;
+
+// per-command context passed to RAPI command handlers
+// decoded arguments are in arg[], raw tokens in argv[]
+// the response is streamed straight to the transport, so a handler must
+// finish any other I/O (e.g. I2C reads) before its first put*(), and
+// a handler which can fail must call setNak() before its first put*()
+class RapiCmdCtx {
+  uint8_t nak;
+  uint8_t started; // $OK/$NK already written
+public:
+  EvseRapiProcessor *rp;
+  char **argv;
+  int8_t argc;
+  UNION4B arg[RAPI_MAX_DEC_ARGS];
+
+  RapiCmdCtx(EvseRapiProcessor *_rp,char **_argv,int8_t _argc) {
+    rp = _rp;
+    argv = _argv;
+    argc = _argc;
+    nak = 0;
+    started = 0;
+  }
+  int8_t decode(const char *argFmt,uint8_t minArgs);
+
+  void setNak(uint8_t tf) { nak = tf; }
+  void start();
+  uint8_t isStarted() { return started; }
+
+  // response encoder - put*() start a new space separated field
+  void put(char c);
+  void putDec(uint32_t u);
+  void putHexDigits(uint16_t u,uint8_t digits,char alpha='a');
+  void field() { put(' '); }
+  void putU32(uint32_t u) { field(); putDec(u); }
+  void putI32(int32_t i);
+  void putHex(uint16_t u,uint8_t digits=0) { field(); putHexDigits(u,digits); }
+  void putBase64(const uint8_t *buf,uint8_t len);
+  void putChar(char c) { field(); put(c); }
+  void putStr_P(const char *s);
+};
+
+#ifdef RAPI_SENDER
+// called when the response to a command sent by sendCmdAsync() arrives,
+// or when it times out
+// rc: 0=$OK 1=$NK -1=timeout
+// argv[0..argc-1]: response parameters, valid only during the callback
+typedef void (*RapiRespCallback)(uint8_t seqId,int8_t rc,int8_t argc,char **argv);
+
+typedef struct rapi_pending {
+  uint8_t seqId; // INVALID_SEQUENCE_ID = free slot
+  uint16_t msSent; // low 16 bits of millis()
+  RapiRespCallback callback;
+} RAPI_PENDING;
+#endif // RAPI_SENDER
+
 class EvseRapiProcessor {
+  friend class RapiCmdCtx;
 #ifdef GPPBUGKLUDGE
   char *buffer;
 public:
@@ -387,11 +686,18 @@ private:
   char *tokens[ESRAPI_MAX_ARGS];
   int8_t tokenCnt;
   char echo;
+protected:
+  uint8_t frameOk; // set when a frame w/ valid checksum is received
+private:
   uint8_t curReceivedSeqId;
-  void appendSequenceId(char *s,uint8_t seqId);
+  uint8_t wrChk; // running XOR checksum of message being written
 #ifdef RAPI_SENDER
   uint8_t curSentSeqId;
+  RAPI_PENDING pending[RAPIS_MAX_PENDING];
+  RAPI_PENDING *findPending(uint8_t seqId);
   uint8_t getSendSequenceId();
+  void processResp();
+  void checkPendingTimeouts();
   int8_t isAsyncToken();
   int8_t isRespToken();
 #endif // RAPI_SENDER
@@ -409,14 +715,26 @@ private:
   }
 
   int tokenize(char *buf);
+  int8_t findCmd(const char *token,RAPI_CMD *cmd);
   int processCmd();
 
-  void response(uint8_t ok);
-  void appendChk(char *buf);
+  // streaming message writer - call between writeStart() and writeEnd()
+  // wrBegin() writes the SOC, wrEnd() appends ^xk and EOC
+  void wrByte(uint8_t c) { wrChk ^= c; write(c); }
+  void wrBegin() { wrChk = 0; wrByte(ESRAPI_SOC); }
+  void wrStr(const char *s) { while (*s) wrByte(*(s++)); }
+  void wrStr_P(const char *s);
+  void wrDec(uint32_t u);
+  void wrHex(uint16_t u,uint8_t digits,char alpha='a');
+  void wrSequenceId(uint8_t seqId);
+  void wrEnd();
+
+  void responseStart(uint8_t ok);
+  void responseEnd();
+  void response(uint8_t ok) { responseStart(ok); responseEnd(); }
   
 #ifdef RAPI_SENDER
-  char sendbuf[RAPIS_BUFLEN]; // input buffer
-  void _sendCmd(const char *cmdstr);
+  void _sendCmd(const char *cmdstr,uint8_t seqId);
 #endif // RAPI_SENDER
   
 public:
@@ -428,17 +746,28 @@ public:
   void setWifiMode(uint8_t mode); // WIFI_MODE_xxx
   void sendButtonPress(uint8_t long_press);
   void writeStr(const char *msg) { writeStart();write(msg);writeEnd(); }
+  void setEcho(uint8_t tf) { echo = tf; }
+  virtual int8_t setBaud(uint32_t baud) { return 1; } // unsupported
 
   virtual void init();
 
 #ifdef RAPI_SENDER
+  uint8_t sendCmdAsync(const char *cmdstr,RapiRespCallback callback);
+  uint8_t isPending(uint8_t seqId) { return findPending(seqId) ? 1 : 0; }
+  uint8_t pendingCnt();
   int8_t sendCmd(const char *cmdstr);
-  int8_t receiveResp(unsigned long msstart);
 #endif // RAPI_SENDER
 };
 
 #ifdef RAPI_SERIAL
+#define RAPI_BAUD_TIMEOUT_MS 2000 // revert if no valid frame at new baud rate
+
 class EvseSerialRapiProcessor : public EvseRapiProcessor {
+  uint32_t baud; // current baud rate
+  uint32_t prevBaud; // baud rate to revert to if trial fails
+  uint32_t nextBaud; // switch after the $SB response has been sent
+  unsigned long baudTrialStartMs; // 0 = not on trial
+
   int available() { return Serial.available(); }
   int read() { return Serial.read(); }
   int write(uint8_t u8) { return Serial.write(u8); }
@@ -447,6 +776,9 @@ class EvseSerialRapiProcessor : public EvseRapiProcessor {
 public:
   EvseSerialRapiProcessor();
   void init();
+  int doCmd();
+  int8_t setBaud(uint32_t _baud);
+  uint32_t getBaud() { return baud; }
 };
 
 extern EvseSerialRapiProcessor g_ESRP;
@@ -454,17 +786,63 @@ extern EvseSerialRapiProcessor g_ESRP;
 
 
 #ifdef RAPI_I2C
+// sizes must be powers of 2
+#define RAPI_I2C_RXBUFLEN 64
+#define RAPI_I2C_TX_CHUNK 16 // # bytes the remote master reads at a time
+#define RAPI_I2C_TXBUFLEN 128 // must hold the longest message, e.g. $GB w/ 8 buckets
+
+#ifdef EXT_SETPOINT
+// written by the remote master instead of $SX da. there's no response
+#define EXTSP_MAGIC 0xe5 // not ASCII, so it can't be mistaken for RAPI
+typedef struct extsp_pkt {
+  uint8_t magic; // EXTSP_MAGIC
+  uint16_t da; // setpoint in 0.1A, 0 = none
+  uint8_t chk; // XOR of the preceding bytes
+} __attribute__((packed)) EXTSP_PKT;
+#endif // EXT_SETPOINT
+
 class EvseI2cRapiProcessor : public EvseRapiProcessor {
-  int available() { return Wire.available(); }
-  int read() { return Wire.read(); }
+  // filled by rxIsr() from the TWI ISR
+  volatile uint8_t rxBuf[RAPI_I2C_RXBUFLEN];
+  volatile uint8_t rxHead;
+  volatile uint8_t rxTail;
+  volatile uint8_t rxFrameEnd; // rxHead after last EOC
+  volatile uint8_t rxFrameCnt; // # complete frames in rxBuf
+  volatile uint8_t rxDiscard; // overflowed - drop bytes until next EOC
+
+  int available();
+  int read();
+#ifdef RAPI_I2C_MASTER_TX
   void writeStart() { Wire.beginTransmission(RAPI_I2C_REMOTE_ADDR); }
   void writeEnd() { Wire.endTransmission(); }
   int write(uint8_t u8) { return Wire.write(u8); }
   int write(const char *str) { return Wire.write(str); }
+#else
+  // drained by txIsr() when the remote master reads from us
+  uint8_t txBuf[RAPI_I2C_TXBUFLEN];
+  uint8_t txHead;
+  volatile uint8_t txCommit; // txHead after last complete message
+  volatile uint8_t txTail;
+  uint8_t txFull; // current message didn't fit
+
+  void writeStart() { txFull = 0; }
+  void writeEnd();
+  int write(uint8_t u8);
+  int write(const char *str) {
+    int cnt = 0;
+    while (*str) cnt += write(*(str++));
+    return cnt;
+  }
+#endif // RAPI_I2C_MASTER_TX
 
 public:
   EvseI2cRapiProcessor();
   void init();
+  uint8_t frameReady() { return rxFrameCnt; }
+
+  // called from TWI ISR
+  void rxIsr(uint8_t *data,int cnt);
+  void txIsr();
 };
 
 extern EvseI2cRapiProcessor g_EIRP;
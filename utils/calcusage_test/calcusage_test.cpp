@@ -0,0 +1,148 @@
+// -*- C++ -*-
+/*
+ * Open EVSE EnergyMeter Golden Test
+ *
+ * Runs the EnergyMath.h integer energy arithmetic the way
+ * EnergyMeter::calcUsage() and EnergyMeter::endSession() do, over simulated
+ * charging sessions, and checks it against double precision integration of
+ * the same samples
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// usage: calcusage_test
+// build: g++ -O2 -Wall -Wextra -o calcusage_test calcusage_test.cpp
+// exits w/ 1 if any session is off by more than 1 mWs, or the lifetime
+// total by more than 1 Wh
+//
+// the pre-64-bit formula, mws = (mv/16) * (ma/4) / 15625 * dms, is run
+// alongside for comparison
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "../../firmware/open_evse/EnergyMath.h"
+
+// the EnergyMeter accumulator state
+struct METER {
+  uint64_t mwsSession;
+  uint32_t wattSeconds;
+  uint32_t nwsRem;
+  uint32_t mwsTotRem;
+  uint32_t whTot;
+};
+
+// as EnergyMeter::calcUsage()
+static void calcUsage(METER *m,uint32_t mv,uint32_t ma,uint32_t dms,int threephase)
+{
+  uint64_t nws = emNws(mv,ma,dms);
+  if (threephase) nws *= 3;
+  m->mwsSession += emDivRem(nws,EM_NWS_PER_MWS,&m->nwsRem);
+  m->wattSeconds = (uint32_t)(m->mwsSession / 1000);
+}
+
+// as EnergyMeter::endSession()
+static void endSession(METER *m)
+{
+  if (m->mwsSession) {
+    m->whTot += (uint32_t)emDivRem(m->mwsSession,EM_MWS_PER_WH,&m->mwsTotRem);
+  }
+}
+
+// as EnergyMeter::startSession()
+static void startSession(METER *m)
+{
+  m->mwsSession = 0;
+  m->wattSeconds = 0;
+  m->nwsRem = 0;
+}
+
+static uint32_t g_Seed = 12345;
+static uint32_t rnd(uint32_t lo,uint32_t hi)
+{
+  g_Seed = g_Seed * 1103515245UL + 12345UL;
+  return lo + (g_Seed >> 8) % (hi - lo + 1);
+}
+
+typedef struct scenario {
+  const char *name;
+  uint32_t maLo,maHi;
+  uint32_t dmsLo,dmsHi; // calcUsage() interval, incl loop jitter
+  uint32_t secs;
+  int threephase;
+} SCENARIO;
+
+static const SCENARIO g_Scenarios[] = {
+  { "6A  250ms",    5900,  6100, 251,  270, 8*3600, 0 },
+  { "16A 250ms",   15800, 16200, 251,  270, 8*3600, 0 },
+  { "32A 250ms",   31500, 32500, 251,  270, 8*3600, 0 },
+  { "80A 250ms",   79000, 80000, 251,  270, 8*3600, 0 },
+  { "32A 3ph",     31500, 32500, 251,  270, 8*3600, 1 },
+  { "32A 50ms",    31500, 32500,  51,   60, 2*3600, 0 },
+  { "32A 10ms",    31500, 32500,  11,   15, 1*3600, 0 },
+  { "16A 2s gaps", 15800, 16200, 251, 2000, 8*3600, 0 },
+  { "trickle",       100,   900, 251,  270, 1*3600, 0 },
+};
+#define SCENARIO_CNT (int)(sizeof(g_Scenarios)/sizeof(g_Scenarios[0]))
+
+int main()
+{
+  METER m = {};
+  double refTotMws = 0;
+  int errs = 0;
+
+  printf("%-12s %15s %12s %12s\n","session","ref mWs","err mWs","legacy err");
+  for (int s=0;s < SCENARIO_CNT;s++) {
+    const SCENARIO *sc = &g_Scenarios[s];
+    double refMws = 0;
+    uint64_t legacyMws = 0;
+    startSession(&m);
+    for (uint64_t ms=0;ms < (uint64_t)sc->secs*1000;) {
+      uint32_t mv = rnd(225000,245000);
+      uint32_t ma = rnd(sc->maLo,sc->maHi);
+      uint32_t dms = rnd(sc->dmsLo,sc->dmsHi);
+      ms += dms;
+
+      calcUsage(&m,mv,ma,dms,sc->threephase);
+      refMws += (double)mv * (double)ma * (double)dms * (sc->threephase ? 3 : 1) / 1e6;
+      uint32_t lmws = (mv/16) * (ma/4) / 15625 * dms;
+      if (sc->threephase) lmws *= 3;
+      legacyMws += lmws;
+    }
+    endSession(&m);
+    refTotMws += refMws;
+
+    double err = (double)m.mwsSession - refMws;
+    double lerr = (double)legacyMws - refMws;
+    // the integer sum is exact, so it can only trail by the <1 mWs remainder.
+    // allow for double rounding in the reference
+    int ok = (fabs(err) <= 1.0 + refMws*1e-12) &&
+      (m.wattSeconds == (uint32_t)(m.mwsSession / 1000));
+    printf("%-12s %15.0f %12.3f %12.0f%s\n",sc->name,refMws,err,lerr,ok ? "" : " FAIL");
+    if (!ok) errs++;
+  }
+
+  double refWh = refTotMws / 3600000.0;
+  int ok = fabs((double)m.whTot + m.mwsTotRem/3600000.0 - refWh) <= 1.0;
+  printf("lifetime: %u Wh + %u mWs, ref %.3f Wh%s\n",m.whTot,m.mwsTotRem,refWh,ok ? "" : " FAIL");
+  if (!ok) errs++;
+
+  printf(errs ? "FAILED\n" : "PASSED\n");
+  return errs ? 1 : 0;
+}
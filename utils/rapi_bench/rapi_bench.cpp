@@ -0,0 +1,314 @@
+// -*- C++ -*-
+/*
+ * Open EVSE RAPI Dispatch Benchmark
+ *
+ * Host-side timing of the table driven RAPI dispatch in rapi_proc.cpp
+ * (findCmd() binary search + RapiCmdCtx::decode()) against the nested
+ * switch + dtou32() dispatch it replaced
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// usage: rapi_bench [iterations]
+// build: g++ -O2 -o rapi_bench rapi_bench.cpp
+//
+// the table, decoder and lookup are the firmware's own, from rapi_cmd.h and
+// rapi_cmdtab.h, w/ PROGMEM access mapped to plain reads and every handler
+// mapped to one stand-in. all commands are compiled in, as in a full
+// featured build
+//
+// N.B. host timings only show the relative cost of the two dispatchers.
+// on the AVR, each binary search probe is 2 pgm_read_byte()s, and the
+// switch compiles to compare chains, so absolute numbers differ. the
+// flash used by the old switch can't be measured w/o avr-gcc, so only the
+// table side of the flash comparison is printed
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef unsigned char uint8;
+typedef unsigned short uint16;
+typedef signed char int8;
+typedef int int32;
+typedef unsigned int uint32;
+
+// host stand-ins for avr/pgmspace.h
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+// same layout as open_evse.h
+typedef union union4b {
+  int8_t i8;
+  uint8_t u8;
+  int16_t i16;
+  uint16_t u16;
+  int32_t i32;
+  uint32_t u32;
+  unsigned u;
+  int i;
+} UNION4B;
+
+#include "../../firmware/open_evse/rapi_cmd.h"
+
+#define ESRAPI_MAX_ARGS 10
+
+// the firmware's RapiCmdCtx, w/o the response encoder
+class RapiCmdCtx {
+public:
+  char **argv;
+  int8_t argc;
+  UNION4B arg[RAPI_MAX_DEC_ARGS];
+};
+
+// AVR sizeof(RAPI_CMD) - 16 bit pointers
+#define AVR_RAPI_CMD_SIZE 7
+
+volatile uint32 g_Sink;
+
+// stand-in handler. the real ones differ per command, but cost the same
+// under either dispatcher
+static int8_t rapiX(RapiCmdCtx *c)
+{
+  uint32 sum = 0;
+  for (int8 i=0;(i < c->argc) && (i < RAPI_MAX_DEC_ARGS);i++) sum += c->arg[i].u32;
+  g_Sink += sum;
+  return 0;
+}
+
+// every feature w/ RAPI commands
+#define AMMETER
+#define AMMETER_CHANNELS 3
+#define AUTH_LOCK
+#define BTN_MENU
+#define CHARGE_LIMIT
+#define CURRENT_RAMP
+#define CURRENT_REGULATION
+#define DELAYTIMER
+#define DUOSHARE
+#define ECVF_AMMETER_CAL
+#define EXT_SETPOINT
+#define FAKE_CHARGING_CURRENT
+#define HEARTBEAT_SUPERVISION
+#define KWH_RECORDING
+#define LCD16X2
+#define LOAD_PROFILE
+#define MAINS_CT
+#define MCU_ID_LEN 10
+#define MENNEKES_LOCK
+#define PILOT_CLASSIFIER
+#define POWER_QUALITY_STATS
+#define RAPI_SERIAL
+#define RAPI_T_COMMANDS
+#define RELAY_HOLD_DELAY_TUNING
+#define RGBLCD
+#define RTC
+#define SESSION_LOG
+#define SETTINGS_CACHE
+#define TEMPERATURE_MONITORING
+#define TEMPERATURE_MONITORING_NY
+#define TIME_LIMIT
+#define TOU_SCHEDULE
+#define VOLTMETER
+
+#define RAPI_HANDLER(h) rapiX
+#include "../../firmware/open_evse/rapi_cmdtab.h"
+
+// as EvseRapiProcessor::processCmd()
+int newDispatch(char **tokens,int8 tokenCnt)
+{
+  RAPI_CMD cmd;
+  RapiCmdCtx ctx;
+  ctx.argv = &tokens[1];
+  ctx.argc = tokenCnt-1;
+  if (rapiFindCmd(g_RapiCmds,RAPI_CMD_CNT,tokens[0],&cmd) &&
+      !rapiDecodeArgs(cmd.argFmt,cmd.minArgs,ctx.argv,ctx.argc,ctx.arg)) {
+    return (*cmd.handler)(&ctx);
+  }
+  return -1;
+}
+
+//
+// the pre-table dispatcher: nested switch on the 2 command characters,
+// each case converting its own arguments w/ dtou32(). commands added
+// since exist only in the table, so they aren't benchmarked
+//
+uint32 dtou32(const char *s)
+{
+  uint32 u = 0;
+  while (*s) {
+    u *= 10;
+    u += *(s++) - '0';
+  }
+  return u;
+}
+
+static int oldArgs(char **tokens,int8 tokenCnt,int8 n)
+{
+  if (tokenCnt < n+1) return -1;
+  uint32 sum = 0;
+  for (int8 i=1;i <= n;i++) sum += dtou32(tokens[i]);
+  g_Sink += sum;
+  return 0;
+}
+
+int oldDispatch(char **tokens,int8 tokenCnt)
+{
+  const char *s = tokens[0];
+  switch(*(s++)) {
+  case 'F':
+    switch(*s) {
+    case '0': case 'B': return oldArgs(tokens,tokenCnt,1);
+    case 'F':
+      if (tokenCnt != 3) return -1;
+      g_Sink += *tokens[1] + dtou32(tokens[2]);
+      return 0;
+    case 'P': return oldArgs(tokens,tokenCnt,2);
+    case '1': case 'D': case 'E': case 'R': case 'S': return 0;
+    }
+    break;
+  case 'S':
+    switch(*s) {
+    case '0': case '2': case '3': case '4':
+    case 'H': case 'K': case 'V':
+      return oldArgs(tokens,tokenCnt,1);
+    case '1': return oldArgs(tokens,tokenCnt,6);
+    case '5': case 'L':
+      if (tokenCnt != 2) return -1;
+      g_Sink += *tokens[1];
+      return 0;
+    case 'A': case 'M': return oldArgs(tokens,tokenCnt,2);
+    case 'C': return oldArgs(tokens,tokenCnt,1);
+    case 'T': return oldArgs(tokens,tokenCnt,4);
+    case 'Y': return oldArgs(tokens,tokenCnt,2);
+    }
+    break;
+  case 'G':
+    switch(*s) {
+    case 'A': case 'L':
+      return oldArgs(tokens,tokenCnt,tokenCnt-1);
+    case '0': case '3': case '4': case '5': case 'C': case 'D': case 'E':
+    case 'F': case 'G': case 'H': case 'I': case 'M': case 'O': case 'P':
+    case 'S': case 'T': case 'U': case 'V': case 'Y':
+      return 0;
+    }
+    break;
+  case 'T':
+    if (*s == '0') return oldArgs(tokens,tokenCnt,1);
+    break;
+  case 'Z':
+    if (*s == '0') return oldArgs(tokens,tokenCnt,2);
+    break;
+  }
+  return -1;
+}
+
+// a mix of what a WiFi module / load manager actually sends
+static const char *g_Cmds[] = {
+  "GS", "GG", "GE", "GP", "GU", "GC", "GV", "GF", "GT", "GH",
+  "SC 32", "SC 16 V", "SL 2", "FE", "FS", "FD", "SY 30 6", "GY",
+  "SH 12", "ST 22 0 6 30", "S1 26 10 19 12 0 0",
+  "FF E 0", "GL 8", "ZZ",
+};
+#define CMD_CNT (int)(sizeof(g_Cmds)/sizeof(g_Cmds[0]))
+
+struct TOKENIZED {
+  char buf[32];
+  char *tokens[ESRAPI_MAX_ARGS];
+  int8 tokenCnt;
+} g_Tok[CMD_CNT];
+
+static void tokenize(const char *cmd,TOKENIZED *t)
+{
+  strncpy(t->buf,cmd,sizeof(t->buf)-1);
+  t->tokenCnt = 0;
+  for (char *p = strtok(t->buf," ");p && (t->tokenCnt < ESRAPI_MAX_ARGS);p = strtok(NULL," ")) {
+    t->tokens[t->tokenCnt++] = p;
+  }
+}
+
+static double timeIt(int (*dispatch)(char **,int8),long iters)
+{
+  clock_t start = clock();
+  for (long n=0;n < iters;n++) {
+    for (int i=0;i < CMD_CNT;i++) {
+      dispatch(g_Tok[i].tokens,g_Tok[i].tokenCnt);
+    }
+  }
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc,char *argv[])
+{
+  long iters = (argc > 1) ? atol(argv[1]) : 200000;
+
+  // table must be sorted for the binary search
+  for (int i=1;i < (int)RAPI_CMD_CNT;i++) {
+    if (memcmp(g_RapiCmds[i-1].name,g_RapiCmds[i].name,2) >= 0) {
+      printf("g_RapiCmds not sorted at %c%c\n",g_RapiCmds[i].name[0],g_RapiCmds[i].name[1]);
+      return 1;
+    }
+  }
+
+  int errs = 0;
+  for (int i=0;i < CMD_CNT;i++) {
+    tokenize(g_Cmds[i],&g_Tok[i]);
+    int o = oldDispatch(g_Tok[i].tokens,g_Tok[i].tokenCnt);
+    int n = newDispatch(g_Tok[i].tokens,g_Tok[i].tokenCnt);
+    if (o != n) {
+      printf("mismatch: \"%s\" old=%d new=%d\n",g_Cmds[i],o,n);
+      errs++;
+    }
+  }
+
+  // warm up, then time each a few times and keep the best
+  double told = 1e9,tnew = 1e9;
+  for (int pass=0;pass < 3;pass++) {
+    double t = timeIt(oldDispatch,iters);
+    if (t < told) told = t;
+    t = timeIt(newDispatch,iters);
+    if (t < tnew) tnew = t;
+  }
+
+  double ncmds = (double)iters * CMD_CNT;
+  printf("%d commands x %ld iterations\n",CMD_CNT,iters);
+  printf("switch+dtou32:   %7.1f ns/cmd\n",told*1e9/ncmds);
+  printf("findCmd+decode:  %7.1f ns/cmd\n",tnew*1e9/ncmds);
+
+  // each binary search step halves the table
+  int maxProbes = 0;
+  for (int n=RAPI_CMD_CNT;n;n >>= 1) maxProbes++;
+  printf("%d table entries: max %d probes/lookup\n",(int)RAPI_CMD_CNT,maxProbes);
+
+  int schemaBytes = 0;
+  for (int i=0;i < (int)RAPI_CMD_CNT;i++) {
+    int j;
+    for (j=0;(j < i) && (g_RapiCmds[j].argFmt != g_RapiCmds[i].argFmt);j++);
+    if (j == i) schemaBytes += strlen(g_RapiCmds[i].argFmt) + 1;
+  }
+  printf("AVR PROGMEM: %d bytes table + %d bytes schemas\n",
+	 (int)RAPI_CMD_CNT*AVR_RAPI_CMD_SIZE,schemaBytes);
+
+  return errs ? 1 : 0;
+}
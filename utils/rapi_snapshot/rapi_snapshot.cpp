@@ -0,0 +1,151 @@
+// -*- C++ -*-
+/*
+ * Open EVSE RAPI Snapshot Decoder
+ *
+ * This program decodes the response to $GX
+ *
+ * This file is part of Open EVSE.
+
+ * Open EVSE is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+
+ * Open EVSE is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with Open EVSE; see the file COPYING.  If not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// usage: rapi_snapshot ["$OK b64data^xx"]
+// w/o an argument, reads responses from stdin, one per line
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned char uint8;
+typedef unsigned short uint16;
+typedef int int32;
+typedef unsigned int uint32;
+
+#define RSNAP_VERSION 1
+#define RSNAP_LEN 40 // version 1
+
+uint8 snap[256];
+int snapLen;
+
+int b64val(char c)
+{
+  if ((c >= 'A') && (c <= 'Z')) return c - 'A';
+  if ((c >= 'a') && (c <= 'z')) return c - 'a' + 26;
+  if ((c >= '0') && (c <= '9')) return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+// returns # of bytes decoded, -1 on error
+int decodeBase64(const char *s,uint8 *buf,int maxlen)
+{
+  int len = 0;
+  uint32 u = 0;
+  int bits = 0;
+  for (;*s && (*s != '=');s++) {
+    int v = b64val(*s);
+    if (v < 0) return -1;
+    u = (u << 6) | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (len == maxlen) return -1;
+      buf[len++] = (uint8)(u >> bits);
+    }
+  }
+  return len;
+}
+
+uint16 getU16(int ofs) { return snap[ofs] | (snap[ofs+1] << 8); }
+uint32 getU32(int ofs) { return getU16(ofs) | ((uint32)getU16(ofs+2) << 16); }
+
+// line: "$OK b64data^xx", "$OK b64data" or just "b64data"
+int decodeLine(char *line)
+{
+  char *s = strchr(line,'^');
+  if (s) {
+    // verify XOR checksum
+    uint8 chk = 0;
+    for (char *p=line;p < s;p++) chk ^= *p;
+    unsigned rchk;
+    if ((sscanf(s+1,"%2x",&rchk) != 1) || (rchk != chk)) {
+      printf("bad checksum\n");
+      return 1;
+    }
+    *s = '\0';
+  }
+  s = strtok(line," \r\n");
+  if (s && !strcmp(s,"$NK")) {
+    printf("$NK\n");
+    return 1;
+  }
+  if (s && !strcmp(s,"$OK")) {
+    s = strtok(NULL," \r\n");
+  }
+  if (!s) return 1;
+
+  snapLen = decodeBase64(s,snap,sizeof(snap));
+  if (snapLen < 1) {
+    printf("bad base64\n");
+    return 1;
+  }
+  if (snapLen < RSNAP_LEN) {
+    printf("short snapshot: %d bytes\n",snapLen);
+    return 1;
+  }
+  if (snap[0] > RSNAP_VERSION) {
+    // newer firmware - fields we know about are still at the same offsets
+    printf("version %u is newer than %u, extra fields ignored\n",(unsigned)snap[0],RSNAP_VERSION);
+  }
+
+  printf("version: %u\n",(unsigned)snap[0]);
+  printf("evsestate: %02x\n",(unsigned)snap[1]);
+  printf("pilotstate: %02x\n",(unsigned)snap[2]);
+  printf("vflags: %04x\n",(unsigned)getU16(3));
+  printf("elapsed: %u s\n",getU32(5));
+  printf("flags: %04x\n",(unsigned)getU16(9));
+  printf("currentcapacity: %u A\n",(unsigned)snap[11]);
+  printf("current: %d mA\n",(int32)getU32(12));
+  printf("voltage: %d mV\n",(int32)getU32(16));
+  printf("sessionws: %u Ws (%.3f kWh)\n",getU32(20),getU32(20)/3600000.0);
+  printf("whtot: %u Wh\n",getU32(24));
+  printf("gfitripcnt: %u\n",(unsigned)snap[28]);
+  printf("nogndtripcnt: %u\n",(unsigned)snap[29]);
+  printf("stuckrelaytripcnt: %u\n",(unsigned)snap[30]);
+  printf("chargelimit: %u Wh\n",getU32(31));
+  printf("timelimit: %u min\n",(unsigned)snap[35]*15);
+  printf("unixtime: %u\n",getU32(36));
+  return 0;
+}
+
+int main(int argc,char *argv[])
+{
+  char line[300];
+  if (argc > 1) {
+    strncpy(line,argv[1],sizeof(line)-1);
+    line[sizeof(line)-1] = '\0';
+    return decodeLine(line);
+  }
+
+  int rc = 0;
+  while (fgets(line,sizeof(line),stdin)) {
+    rc |= decodeLine(line);
+    printf("\n");
+  }
+  return rc;
+}